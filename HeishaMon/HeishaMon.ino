@@ -35,6 +35,7 @@
 
 #include "lwip/apps/sntp.h"
 #include "src/common/timerqueue.h"
+#include "src/common/writeframe.h"
 #include "src/common/stricmp.h"
 #include "src/common/log.h"
 #include "src/common/progmem.h"
@@ -44,6 +45,8 @@
 #include "decode.h"
 #include "commands.h"
 #include "rules.h"
+#include "mqtt.h"
+#include "mqtt5.h"
 #include "version.h"
 
 DNSServer dnsServer;
@@ -62,12 +65,24 @@ settingsStruct heishamonSettings;
 uint32_t neoPixelState = 0; //running neoPixelState
 bool inSetup; //bool to check if still booting
 bool sending = false; // mutex for sending data
-bool mqttcallbackinprogress = false; // mutex for processing mqtt callback
 
 bool extraDataBlockAvailable = false; // this will be set to true if, during boot, heishamon detects this heatpump has extra data block (like K and L series do)
 
-#define MQTTRECONNECTTIMER 30000 //it takes 30 secs for each mqtt server reconnect attempt
+#define MQTTRECONNECTMIN 2000 //first retry after a failed mqtt connect is within 2 secs
+#define MQTTRECONNECTMAX 300000 //retry time is doubled after each failed attempt up to 5 minutes
+#define MQTTCONNECTTIMEOUT 2000 //max millis to wait for the tcp connection to the mqtt server
 unsigned long lastMqttReconnectAttempt = 0;
+unsigned long mqttReconnectWait = 0; //millis to wait after lastMqttReconnectAttempt before the next attempt
+unsigned long mqttReconnectBackoff = MQTTRECONNECTMIN; //current max wait time, doubled after each failed attempt
+IPAddress mqttServerIP;
+uint8_t mqttSubscribeStep = 0;
+
+#define MQTT_STATE_DISCONNECTED 0
+#define MQTT_STATE_TCP 1
+#define MQTT_STATE_HANDSHAKE 2
+#define MQTT_STATE_SUBSCRIBE 3
+#define MQTT_STATE_CONNECTED 4
+uint8_t mqttState = MQTT_STATE_DISCONNECTED;
 
 unsigned long bootButtonNotPressed = 0;
 
@@ -99,6 +114,18 @@ byte data_length = 0;
 //for received proxied data
 char proxydata[MAXDATASIZE] = { '\0' };
 byte proxydata_length = 0;
+//which data blocks the proxy client is still waiting for (bit 0 = basic data, bit 1 = extra data)
+byte proxyPendingReply = 0;
+//proxy client statistics
+struct proxyStats_t {
+  unsigned long queries = 0; //read queries received from proxy client
+  unsigned long cachehits = 0; //queries answered directly from our data cache
+  unsigned long forcedpolls = 0; //queries which needed a fresh poll because our data was too old
+  unsigned long writes = 0; //write commands received from proxy client
+  unsigned long mergedwrites = 0; //write commands merged with an already buffered write
+  unsigned long forwarded = 0; //other messages forwarded to the heatpump
+  unsigned long badframes = 0; //bad header, length or checksum
+} proxyStats;
 //for the neopixel
 Adafruit_NeoPixel pixels(1, LEDPIN);
 #endif
@@ -107,13 +134,12 @@ Adafruit_NeoPixel pixels(1, LEDPIN);
 char actData[DATASIZE] = { '\0' };
 char actDataExtra[DATASIZE] = { '\0' };
 char actOptData[OPTDATASIZE]  = { '\0' };
+unsigned long actDataTime = 0; //millis() when actData was last received
+unsigned long actDataExtraTime = 0; //millis() when actDataExtra was last received
 
 // log message to sprintf to
 char log_msg[256];
 
-// mqtt topic to sprintf and then publish to
-char mqtt_topic[256];
-
 static int mqttReconnects = 0;
 
 // can't have too much in buffer due to memory shortage
@@ -133,15 +159,12 @@ static uint8_t cmdnrel = 0;
 
 // mqtt
 WiFiClient mqtt_wifi_client;
-PubSubClient mqtt_client;
+MQTT5Client mqtt_client;
 
 
 
 bool firstConnectSinceBoot = true; //if this is true there is no first connection made yet
 
-struct timerqueue_t **timerqueue = NULL;
-int timerqueue_size = 0;
-
 #ifdef ESP32
 #define ETH_TYPE        ETH_PHY_W5500
 #define ETH_ADDR         1
@@ -307,65 +330,144 @@ void check_wifi() {
 }
 
 
+// subscribe to one topic per call so a connect doesn't block the loop, returns false when all topics are subscribed
+bool mqtt_subscribe_step(uint8_t step) {
+  char topic[256];
+  switch (step) {
+    case 0: {
+        if (!heishamonSettings.opentherm) return true;
+        sprintf(topic, "%s/%s/#", heishamonSettings.mqtt_topic_base, mqtt_topic_opentherm_read);
+      } break;
+    case 1: {
+        sprintf(topic, "%s/%s/#", heishamonSettings.mqtt_topic_base, mqtt_topic_commands);
+      } break;
+    case 2: {
+        sprintf(topic, "%s/%s/#", heishamonSettings.mqtt_topic_base, mqtt_topic_gpio);
+      } break;
+    case 3: {
+        sprintf(topic, "%s/%s", heishamonSettings.mqtt_topic_base, mqtt_send_raw_value_topic);
+      } break;
+    case 4: { // connect to s0 topic to retrieve older watttotal from mqtt
+        if (!heishamonSettings.use_s0) return true;
+        sprintf_P(topic, PSTR("%s/%s/WatthourTotal/1"), heishamonSettings.mqtt_topic_base, mqtt_topic_s0);
+      } break;
+    case 5: {
+        if (!heishamonSettings.use_s0) return true;
+        sprintf_P(topic, PSTR("%s/%s/WatthourTotal/2"), heishamonSettings.mqtt_topic_base, mqtt_topic_s0);
+      } break;
+      //use this to receive valid heishamon raw data from other heishamon to debug this OT code
+//#define RAWDEBUG
+#ifdef RAWDEBUG
+    case 6: {
+        if (!heishamonSettings.listenonly) return true;
+        sprintf(topic, "panasonic_heat_pump/raw/data"); //subscribe to raw heatpump data over MQTT
+      } break;
+#endif
+    default: {
+        return false;
+      } break;
+  }
+  mqtt_client.subscribe(topic);
+  return true;
+}
+
+/*
+   Connecting is split in steps, one step per loop, so the loop keeps running:
+   resolve the server, open the tcp connection, do the mqtt handshake and
+   then subscribe to one topic each loop. Failed attempts wait a random
+   time within an exponential growing backoff, so a fleet of heishamons
+   doesn't reconnect all at the same moment after a broker restart.
+*/
 void mqtt_reconnect()
 {
   unsigned long now = millis();
-  if ((lastMqttReconnectAttempt == 0) || ((unsigned long)(now - lastMqttReconnectAttempt) > MQTTRECONNECTTIMER)) { //only try reconnect each MQTTRECONNECTTIMER seconds or on boot when lastMqttReconnectAttempt is still 0
-    lastMqttReconnectAttempt = now;
-    if (mqttReconnects == 0) {
-      log_message(_F("Connecting to mqtt server ..."));
-    } else {
-      log_message(_F("Reconnecting to mqtt server ..."));
-    }
-    char topic[256];
-    sprintf(topic, "%s/%s", heishamonSettings.mqtt_topic_base, mqtt_willtopic);
-    if (mqtt_client.connect(heishamonSettings.wifi_hostname, heishamonSettings.mqtt_username, heishamonSettings.mqtt_password, topic, 1, true, "Offline"))
-    {
-      mqttReconnects++;
-      if (heishamonSettings.opentherm) {
-        sprintf(topic, "%s/%s/#", heishamonSettings.mqtt_topic_base, mqtt_topic_opentherm_read);
-        mqtt_client.subscribe(topic);
-      }
-      sprintf(topic, "%s/%s/#", heishamonSettings.mqtt_topic_base, mqtt_topic_commands);
-      mqtt_client.subscribe(topic);
-      sprintf(topic, "%s/%s/#", heishamonSettings.mqtt_topic_base, mqtt_topic_gpio);
-      mqtt_client.subscribe(topic);      
-      sprintf(topic, "%s/%s", heishamonSettings.mqtt_topic_base, mqtt_send_raw_value_topic);
-      mqtt_client.subscribe(topic);
-      sprintf(topic, "%s/%s", heishamonSettings.mqtt_topic_base, mqtt_willtopic);
-      mqtt_client.publish(topic, "Online");
-      sprintf(topic, "%s/%s", heishamonSettings.mqtt_topic_base, mqtt_iptopic);
+  switch (mqttState) {
+    case MQTT_STATE_DISCONNECTED: {
+        if ((lastMqttReconnectAttempt != 0) && ((unsigned long)(now - lastMqttReconnectAttempt) < mqttReconnectWait)) {
+          return;
+        }
+        lastMqttReconnectAttempt = now;
+        if (mqttReconnects == 0) {
+          log_message(_F("Connecting to mqtt server ..."));
+        } else {
+          log_message(_F("Reconnecting to mqtt server ..."));
+        }
+        if (!WiFi.hostByName(heishamonSettings.mqtt_server, mqttServerIP)) {
+          log_message(_F("Could not resolve mqtt server!"));
+          mqtt_reconnect_failed();
+          return;
+        }
+        mqttState = MQTT_STATE_TCP;
+      } break;
+    case MQTT_STATE_TCP: {
 #ifdef ESP8266
-      mqtt_client.publish(topic, WiFi.localIP().toString().c_str(), true);
+        mqtt_wifi_client.setTimeout(MQTTCONNECTTIMEOUT);
+        if (!mqtt_wifi_client.connect(mqttServerIP, atoi(heishamonSettings.mqtt_port))) {
 #else
-      if (ETH.hasIP()) {
-        mqtt_client.publish(topic, ETH.localIP().toString().c_str(), true);
-      } else {
-        mqtt_client.publish(topic, WiFi.localIP().toString().c_str(), true);
-      }
+        if (!mqtt_wifi_client.connect(mqttServerIP, atoi(heishamonSettings.mqtt_port), MQTTCONNECTTIMEOUT)) {
 #endif
-
-      if (heishamonSettings.use_s0) { // connect to s0 topic to retrieve older watttotal from mqtt
-        sprintf_P(mqtt_topic, PSTR("%s/%s/WatthourTotal/1"), heishamonSettings.mqtt_topic_base, mqtt_topic_s0);
-        mqtt_client.subscribe(mqtt_topic);
-        sprintf_P(mqtt_topic, PSTR("%s/%s/WatthourTotal/2"), heishamonSettings.mqtt_topic_base, mqtt_topic_s0);
-        mqtt_client.subscribe(mqtt_topic);
-      }
-      if (mqttReconnects == 1) { //only resend all data on first connect to mqtt so a data bomb like and bad mqtt server will not cause a reconnect bomb everytime
-        if (heishamonSettings.use_1wire) resetlastalldatatime_dallas(); //resend all 1wire values to mqtt
-        resetlastalldatatime(); //resend all heatpump values to mqtt
-      }
-      //use this to receive valid heishamon raw data from other heishamon to debug this OT code
-//#define RAWDEBUG
-#ifdef RAWDEBUG
-      if ( heishamonSettings.listenonly) {
-        mqtt_client.subscribe((char*)"panasonic_heat_pump/raw/data"); //subscribe to raw heatpump data over MQTT
-      }
+          log_message(_F("Could not connect to mqtt server!"));
+          mqtt_reconnect_failed();
+          return;
+        }
+        mqttState = MQTT_STATE_HANDSHAKE;
+      } break;
+    case MQTT_STATE_HANDSHAKE: {
+        //tcp connection is already open so this only does the mqtt connect handshake
+        if (!mqtt_client.connect(heishamonSettings.wifi_hostname, heishamonSettings.mqtt_username, heishamonSettings.mqtt_password, mqtt_topic_by_id(MQTT_TOPIC_LWT), 1, true, "Offline")) {
+          sprintf_P(log_msg, PSTR("Mqtt server refused connection, state: %d"), mqtt_client.state());
+          log_message(log_msg);
+          mqtt_wifi_client.stop();
+          mqtt_reconnect_failed();
+          return;
+        }
+        mqttReconnects++;
+        mqttReconnectBackoff = MQTTRECONNECTMIN;
+        mqttSubscribeStep = 0;
+        mqttState = MQTT_STATE_SUBSCRIBE;
+        mqtt_publish_id(MQTT_TOPIC_LWT, "Online", false);
+#ifdef ESP8266
+        mqtt_publish_id(MQTT_TOPIC_IP, WiFi.localIP().toString().c_str(), true);
+#else
+        if (ETH.hasIP()) {
+          mqtt_publish_id(MQTT_TOPIC_IP, ETH.localIP().toString().c_str(), true);
+        } else {
+          mqtt_publish_id(MQTT_TOPIC_IP, WiFi.localIP().toString().c_str(), true);
+        }
 #endif
-    }
+      } break;
+    case MQTT_STATE_SUBSCRIBE: {
+        if (!mqtt_client.connected()) {
+          mqtt_reconnect_failed();
+        } else if (!mqtt_subscribe_step(mqttSubscribeStep++)) {
+          mqttState = MQTT_STATE_CONNECTED;
+          if (mqttReconnects == 1) { //only resend all data on first connect to mqtt so a data bomb like and bad mqtt server will not cause a reconnect bomb everytime
+            if (heishamonSettings.use_1wire) resetlastalldatatime_dallas(); //resend all 1wire values to mqtt
+            resetlastalldatatime(); //resend all heatpump values to mqtt
+          }
+        }
+      } break;
+    case MQTT_STATE_CONNECTED: {
+        if (!mqtt_client.connected()) {
+          log_message(_F("Lost MQTT connection!"));
+          mqttState = MQTT_STATE_DISCONNECTED;
+          lastMqttReconnectAttempt = 0; //first retry directly, backoff starts when that fails
+        }
+      } break;
   }
 }
 
+void mqtt_reconnect_failed() {
+  mqttState = MQTT_STATE_DISCONNECTED;
+  //wait a random time between half and the full backoff time
+  mqttReconnectWait = random(mqttReconnectBackoff / 2, mqttReconnectBackoff + 1);
+  sprintf_P(log_msg, PSTR("Retrying mqtt connection in %lu seconds"), mqttReconnectWait / 1000);
+  log_message(log_msg);
+  lastMqttReconnectAttempt = millis();
+  //next backoff is doubled, but not more than the max
+  mqttReconnectBackoff = (mqttReconnectBackoff * 2 > MQTTRECONNECTMAX) ? MQTTRECONNECTMAX : mqttReconnectBackoff * 2;
+}
+
 #ifdef ESP32
 void blinkNeoPixel(bool status) {
   if (status) {
@@ -397,16 +499,12 @@ void log_message(char* string)
   }
   if (heishamonSettings.logMqtt && mqtt_client.connected())
   {
-    char log_topic[256];
-    sprintf(log_topic, "%s/%s", heishamonSettings.mqtt_topic_base, mqtt_logtopic);
-
-    if (!mqtt_client.publish(log_topic, log_line)) {
+    if (!mqtt_publish_id(MQTT_TOPIC_LOG, log_line, false)) {
       if (heishamonSettings.logSerial1) {
         loggingSerial.print(millis());
         loggingSerial.print(F(": "));
-        loggingSerial.println(F("MQTT publish log message failed!"));
+        loggingSerial.println(F("MQTT log message dropped, queue is full!"));
       }
-      mqtt_client.disconnect();
     }
   }
   //send log message to websocket
@@ -430,16 +528,6 @@ void logHex(char *hex, byte hex_len) {
   }
 }
 
-void mqttPublish(char* topic, char* subtopic, char* value) {
-  mqttPublish(topic, subtopic, value, MQTT_RETAIN_VALUES);
-}
-
-void mqttPublish(char* topic, char* subtopic, char* value, bool retain) {
-  char mqtt_topic[256];
-  sprintf_P(mqtt_topic, PSTR("%s/%s/%s"), heishamonSettings.mqtt_topic_base, topic, subtopic);
-  mqtt_client.publish(mqtt_topic, value, retain);
-}
-
 
 
 byte calcChecksum(byte* command, int length) {
@@ -460,6 +548,44 @@ bool isValidReceiveChecksum(char* check_data, byte check_length) {
 }
 
 #ifdef ESP32
+bool proxyCacheValid(char *cache, unsigned long cachetime) {
+  if ((cache[0] != 0x71) || (cache[1] != 0xc8) || (cache[2] != 0x01)) { //we don't have data yet
+    return false;
+  }
+  if (heishamonSettings.proxyMaxAge == 0) { //no max age, always answer from cache
+    return true;
+  }
+  return ((unsigned long)(millis() - cachetime) <= (1000UL * heishamonSettings.proxyMaxAge));
+}
+
+void proxyAnswerQuery(byte block) {
+  char *cache = (block == 0x21) ? actDataExtra : actData;
+  unsigned long cachetime = (block == 0x21) ? actDataExtraTime : actDataTime;
+  byte pendingbit = (block == 0x21) ? 2 : 1;
+
+  proxyStats.queries++;
+  if (proxyCacheValid(cache, cachetime)) {
+    proxyStats.cachehits++;
+    proxySerial.write(cache, DATASIZE); //should contain valid checksum also
+  } else if ((proxyPendingReply & pendingbit) == 0) {
+    //our data is too old (or not there yet), poll the heatpump together with our own commands and answer when the data arrives
+    proxyStats.forcedpolls++;
+    proxyPendingReply |= pendingbit;
+    byte query[PANASONICQUERYSIZE];
+    memcpy(query, panasonicQuery, PANASONICQUERYSIZE);
+    query[3] = block;
+    pushCommandBuffer(query, PANASONICQUERYSIZE);
+  }
+}
+
+void proxyAnswerPending(byte block) {
+  byte pendingbit = (block == 0x21) ? 2 : 1;
+  if (proxyPendingReply & pendingbit) {
+    proxyPendingReply &= ~pendingbit;
+    proxySerial.write((block == 0x21) ? actDataExtra : actData, DATASIZE);
+  }
+}
+
 void readProxy()
 {
   int proxylen = 0;
@@ -469,64 +595,54 @@ void readProxy()
     if ((proxydata[0] != 0x71) and  (proxydata[0] != 0x31) and  (proxydata[0] != 0xF1)) { //wrong header received!
       log_message(_F("PROXY Received bad header. Ignoring this data!"));
       if (heishamonSettings.logHexdump) logHex(proxydata, proxylen);
+      proxyStats.badframes++;
       proxydata_length = 0;
       return; //return so this while loop does not loop forever if there happens to be a continous invalid data stream
     }
   }
-  //if ((proxylen > 0) && (proxydata_length == 0 )) proxy_totalreads++; //this is the start of a new read
   proxydata_length +=  proxylen;
   if (proxydata_length > 1 ) { //should have received length part of header now
     if ((proxydata_length > ( proxydata[1] + 3)) || (proxydata_length >= MAXDATASIZE)) {
-      sprintf_P(log_msg, PSTR("PROXY Received %i bytes proxy %i\n"), proxydata_length, proxydata[1]);
-      log_message(log_msg);
       log_message(_F("PROXY Received more data than header suggests! Ignoring this as this is bad data."));
-      proxydata_length = 0;
       if (heishamonSettings.logHexdump) logHex(proxydata, proxydata_length);
+      proxyStats.badframes++;
+      proxydata_length = 0;
       return;
     }
     if (proxydata_length == (proxydata[1] + 3)) { //we received all data (serial2_data[1] is header length field)
-      sprintf_P(log_msg, PSTR("PROXY Received %i bytes"), proxydata_length); log_message(log_msg);
       if (heishamonSettings.logHexdump) logHex(proxydata, proxydata_length);
       if (! isValidReceiveChecksum(proxydata,proxydata_length) ) {
         log_message(_F("PROXY Checksum received false!"));
+        proxyStats.badframes++;
         proxydata_length = 0; //for next attempt
         return;
-      }      
-      log_message(_F("PROXY Checksum and header received ok!"));
+      }
       if ((proxydata[0]==0x71 or proxydata[0]==0xF1) and proxydata_length == (PANASONICQUERYSIZE+1)) { //this is a query from cztaw on proxy port
-        if (proxydata[0]==0xf1) {  //this is a write query, just pass this message forward as new command
-          log_message(_F("PROXY received write query, copy message forward to heatpump"));
-          send_command((byte*)proxydata,proxydata_length-1); //strip CRC, will be calculated again in send_command
+        if (proxydata[0]==0xf1) {  //this is a write query, buffer it so it is merged with other pending write commands
+          proxyStats.writes++;
+          if (pushCommandBuffer((byte*)proxydata, proxydata_length-1) == 2) { //strip CRC, will be calculated again in send_command
+            proxyStats.mergedwrites++;
+          }
           //then just reply with the current settings, for read and write it is the same as the write is only acknowledged in the next read
           //so we just run to the next if statement
         }
-        if (proxydata[3] == 0x10) {
-          log_message(_F("PROXY requests basic data"));
-          if ((actData[0] == 0x71) && (actData[1] == 0xc8) && (actData[2] == 0x01)) { //don't answer if we don't have data
-            proxySerial.write(actData,DATASIZE); //should contain valid checksum also
-          }
-        } else if (proxydata[3] == 0x21 ) {
-          log_message(_F("PROXY requests extra data"));
-          if ((actDataExtra[0] == 0x71) && (actDataExtra[1] == 0xc8) && (actDataExtra[2] == 0x01)) { //don't answer if we don't have data
-            proxySerial.write(actDataExtra,DATASIZE); //should containt valid checksum also
-          }
+        if (proxydata[3] == 0x10 || proxydata[3] == 0x21) {
+          proxyAnswerQuery(proxydata[3]);
         } else {
           log_message(_F("PROXY has sent unknown query! Forwarding to heatpump!"));
-          send_command((byte *)proxydata, proxydata_length-1); //strip CRC from end as send_command wil recalculate it
+          proxyStats.forwarded++;
+          pushCommandBuffer((byte *)proxydata, proxydata_length-1); //strip CRC from end as send_command wil recalculate it
         }
-        proxydata_length = 0;
-        return;
       } else if (proxydata[0]==0x31) {
         log_message(_F("PROXY received startup message, forwarding to heatpump!"));
-        send_command((byte *)proxydata, proxydata_length-1); //strip CRC from end as send_command wil recalculate it
-        proxydata_length = 0;
-        return;
+        proxyStats.forwarded++;
+        pushCommandBuffer((byte *)proxydata, proxydata_length-1); //strip CRC from end as send_command wil recalculate it
       } else {
         log_message(_F("PROXY received unknown message, forwarding it to heatpump anyway!"));
-        send_command((byte *)proxydata, proxydata_length-1); //strip CRC from end as send_command wil recalculate it
-        proxydata_length = 0;
-        return;
+        proxyStats.forwarded++;
+        pushCommandBuffer((byte *)proxydata, proxydata_length-1); //strip CRC from end as send_command wil recalculate it
       }
+      proxydata_length = 0;
     }
   }
 }
@@ -575,22 +691,22 @@ bool readSerial()
 
       if (data_length == DATASIZE)  {  //receive a full data block
         if  (data[3] == 0x10) { //decode the normal data block
-          decode_heatpump_data(data, actData, mqtt_client, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
-          {
-            char mqtt_topic[256];
-            sprintf(mqtt_topic, "%s/raw/data", heishamonSettings.mqtt_topic_base);
-            mqtt_client.publish(mqtt_topic, (const uint8_t *)actData, DATASIZE, false); //do not retain this raw data
-          }
+          decode_heatpump_data(data, actData, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
+          actDataTime = millis();
+#ifdef ESP32
+          proxyAnswerPending(0x10);
+#endif
+          mqtt_publish_id(MQTT_TOPIC_RAW_DATA, (const uint8_t *)actData, DATASIZE, false); //do not retain this raw data
           data_length = 0;
           return true;
         } else if (data[3] == 0x21) { //decode the new model extra data block
           extraDataBlockAvailable = true; //set the flag to true so we know we can request this data always
-          decode_heatpump_data_extra(data, actDataExtra, mqtt_client, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
-          {
-            char mqtt_topic[256];
-            sprintf(mqtt_topic, "%s/raw/dataextra", heishamonSettings.mqtt_topic_base);
-            mqtt_client.publish(mqtt_topic, (const uint8_t *)actDataExtra, DATASIZE, false); //do not retain this raw data
-          }
+          decode_heatpump_data_extra(data, actDataExtra, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
+          actDataExtraTime = millis();
+#ifdef ESP32
+          proxyAnswerPending(0x21);
+#endif
+          mqtt_publish_id(MQTT_TOPIC_RAW_DATAEXTRA, (const uint8_t *)actDataExtra, DATASIZE, false); //do not retain this raw data
           data_length = 0;
           return true;
         } else {
@@ -606,7 +722,7 @@ bool readSerial()
       }
       else if (data_length == OPTDATASIZE ) { //optional pcb acknowledge answer
         log_message(_F("Received optional PCB ack answer. Decoding this in OPT topics."));
-        decode_optional_heatpump_data(data, actOptData, mqtt_client, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
+        decode_optional_heatpump_data(data, actOptData, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
         data_length = 0;
         return true;
       }
@@ -634,15 +750,44 @@ void popCommandBuffer() {
   }
 }
 
-void pushCommandBuffer(byte* command, int length) {
+/*
+   returns 0 if the buffer is full, 1 if the command is added to the buffer
+   and 2 if it is merged with a command which was already in the buffer
+*/
+byte pushCommandBuffer(byte* command, int length) {
+  bool write = (command[0] == 0xf1) && (length == PANASONICQUERYSIZE);
+  uint8_t last = MAXCOMMANDSINBUFFER;
+  for (uint8_t i = 0, x = cmdstart; i < cmdnrel; i++, x = (x + 1) % (MAXCOMMANDSINBUFFER)) {
+    if ((cmdbuffer[x].length != length) || (memcmp(cmdbuffer[x].data, command, 4) != 0)) {
+      continue;
+    }
+    if (write) {
+      last = x;
+      continue;
+    }
+    if (memcmp(cmdbuffer[x].data, command, length) == 0) {
+      //exactly the same query is already waiting in the buffer
+      return 2;
+    }
+  }
+  //write command, a zero byte means no change so merge it into the last buffered write
+  //unless they both change the same setting, then it has to follow as a separate write
+  if ((last != MAXCOMMANDSINBUFFER) && writeframe_merge(cmdbuffer[last].data, command, length)) {
+    return 2;
+  }
   if (cmdnrel + 1 > MAXCOMMANDSINBUFFER) {
     log_message(_F("Too much commands already in buffer. Ignoring this commands.\n"));
-    return;
+    return 0;
+  }
+  if (length > (int)sizeof(cmdbuffer[0].data)) {
+    log_message(_F("Command too long for buffer. Ignoring this command.\n"));
+    return 0;
   }
   cmdbuffer[cmdend].length = length;
   memcpy(&cmdbuffer[cmdend].data, command, length);
   cmdend = (cmdend + 1) % (MAXCOMMANDSINBUFFER);
   cmdnrel++;
+  return 1;
 }
 
 bool send_command(byte* command, int length) {
@@ -669,60 +814,72 @@ bool send_command(byte* command, int length) {
 }
 
 // Callback function that is called when a message has been pushed to one of your topics.
+// Only queues the message, it is handled from loop() by mqtt_process_message
 void mqtt_callback(char* topic, byte* payload, unsigned int length) {
-  if (mqttcallbackinprogress) {
-    log_message(_F("Already processing another mqtt callback. Ignoring this one"));
+  uint8_t type = 0;
+  const char* subtopic = "";
+  char* topic_command = topic + strlen(heishamonSettings.mqtt_topic_base) + 1; //strip base plus seperator from topic
+  if (strcmp(topic_command, mqtt_send_raw_value_topic) == 0) {
+    type = MQTT_IN_RAW;
+  } else if (strncmp(topic_command, mqtt_topic_s0, strlen(mqtt_topic_s0)) == 0) {
+    type = MQTT_IN_S0;
+    subtopic = topic_command + strlen(mqtt_topic_s0) + 15; //strip the first 17 "s0/WatthourTotal/" from the topic to get the s0 port
+  } else if (strncmp(topic_command, mqtt_topic_commands, strlen(mqtt_topic_commands)) == 0) {
+    type = MQTT_IN_COMMAND;
+    subtopic = topic_command + strlen(mqtt_topic_commands) + 1; //strip the first 9 "commands/" from the topic to get what we need
+#ifdef RAWDEBUG
+  } else if (strcmp((char*)"panasonic_heat_pump/raw/data", topic) == 0) {
+    type = MQTT_IN_RAWDATA;
+#endif
+  } else if (strncmp(topic_command, mqtt_topic_opentherm_read, strlen(mqtt_topic_opentherm_read)) == 0) {
+    type = MQTT_IN_OPENTHERM;
+    subtopic = topic_command + strlen(mqtt_topic_opentherm_read) + 1; //strip the opentherm subtopic from the topic
+  } else if (strncmp(topic_command, mqtt_topic_gpio, strlen(mqtt_topic_gpio)) == 0) {
+    type = MQTT_IN_GPIO;
+    subtopic = topic_command + strlen(mqtt_topic_gpio) + 1; //strip the gpio subtopic from the topic
+  } else {
+    return;
   }
-  else {
-    mqttcallbackinprogress = true; //simple semaphore to make sure we don't have two callbacks at the same time
-    char msg[length + 1];
-    for (unsigned int i = 0; i < length; i++) {
-      msg[i] = (char)payload[i];
-    }
-    msg[length] = '\0';
-    char* topic_command = topic + strlen(heishamonSettings.mqtt_topic_base) + 1; //strip base plus seperator from topic
-    if (strcmp(topic_command, mqtt_send_raw_value_topic) == 0)
-    { // send a raw hex string
-      byte *rawcommand;
-      rawcommand = (byte *) malloc(length);
-      memcpy(rawcommand, msg, length);
-
-      sprintf_P(log_msg, PSTR("sending raw value"));
-      log_message(log_msg);
-      send_command(rawcommand, length);
-      free(rawcommand);
-    } else if (strncmp(topic_command, mqtt_topic_s0, strlen(mqtt_topic_s0)) == 0)  // this is a s0 topic, check for watthour topic and restore it
-    {
-      char* topic_s0_watthour_port = topic_command + strlen(mqtt_topic_s0) + 15; //strip the first 17 "s0/WatthourTotal/" from the topic to get the s0 port
-      int s0Port = String(topic_s0_watthour_port).toInt();
-      float watthour = String(msg).toFloat();
-      restore_s0_Watthour(s0Port, watthour);
-      //unsubscribe after restoring the watthour values
-      char mqtt_topic[256];
-      sprintf(mqtt_topic, "%s", topic);
-      if (mqtt_client.unsubscribe(mqtt_topic)) {
-        log_message(_F("Unsubscribed from S0 watthour restore topic"));
-      }
-    } else if (strncmp(topic_command, mqtt_topic_commands, strlen(mqtt_topic_commands)) == 0)  // check for commands to heishamon
-    {
-      char* topic_sendcommand = topic_command + strlen(mqtt_topic_commands) + 1; //strip the first 9 "commands/" from the topic to get what we need
-      send_heatpump_command(topic_sendcommand, msg, send_command, log_message, heishamonSettings.optionalPCB);
+  if (!mqtt_inqueue_push(type, subtopic, payload, length)) {
+    sprintf_P(log_msg, PSTR("MQTT receive queue full or message too large, dropped message on %s"), topic);
+    log_message(log_msg);
+  }
+}
+
+void mqtt_process_message(uint8_t type, char* subtopic, char* msg, unsigned int length) {
+  switch (type) {
+    case MQTT_IN_RAW: { // send a raw hex string
+        log_message(_F("sending raw value"));
+        send_command((byte *)msg, length);
+      } break;
+    case MQTT_IN_S0: { // this is a s0 topic, restore the watthour value
+        int s0Port = String(subtopic).toInt();
+        float watthour = String(msg).toFloat();
+        restore_s0_Watthour(s0Port, watthour);
+        //unsubscribe after restoring the watthour values
+        char mqtt_topic[256];
+        sprintf_P(mqtt_topic, PSTR("%s/%s/WatthourTotal/%s"), heishamonSettings.mqtt_topic_base, mqtt_topic_s0, subtopic);
+        if (mqtt_client.unsubscribe(mqtt_topic)) {
+          log_message(_F("Unsubscribed from S0 watthour restore topic"));
+        }
+      } break;
+    case MQTT_IN_COMMAND: { // check for commands to heishamon
+        send_heatpump_command(subtopic, msg, send_command, log_message, heishamonSettings.optionalPCB);
+      } break;
     //use this to receive valid heishamon raw data from other heishamon to debug this OT code
 #ifdef RAWDEBUG
-    } else if (strcmp((char*)"panasonic_heat_pump/raw/data", topic) == 0) {  // check for raw heatpump input
-      sprintf_P(log_msg, PSTR("Received raw heatpump data from MQTT"));
-      log_message(log_msg);
-      decode_heatpump_data(msg, actData, mqtt_client, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
-      memcpy(actData, msg, DATASIZE);
+    case MQTT_IN_RAWDATA: { // check for raw heatpump input
+        log_message(_F("Received raw heatpump data from MQTT"));
+        decode_heatpump_data(msg, actData, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.updateAllTime);
+        memcpy(actData, msg, DATASIZE);
+      } break;
 #endif
-    } else if (strncmp(topic_command, mqtt_topic_opentherm_read, strlen(mqtt_topic_opentherm_read)) == 0)  {
-      char* topic_otcommand = topic_command + strlen(mqtt_topic_opentherm_read) + 1; //strip the opentherm subtopic from the topic
-      mqttOTCallback(topic_otcommand, msg);
-    } else if (strncmp(topic_command, mqtt_topic_gpio, strlen(mqtt_topic_gpio)) == 0)  {
-      char* topic_gpiocommand = topic_command + strlen(mqtt_topic_gpio) + 1; //strip the gpio subtopic from the topic
-      mqttGPIOCallback(topic_gpiocommand, msg);
-    }    
-    mqttcallbackinprogress = false;
+    case MQTT_IN_OPENTHERM: {
+        mqttOTCallback(subtopic, msg);
+      } break;
+    case MQTT_IN_GPIO: {
+        mqttGPIOCallback(subtopic, msg);
+      } break;
   }
 }
 
@@ -783,6 +940,10 @@ int8_t webserver_cb(struct webserver_t *client, void *dat) {
           client->route = 1;
           log_message(_F("Toggled hexdump log flag"));
           heishamonSettings.logHexdump ^= true;
+        } else if (strcmp_P((char *)dat, PSTR("/toggleruletrace")) == 0) {
+          client->route = 1;
+          log_message(_F("Toggled rules trace flag"));
+          ruleTrace ^= true;
         } else if (strcmp_P((char *)dat, PSTR("/hotspot-detect.html")) == 0 ||
                    strcmp_P((char *)dat, PSTR("/fwlink")) == 0 ||
                    strcmp_P((char *)dat, PSTR("/generate_204")) == 0 ||
@@ -862,43 +1023,23 @@ int8_t webserver_cb(struct webserver_t *client, void *dat) {
               memset(&cpy, 0, args->len + 1);
               snprintf((char *)&cpy, args->len + 1, "%.*s", args->len, args->value);
 
-              for (uint8_t x = 0; x < sizeof(commands) / sizeof(commands[0]); x++) {
-                cmdStruct tmp;
-                memcpy_P(&tmp, &commands[x], sizeof(tmp));
-                if (strcmp((char *)args->name, tmp.name) == 0) {
-                  len = tmp.func(cpy, cmd, log_msg);
-                  if ((client->userdata = realloc(client->userdata, strlen((char *)client->userdata) + strlen(log_msg) + 2)) == NULL) {
-                    loggingSerial.printf(PSTR("Out of memory %s:#%d\n"), __FUNCTION__, __LINE__);
-                    ESP.restart();
-                    exit(-1);
-                  }
-                  strcat((char *)client->userdata, log_msg);
-                  strcat((char *)client->userdata, "\n");
-                  log_message(log_msg);
-                  send_command(cmd, len);
+              uint8_t idx = find_command((char *)args->name, strlen((char *)args->name));
+              bool batch = (strcmp_P((char *)args->name, PSTR(BATCH_COMMAND)) == 0);
+              if (batch || (idx != COMMAND_UNKNOWN && (!(idx & COMMAND_OPTIONAL) || heishamonSettings.optionalPCB))) {
+                if (batch) {
+                  len = build_heatpump_batch(cpy, cmd, log_msg, heishamonSettings.optionalPCB);
+                } else {
+                  len = run_command(idx, cpy, cmd, log_msg);
                 }
-              }
-
-              memset(&cmd, 0, 256);
-              memset(&log_msg, 0, 256);
-
-              if (heishamonSettings.optionalPCB) {
-                //optional commands
-                for (uint8_t x = 0; x < sizeof(optionalCommands) / sizeof(optionalCommands[0]); x++) {
-                  optCmdStruct tmp;
-                  memcpy_P(&tmp, &optionalCommands[x], sizeof(tmp));
-                  if (strcmp((char *)args->name, tmp.name) == 0) {
-                    len = tmp.func(cpy, log_msg);
-                    if ((client->userdata = realloc(client->userdata, strlen((char *)client->userdata) + strlen(log_msg) + 2)) == NULL) {
-                      loggingSerial.printf(PSTR("Out of memory %s:#%d\n"), __FUNCTION__, __LINE__);
-                      ESP.restart();
-                      exit(-1);
-                    }
-                    strcat((char *)client->userdata, log_msg);
-                    strcat((char *)client->userdata, "\n");
-                    log_message(log_msg);
-                  }
+                if ((client->userdata = realloc(client->userdata, strlen((char *)client->userdata) + strlen(log_msg) + 2)) == NULL) {
+                  loggingSerial.printf(PSTR("Out of memory %s:#%d\n"), __FUNCTION__, __LINE__);
+                  ESP.restart();
+                  exit(-1);
                 }
+                strcat((char *)client->userdata, log_msg);
+                strcat((char *)client->userdata, "\n");
+                log_message(log_msg);
+                if (len > 0) send_command(cmd, len);
               }
             } break;
           case 110: {
@@ -1270,6 +1411,7 @@ void switchSerial() {
 }
 
 void setupMqtt() {
+  mqtt_client.setVersion5(heishamonSettings.mqtt5);
   mqtt_client.setClient(mqtt_wifi_client);
   mqtt_client.setBufferSize(1024);
   mqtt_client.setSocketTimeout(10); mqtt_client.setKeepAlive(5); //fast timeout, any slower will block the main loop too long
@@ -1360,6 +1502,9 @@ void timer_cb(int nr) {
             timerqueue_insert(86100, 0, -5);
           }
         } break;
+      case RULE_TIMER_TIME: {
+          rules_time_cb();
+        } break;
     }
   }
 
@@ -1526,15 +1671,24 @@ void send_initial_query() {
 
 }
 
+// data received in the last half wait time (proxy client poll or command answer) doesn't need to be polled again
+bool recentlyReceived(char *cache, unsigned long cachetime) {
+  return ((cache[0] == 0x71) && ((unsigned long)(millis() - cachetime) < (500UL * heishamonSettings.waitTime)));
+}
+
 void send_panasonic_query() {
-  log_message(_F("Requesting new panasonic data"));
-  send_command(panasonicQuery, PANASONICQUERYSIZE);
+  if (!recentlyReceived(actData, actDataTime)) {
+    log_message(_F("Requesting new panasonic data"));
+    send_command(panasonicQuery, PANASONICQUERYSIZE);
+  }
   // rest is for the new data block on new models
   if (extraDataBlockAvailable) {
-    log_message(_F("Requesting new panasonic extra data"));
-    panasonicQuery[3] = 0x21; //setting 4th byte to 0x21 is a request for extra block
-    send_command(panasonicQuery, PANASONICQUERYSIZE);
-    panasonicQuery[3] = 0x10; //setting 4th back to 0x10 for normal data request next time
+    if (!recentlyReceived(actDataExtra, actDataExtraTime)) {
+      log_message(_F("Requesting new panasonic extra data"));
+      panasonicQuery[3] = 0x21; //setting 4th byte to 0x21 is a request for extra block
+      send_command(panasonicQuery, PANASONICQUERYSIZE);
+      panasonicQuery[3] = 0x10; //setting 4th back to 0x10 for normal data request next time
+    }
   } else  {
     //if ((actData[0] == 0x71) && (actData[1] == 0xc8) && (actData[2] == 0x01) && (actData[193] == 0)  && (actData[195] == 0)  && (actData[197] == 0) ) { //do we have valid data but 0 value in heat consumptiom power, then assume K or L series
     if ((actData[0] == 0x71) && (actData[0xc7] >= 3) ) { //do we have valid header and byte 0xc7 is more or equal 3 then assume K&L and more series
@@ -1564,6 +1718,9 @@ void readHeatpump() {
     }
     data_length = 0; //clear any data in array
     sending = false; //receiving the answer from the send command timed out, so we are allowed to send a new command
+#ifdef ESP32
+    proxyPendingReply = 0; //the proxy client will ask again
+#endif
   }
   if ( (heishamonSettings.listenonly || sending) && (heatpumpSerial.available() > 0)) readSerial();
 }
@@ -1591,10 +1748,19 @@ void loop() {
   // Handle OTA first.s
   ArduinoOTA.handle();
 
+  //check mqtt, each call only does a small step of the (re)connect
+#ifdef ESP8266
+  if (WiFi.isConnected()) mqtt_reconnect();
+#else
+  if (WiFi.isConnected() || ETH.connected()) mqtt_reconnect();
+#endif
   mqtt_client.loop();
+  mqtt_inqueue_loop(mqtt_process_message);
+  mqtt_queue_loop();
+  mqtt_spool_loop();
 
   if (heishamonSettings.opentherm) {
-    HeishaOTLoop(actData, mqtt_client, heishamonSettings.mqtt_topic_base);
+    HeishaOTLoop(actData, heishamonSettings.mqtt_topic_base);
   }
 
   readHeatpump();
@@ -1607,9 +1773,9 @@ void loop() {
     popCommandBuffer();
   }
 
-  if (heishamonSettings.use_1wire) dallasLoop(mqtt_client, log_message, heishamonSettings.mqtt_topic_base);
+  if (heishamonSettings.use_1wire) dallasLoop(log_message, heishamonSettings.mqtt_topic_base);
 
-  if (heishamonSettings.use_s0) s0Loop(mqtt_client, log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.s0Settings);
+  if (heishamonSettings.use_s0) s0Loop(log_message, heishamonSettings.mqtt_topic_base, heishamonSettings.s0Settings);
 
   if ((!sending) && (!heishamonSettings.listenonly) && (heishamonSettings.optionalPCB) && ((unsigned long)(millis() - lastOptionalPCBRunTime) > OPTIONALPCBQUERYTIME) ) {
     lastOptionalPCBRunTime = millis();
@@ -1627,17 +1793,6 @@ void loop() {
   // run the data query only each WAITTIME
   if ((unsigned long)(millis() - lastRunTime) > (1000 * heishamonSettings.waitTime)) {
     lastRunTime = millis();
-    //check mqtt
-  #ifdef ESP8266
-    if ( WiFi.isConnected() && (!mqtt_client.connected()) )
-  #else
-    if ( (WiFi.isConnected() || ETH.connected()) && (!mqtt_client.connected()) )
-  #endif
-    {
-      if (mqttReconnects > 0 ) log_message(_F("Lost MQTT connection!"));
-      mqtt_reconnect();
-    }
-
 
     //log stats
     if (totalreads > 0 ) readpercentage = (((float)goodreads / (float)totalreads) * 100);
@@ -1698,7 +1853,7 @@ void loop() {
 
     String stats;
 #ifdef ESP8266
-    stats.reserve(384);
+    stats.reserve(512 + ((nrrules < RULEPROFILESTATS) ? nrrules : RULEPROFILESTATS) * 160); //every profiled rule adds about 130 bytes and its name
 #endif
     stats += F("{\"uptime\":");
     stats += String(millis());
@@ -1740,9 +1895,101 @@ void loop() {
 #endif
     stats += F("\",\"rules active\":");
     stats += nrrules;
+    stats += F(",\"rules coalesced\":");
+    stats += rules_coalesced();
+    struct rule_strings_t strstats;
+    rules_strings(&strstats);
+    stats += F(",\"rules strings\":");
+    stats += strstats.nr;
+    stats += F(",\"rules string bytes\":");
+    stats += strstats.bytes;
+    stats += F(",\"rules string lookups\":");
+    stats += strstats.lookups;
+    stats += F(",\"rules string hits\":");
+    stats += strstats.hits;
+    stats += F(",\"rules profile\":[");
+    for (uint8_t i = 0; i < nrrules && i < RULEPROFILESTATS; i++) {
+      const char *name = NULL, *trigger = NULL;
+      const struct rule_profile_t *profile = rules_profile(i, &name, &trigger);
+      if (profile == NULL) {
+        break;
+      }
+      if (i > 0) stats += F(",");
+      stats += F("{\"rule\":\"");
+      for (const char *c = name; c != NULL && *c != '\0'; c++) {
+        //cron rule names like Time#"0 6 * * 1-5" hold quotes
+        if (*c == '"' || *c == '\\') stats += '\\';
+        stats += *c;
+      }
+      stats += F("\",\"runs\":");
+      stats += profile->runs;
+      stats += F(",\"avg us\":");
+      stats += (profile->runs == 0) ? 0 : profile->total / profile->runs;
+      stats += F(",\"max us\":");
+      stats += profile->max;
+      stats += F(",\"recent us\":");
+      stats += profile->ewma;
+      stats += F(",\"instructions\":");
+      stats += profile->ops;
+      stats += F(",\"budget hits\":");
+      stats += profile->budgethits;
+      stats += F(",\"trigger\":\"");
+      stats += trigger;
+      stats += F("\"}");
+    }
+    stats += F("]");
+    struct mqttqueuestats_t mqttstats;
+    mqtt_queue_stats(&mqttstats);
+    stats += F(",\"mqtt queue\":");
+    stats += mqttstats.depth;
+    stats += F(",\"mqtt queue max\":");
+    stats += mqttstats.maxdepth;
+    stats += F(",\"mqtt drops\":");
+    stats += mqttstats.drops;
+    stats += F(",\"mqtt failures\":");
+    stats += mqttstats.failures;
+    stats += F(",\"mqtt latency avg\":");
+    stats += mqttstats.latencyavg;
+    stats += F(",\"mqtt latency max\":");
+    stats += mqttstats.latencymax;
+    stats += F(",\"mqtt receive queue\":");
+    stats += mqttstats.indepth;
+    stats += F(",\"mqtt receive drops\":");
+    stats += mqttstats.indrops;
+    stats += F(",\"mqtt receive latency avg\":");
+    stats += mqttstats.inlatencyavg;
+    stats += F(",\"mqtt receive latency max\":");
+    stats += mqttstats.inlatencymax;
+    if (mqtt_client.isVersion5()) {
+      stats += F(",\"mqtt topic aliases\":");
+      stats += mqtt_client.aliasesUsed();
+    }
+    if (heishamonSettings.mqttSpool) {
+      stats += F(",\"mqtt spooled\":");
+      stats += mqttstats.spooled;
+      stats += F(",\"mqtt replayed\":");
+      stats += mqttstats.replayed;
+    }
+#ifdef ESP32
+    if (heishamonSettings.proxy) {
+      stats += F(",\"proxy queries\":");
+      stats += proxyStats.queries;
+      stats += F(",\"proxy cache hits\":");
+      stats += proxyStats.cachehits;
+      stats += F(",\"proxy forced polls\":");
+      stats += proxyStats.forcedpolls;
+      stats += F(",\"proxy writes\":");
+      stats += proxyStats.writes;
+      stats += F(",\"proxy merged writes\":");
+      stats += proxyStats.mergedwrites;
+      stats += F(",\"proxy forwarded\":");
+      stats += proxyStats.forwarded;
+      stats += F(",\"proxy bad frames\":");
+      stats += proxyStats.badframes;
+    }
+#endif
     stats += F("}");
-    sprintf_P(mqtt_topic, PSTR("%s/stats"), heishamonSettings.mqtt_topic_base);
-    mqtt_client.publish(mqtt_topic, stats.c_str(), MQTT_RETAIN_VALUES);
+    mqtt_publish_id(MQTT_TOPIC_STATS, stats.c_str(), MQTT_RETAIN_VALUES);
 
     //websocket stats
 #ifdef ESP32
@@ -1778,8 +2025,7 @@ void loop() {
     if (!heishamonSettings.listenonly) send_panasonic_query();
 
     //Make sure the LWT is set to Online, even if the broker have marked it dead.
-    sprintf_P(mqtt_topic, PSTR("%s/%s"), heishamonSettings.mqtt_topic_base, mqtt_willtopic);
-    mqtt_client.publish(mqtt_topic, "Online");
+    mqtt_publish_id(MQTT_TOPIC_LWT, "Online", false);
 
 #ifdef ESP8266
     if (WiFi.isConnected()) {
@@ -1,6 +1,7 @@
 #include "src/opentherm/opentherm.h"
 #include "HeishaOT.h"
 #include "decode.h"
+#include "mqtt.h"
 #include "rules.h"
 #include "webfunctions.h"
 #include "src/common/stricmp.h"
@@ -14,7 +15,7 @@ const char* mqtt_topic_opentherm_write PROGMEM = "opentherm/write";
 
 unsigned long otResponse = 0;
 
-struct heishaOTDataStruct_t heishaOTDataStruct[] = {
+struct heishaOTDataStruct_t heishaOTDataStruct[NUMBER_OF_OT_VALUES + 1] = {
   //WRITE values
   { "chEnable", TBOOL, { .b = false }, 3 }, //is central heating enabled by thermostat
   { "dhwEnable", TBOOL, { .b = false }, 3 }, //is dhw heating enabled by thermostat
@@ -46,9 +47,6 @@ struct heishaOTDataStruct_t heishaOTDataStruct[] = {
   { NULL, 0, 0, 0 }
 };
 
-void mqttPublish(char* topic, char* subtopic, char* value, bool retain);
-void mqttPublish(char* topic, char* subtopic, char* value);
-
 struct heishaOTDataStruct_t *getOTStructMember(const char *name) {
   int i = 0;
   while(heishaOTDataStruct[i].name != NULL) {
@@ -60,6 +58,13 @@ struct heishaOTDataStruct_t *getOTStructMember(const char *name) {
   return NULL;
 }
 
+void publishOTValue(const char *name, const char *value) {
+  struct heishaOTDataStruct_t *member = getOTStructMember(name);
+  if (member != NULL) {
+    mqtt_publish_id(MQTT_TOPIC_OT + (member - heishaOTDataStruct), value, MQTT_RETAIN_VALUES);
+  }
+}
+
 void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
  if (status != OpenThermResponseStatus::SUCCESS) {
     log_message(_F("OpenTherm: Request invalid!"));
@@ -84,19 +89,19 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
 
         if ((bool)CHEnable != getOTStructMember(_F("chEnable"))->value.b) { //only publish if changed
           getOTStructMember(_F("chEnable"))->value.b = (bool)CHEnable;
-          CHEnable ? mqttPublish((char*)mqtt_topic_opentherm_write, _F("chEnable"), _F("true")) : mqttPublish((char*)mqtt_topic_opentherm_write, _F("chEnable"), _F("false")) ;
+          CHEnable ? publishOTValue(_F("chEnable"), _F("true")) : publishOTValue(_F("chEnable"), _F("false")) ;
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %s}}}"), _F("chEnable"), CHEnable ? _F("true") : _F("false"));
           websocket_write_all(log_msg, strlen(log_msg));
         }
         if ((bool)DHWEnable != getOTStructMember(_F("dhwEnable"))->value.b) { //only publish if changed
           getOTStructMember(_F("dhwEnable"))->value.b = (bool)DHWEnable;
-          DHWEnable ? mqttPublish((char*)mqtt_topic_opentherm_write, _F("dhwEnable"), _F("true")) : mqttPublish((char*)mqtt_topic_opentherm_write, _F("dhwEnable"), _F("false")) ;
+          DHWEnable ? publishOTValue(_F("dhwEnable"), _F("true")) : publishOTValue(_F("dhwEnable"), _F("false")) ;
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %s}}}"), _F("dhwEnable"), DHWEnable ? _F("true") : _F("false"));
           websocket_write_all(log_msg, strlen(log_msg));
         }
         if ((bool)Cooling != getOTStructMember(_F("coolingEnable"))->value.b) { //only publish if changed
           getOTStructMember(_F("coolingEnable"))->value.b = (bool)Cooling;
-          Cooling ? mqttPublish((char*)mqtt_topic_opentherm_write, _F("coolingEnable"), _F("true")) : mqttPublish((char*)mqtt_topic_opentherm_write, _F("coolingEnable"), _F("false")) ;
+          Cooling ? publishOTValue(_F("coolingEnable"), _F("true")) : publishOTValue(_F("coolingEnable"), _F("false")) ;
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %s}}}"), _F("coolingEnable"), Cooling ? _F("true") : _F("false"));
           websocket_write_all(log_msg, strlen(log_msg));
         }
@@ -134,7 +139,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
         log_message(log_msg);
         if (getOTStructMember(_F("chSetpoint"))->value.f != ot.getFloat(request)) { //only publish if changed
           getOTStructMember(_F("chSetpoint"))->value.f = ot.getFloat(request);
-          mqttPublish((char*)mqtt_topic_opentherm_write, _F("chSetpoint"), str);
+          publishOTValue(_F("chSetpoint"), str);
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("chSetpoint"), getOTStructMember(_F("chSetpoint"))->value.f);
           websocket_write_all(log_msg, strlen(log_msg));
         }
@@ -177,7 +182,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
           if ( getOTStructMember(_F("relativeModulation"))->value.f > getOTStructMember(_F("maxRelativeModulation"))->value.f) { //need to change the relative modulation on the fly to comply with max requested
             getOTStructMember(_F("relativeModulation"))->value.f = getOTStructMember(_F("maxRelativeModulation"))->value.f;
           }
-          mqttPublish((char*)mqtt_topic_opentherm_write, _F("maxRelativeModulation"), str);
+          publishOTValue(_F("maxRelativeModulation"), str);
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("maxRelativeModulation"), getOTStructMember(_F("maxRelativeModulation"))->value.f);
           websocket_write_all(log_msg, strlen(log_msg));          
         }
@@ -221,7 +226,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
         log_message(log_msg);
         if (getOTStructMember(_F("coolingControl"))->value.f != ot.getFloat(request)) {
           getOTStructMember(_F("coolingControl"))->value.f = ot.getFloat(request);  
-          mqttPublish((char*)mqtt_topic_opentherm_write, _F("coolingControl"), str);
+          publishOTValue(_F("coolingControl"), str);
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("coolingControl"), getOTStructMember(_F("coolingControl"))->value.f);
           websocket_write_all(log_msg, strlen(log_msg));
         }
@@ -248,7 +253,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
         sprintf_P(log_msg, PSTR("OpenTherm: Room temp: %s"), str);
         log_message(log_msg);
         if (getOTStructMember(_F("roomTemp"))->value.f != ot.getFloat(request)) {
-          mqttPublish((char*)mqtt_topic_opentherm_write, _F("roomTemp"), str);
+          publishOTValue(_F("roomTemp"), str);
           getOTStructMember(_F("roomTemp"))->value.f = ot.getFloat(request);
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("roomTemp"), getOTStructMember(_F("roomTemp"))->value.f);
           websocket_write_all(log_msg, strlen(log_msg));
@@ -263,7 +268,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
         log_message(log_msg);
         if (getOTStructMember(_F("roomTempSet"))->value.f != ot.getFloat(request)) {
           getOTStructMember(_F("roomTempSet"))->value.f = ot.getFloat(request);
-          mqttPublish((char*)mqtt_topic_opentherm_write, _F("roomTempSet"), str);
+          publishOTValue(_F("roomTempSet"), str);
           sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("roomTempSet"), getOTStructMember(_F("roomTempSet"))->value.f);
           websocket_write_all(log_msg, strlen(log_msg));          
         }
@@ -278,7 +283,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
           log_message(log_msg);
           if (getOTStructMember(_F("dhwSetpoint"))->value.f != ot.getFloat(request)) {
             getOTStructMember(_F("dhwSetpoint"))->value.f = ot.getFloat(request);
-            mqttPublish((char*)mqtt_topic_opentherm_write, _F("dhwSetpoint"), str);    
+            publishOTValue(_F("dhwSetpoint"), str);    
             sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("dhwSetpoint"), getOTStructMember(_F("dhwSetpoint"))->value.f);
             websocket_write_all(log_msg, strlen(log_msg));                      
           }
@@ -298,7 +303,7 @@ void processOTRequest(unsigned long request, OpenThermResponseStatus status) {
           log_message(log_msg);
           if (getOTStructMember(_F("maxTSet"))->value.f != ot.getFloat(request)) {
             getOTStructMember(_F("maxTSet"))->value.f = ot.getFloat(request);
-            mqttPublish((char*)mqtt_topic_opentherm_write, _F("maxTSet"), str);
+            publishOTValue(_F("maxTSet"), str);
             sprintf_P(log_msg, PSTR("{\"data\": {\"opentherm\": {\"name\": \"%s\", \"value\": %.2f}}}"), _F("maxTSet"), getOTStructMember(_F("maxTSet"))->value.f);
             websocket_write_all(log_msg, strlen(log_msg));                       
           }
@@ -421,7 +426,7 @@ void HeishaOTSetup() {
   ot.begin(handleOTInterrupt, processOTRequest);
 }
 
-void HeishaOTLoop(char * actData, PubSubClient &mqtt_client, char* mqtt_topic_base) {
+void HeishaOTLoop(char * actData, char* mqtt_topic_base) {
   // opentherm loop
   if (otResponse && ot.isReady()) {
     ot.sendResponse(otResponse);
@@ -22,6 +22,8 @@ extern const char* mqtt_topic_opentherm_write;
 #define TFLOAT 2
 #define TINT8 3
 
+#define NUMBER_OF_OT_VALUES 27 //number of values in heishaOTDataStruct
+
 typedef struct heishaOTDataStruct_t {
   const char *name;
   uint8_t type;
@@ -36,7 +38,7 @@ typedef struct heishaOTDataStruct_t {
 extern struct heishaOTDataStruct_t heishaOTDataStruct[];
 
 void HeishaOTSetup();
-void HeishaOTLoop(char *actDat, PubSubClient &mqtt_client, char* mqtt_topic_base);
+void HeishaOTLoop(char *actDat, char* mqtt_topic_base);
 void mqttOTCallback(char* topic, char* value);
 void openthermJsonOutput(struct webserver_t *client);
 
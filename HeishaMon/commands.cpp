@@ -1,4 +1,5 @@
 #include "commands.h"
+#include "src/common/writeframe.h"
 #include <LittleFS.h>
 
 //removed checksum from default query, is calculated in send_command
@@ -1037,33 +1038,149 @@ unsigned int set_solar_temp(char *msg, char *log_msg) {
 
 
 
-void send_heatpump_command(char* topic, char *msg, bool (*send_command)(byte*, int), void (*log_message)(char*), bool optionalPCB) {
-  unsigned char cmd[256] = { 0 };
-  char log_msg[256] = { 0 };
-  unsigned int len = 0;
-
-  for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
-    cmdStruct tmp;
-    memcpy_P(&tmp, &commands[i], sizeof(tmp));
-    if (strcmp(topic, tmp.name) == 0) {
-      len = tmp.func(msg, cmd, log_msg);
-      log_message(log_msg);
-      if (len > 0) send_command(cmd, len);
+static uint8_t commandIndex[COMMANDINDEXSIZE];
+static bool commandIndexBuilt = false;
+
+static uint32_t command_hash(const char *name, size_t len) {
+  //case insensitive FNV-1a
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)tolower(name[i]);
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+static const char *command_name(uint8_t idx) {
+  if (idx & COMMAND_OPTIONAL) {
+    return optionalCommands[idx & ~COMMAND_OPTIONAL].name;
+  }
+  return commands[idx].name;
+}
+
+static void command_index_add(uint8_t idx) {
+  char name[sizeof(cmdStruct::name)];
+  strncpy_P(name, command_name(idx), sizeof(name));
+  name[sizeof(name) - 1] = '\0';
+  uint8_t slot = command_hash(name, strlen(name)) & (COMMANDINDEXSIZE - 1);
+  while (commandIndex[slot] != COMMAND_UNKNOWN) {
+    slot = (slot + 1) & (COMMANDINDEXSIZE - 1);
+  }
+  commandIndex[slot] = idx;
+}
+
+static void command_index_build() {
+  memset(commandIndex, COMMAND_UNKNOWN, sizeof(commandIndex));
+  for (uint8_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    command_index_add(i);
+  }
+  for (uint8_t i = 0; i < sizeof(optionalCommands) / sizeof(optionalCommands[0]); i++) {
+    command_index_add(i | COMMAND_OPTIONAL);
+  }
+  commandIndexBuilt = true;
+}
+
+uint8_t find_command(const char *name, size_t len) {
+  if (!commandIndexBuilt) {
+    command_index_build();
+  }
+  uint8_t slot = command_hash(name, len) & (COMMANDINDEXSIZE - 1);
+  while (commandIndex[slot] != COMMAND_UNKNOWN) {
+    const char *cmdname = command_name(commandIndex[slot]);
+    if (strlen_P(cmdname) == len && strncasecmp_P(name, cmdname, len) == 0) {
+      return commandIndex[slot];
     }
+    slot = (slot + 1) & (COMMANDINDEXSIZE - 1);
   }
+  return COMMAND_UNKNOWN;
+}
 
-  if (optionalPCB) {
-    //run for optional pcb commands
-    for (unsigned int i = 0; i < sizeof(optionalCommands) / sizeof(optionalCommands[0]); i++) {
-      optCmdStruct tmp;
-      memcpy_P(&tmp, &optionalCommands[i], sizeof(tmp));
-      if (strcmp(topic, tmp.name) == 0) {
-        len = tmp.func(msg, log_msg);
-        log_message(log_msg);
-      }
+unsigned int run_command(uint8_t idx, char *msg, unsigned char *cmd, char *log_msg) {
+  if (idx & COMMAND_OPTIONAL) {
+    optCmdStruct tmp;
+    memcpy_P(&tmp, &optionalCommands[idx & ~COMMAND_OPTIONAL], sizeof(tmp));
+    tmp.func(msg, log_msg);
+    return 0; //optional pcb commands only change the optional pcb query
+  }
+  cmdStruct tmp;
+  memcpy_P(&tmp, &commands[idx], sizeof(tmp));
+  return tmp.func(msg, cmd, log_msg);
+}
+
+/*
+  Runs every command of the batch on its own frame and merges the changed
+  bytes into one frame. A zero byte or bit field means no change, so a
+  command is rejected when it would change bits another command in the
+  batch already changed.
+*/
+unsigned int build_heatpump_batch(char *msg, unsigned char *cmd, char *log_msg, bool optionalPCB) {
+  JsonDocument jsonDoc;
+  DeserializationError error = deserializeJson(jsonDoc, msg);
+  if (error || !jsonDoc.is<JsonObject>()) {
+    snprintf_P(log_msg, 255, PSTR("Batch command JSON decode failed!"));
+    return 0;
+  }
+
+  unsigned int applied = 0;
+  unsigned int rejected = 0;
+  bool changed = false;
+  memcpy_P(cmd, panasonicSendQuery, sizeof(panasonicSendQuery));
+
+  for (JsonPair kv : jsonDoc.as<JsonObject>()) {
+    const char *name = kv.key().c_str();
+    uint8_t idx = find_command(name, strlen(name));
+    if (idx == COMMAND_UNKNOWN || ((idx & COMMAND_OPTIONAL) && !optionalPCB)) {
+      rejected++;
+      continue;
+    }
+    char value[256] = { 0 };
+    if (kv.value().is<const char*>()) {
+      strlcpy(value, kv.value().as<const char*>(), sizeof(value));
+    } else {
+      serializeJson(kv.value(), value, sizeof(value));
+    }
+
+    unsigned char single[256] = { 0 };
+    char single_log[256] = { 0 };
+    unsigned int len = run_command(idx, value, single, single_log);
+    if (idx & COMMAND_OPTIONAL) {
+      applied++; //optional pcb commands change the optional pcb query directly
+      continue;
     }
+    if (len != sizeof(panasonicSendQuery) || single[0] != cmd[0]) {
+      rejected++;
+      continue;
+    }
+    if (!writeframe_merge(cmd, single, len)) {
+      rejected++; //sets a setting which is already set in this batch
+      continue;
+    }
+    changed = true;
+    applied++;
   }
 
+  snprintf_P(log_msg, 255, PSTR("Batch command: %u applied, %u rejected"), applied, rejected);
+  return changed ? sizeof(panasonicSendQuery) : 0;
+}
+
+void send_heatpump_command(char* topic, char *msg, bool (*send_command)(byte*, int), void (*log_message)(char*), bool optionalPCB) {
+  unsigned char cmd[256] = { 0 };
+  char log_msg[256] = { 0 };
+
+  if (strcmp_P(topic, PSTR(BATCH_COMMAND)) == 0) {
+    unsigned int len = build_heatpump_batch(msg, cmd, log_msg, optionalPCB);
+    log_message(log_msg);
+    if (len > 0) send_command(cmd, len);
+    return;
+  }
+
+  uint8_t idx = find_command(topic, strlen(topic));
+  if (idx == COMMAND_UNKNOWN || ((idx & COMMAND_OPTIONAL) && !optionalPCB)) {
+    return;
+  }
+  unsigned int len = run_command(idx, msg, cmd, log_msg);
+  log_message(log_msg);
+  if (len > 0) send_command(cmd, len);
 }
 
 
@@ -178,6 +178,26 @@ const optCmdStruct optionalCommands[] PROGMEM = {
   { "SetOptPCBByte9", set_byte_9 }
 };
 
+/*
+  Command names are looked up case insensitive through a hash index
+  over both tables, shared by mqtt, the webserver and the rules.
+  The index holds the position in commands[], or the position in
+  optionalCommands[] with COMMAND_OPTIONAL set.
+*/
+#define COMMAND_UNKNOWN 0xFF
+#define COMMAND_OPTIONAL 0x80
+#define COMMANDINDEXSIZE 128 // power of two, at least twice the number of commands
+
+uint8_t find_command(const char *name, size_t len);
+unsigned int run_command(uint8_t idx, char *msg, unsigned char *cmd, char *log_msg);
+
+/*
+  A batch is a json object of command names and values, for example
+  {"SetZ1HeatRequestTemperature":21,"SetDHWTemp":50}. All heatpump
+  commands in it are combined into one write frame.
+*/
+#define BATCH_COMMAND "batch"
+unsigned int build_heatpump_batch(char *msg, unsigned char *cmd, char *log_msg, bool optionalPCB);
 void send_heatpump_command(char* topic, char *msg, bool (*send_command)(byte*, int), void (*log_message)(char*), bool optionalPCB);
 bool saveOptionalPCB(byte* command, int length);
 bool loadOptionalPCB(byte* command, int length);
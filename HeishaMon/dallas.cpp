@@ -3,6 +3,7 @@
 #include <PubSubClient.h>
 #include "commands.h"
 #include "dallas.h"
+#include "mqtt.h"
 #include "rules.h"
 #include "src/common/progmem.h"
 #include <ArduinoJson.h>
@@ -22,7 +23,7 @@ dallasDataStruct* actDallasData = 0;
 int dallasDevicecount = 0;
 
 
-unsigned long lastalldatatime_dallas = 0;
+refreshStruct refreshDallas = { 0, 0, 0 };
 
 unsigned long dallasTimer = 0;
 unsigned long dallasTimer1 = 0;
@@ -62,23 +63,22 @@ void initDallasSensors(void (*log_message)(char*), unsigned int updateAllDallasT
   }
   if (DALLASASYNC) DS18B20.setWaitForConversion(false); //async 1wire during next loops
   loadDallasAlias();
+  mqtt_topics_build(); //sensor addresses are part of the 1wire topics
+  rules_index_build(); //and of the 1wire rule events
 }
 
 void resetlastalldatatime_dallas() {
-  lastalldatatime_dallas = 0;
+  refresh_reset(&refreshDallas);
 }
 
-void readNewDallasTemp(PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base) {
+void readNewDallasTemp(void (*log_message)(char*), char* mqtt_topic_base) {
   char log_msg[256];
-  char mqtt_topic[256];
   char valueStr[80];
-  bool updatenow = false;
+  uint16_t refreshFrom = refreshDallas.done;
+  uint16_t refreshTo = refresh_due(&refreshDallas, dallasDevicecount, updateAllDallasTime);
 
-  if ((lastalldatatime_dallas == 0) || ((unsigned long)(millis() - lastalldatatime_dallas) >  (1000 * updateAllDallasTime))) {
-    updatenow = true;
-    lastalldatatime_dallas = millis();
-  }
   if (!(DALLASASYNC)) DS18B20.requestTemperatures();
+  rules_frame_begin(); //rules triggered by this read run once all sensors are read
   for (int i = 0; i < dallasDevicecount; i++) {
     float temp = DS18B20.getTempC(actDallasData[i].sensor);
     if (temp < -120.0) {
@@ -90,29 +90,30 @@ void readNewDallasTemp(PubSubClient &mqtt_client, void (*log_message)(char*), ch
         log_message(log_msg);
       } else {
         actDallasData[i].lastgoodtime = millis();
+        bool updatenow = (i >= refreshFrom) && (i < refreshTo);
         if ((updatenow) || (actDallasData[i].temperature != temp )) {  //only update mqtt topic if temp changed or after each update timer
           actDallasData[i].temperature = temp;
           sprintf(log_msg, PSTR("Received 1wire sensor temperature (%s): %.2f"), actDallasData[i].address, actDallasData[i].temperature);
           log_message(log_msg);
           if (true) {
             sprintf_P(valueStr, PSTR("%.2f"), actDallasData[i].temperature);
-            sprintf_P(mqtt_topic, PSTR("%s/%s/%s"), mqtt_topic_base, mqtt_topic_1wire, actDallasData[i].address); mqtt_client.publish(mqtt_topic, valueStr, MQTT_RETAIN_VALUES);
-            sprintf_P(valueStr, PSTR("%s"), actDallasData[i].alias);
-            sprintf_P(mqtt_topic, PSTR("%s/%s/%s/alias"), mqtt_topic_base, mqtt_topic_1wire, actDallasData[i].address); mqtt_client.publish(mqtt_topic, valueStr, MQTT_RETAIN_VALUES);
+            mqtt_publish_id(MQTT_TOPIC_DALLAS + i, valueStr, MQTT_RETAIN_VALUES);
+            mqtt_publish_id(MQTT_TOPIC_DALLAS_ALIAS + i, actDallasData[i].alias, MQTT_RETAIN_VALUES);
           } else {
             sprintf_P(valueStr, PSTR("{\"Temperature\":%.2f,\"Alias\":\"%s\"}"), actDallasData[i].temperature, actDallasData[i].alias);
-            sprintf_P(mqtt_topic, PSTR("%s/%s/%s"), mqtt_topic_base, mqtt_topic_1wire, actDallasData[i].address); mqtt_client.publish(mqtt_topic, valueStr, MQTT_RETAIN_VALUES);
+            mqtt_publish_id(MQTT_TOPIC_DALLAS + i, valueStr, MQTT_RETAIN_VALUES);
           }
           sprintf_P(log_msg, PSTR("{\"data\": {\"dallasvalues\": {\"sensorID\": \"%s\", \"value\": %.2f}}}"), actDallasData[i].address, actDallasData[i].temperature);
           websocket_write_all(log_msg, strlen(log_msg));          
-          rules_event_cb(_F("ds18b20#"), actDallasData[i].address);
+          rules_event_id(RULE_EVENT_DALLAS + i);
         }
       }
     }
   }
+  rules_frame_end();
 }
 
-void dallasLoop(PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base) {
+void dallasLoop(void (*log_message)(char*), char* mqtt_topic_base) {
   if ((unsigned long)(millis() - dallasTimer) > (1000 * dallasTimerWait)) {
     log_message((char*)"Requesting new 1wire temperatures");
     dallasTimer = millis();
@@ -120,12 +121,12 @@ void dallasLoop(PubSubClient &mqtt_client, void (*log_message)(char*), char* mqt
       DS18B20.requestTemperatures();
       dallasTimer1=millis();
     }else{
-      readNewDallasTemp(mqtt_client, log_message, mqtt_topic_base);
+      readNewDallasTemp(log_message, mqtt_topic_base);
     }
   }
   if ((dallasTimer1!=0) && ((millis() - dallasTimer1)>750)){
     dallasTimer1=0;
-    readNewDallasTemp(mqtt_client, log_message, mqtt_topic_base);
+    readNewDallasTemp(log_message, mqtt_topic_base);
   }   
 }
 
@@ -1,13 +1,16 @@
 #include "decode.h"
 #include "commands.h"
+#include "mqtt.h"
 #include "rules.h"
 #include "src/common/progmem.h"
 
 void websocket_write_all(char *data, uint16_t data_len);
 
-unsigned long lastalldatatime = 0;
-unsigned long lastallextradatatime = 0;
-unsigned long lastalloptdatatime = 0;
+refreshStruct refreshMain = { 0, 0, 0 };
+refreshStruct refreshExtra = { 0, 0, 0 };
+refreshStruct refreshOpt = { 0, 0, 0 };
+
+decodedValueStruct actValues[NUMBER_OF_VALUES];
 
 String getBit1(byte input) {
   return String(input  >> 7);
@@ -149,10 +152,74 @@ String getErrorInfo(char* data) { // TOP44 //
 }
 
 
+static void storeValue(decodedValueStruct *slot, const char *str) {
+  size_t len = strlen(str);
+  if (len == 0) {
+    slot->type = VALUE_NONE;
+    return;
+  }
+  uint8_t nrdot = 0;
+  for (size_t pos = 0; pos < len; pos++) {
+    if (str[pos] == '.' && pos > 0) {
+      nrdot++;
+    } else if (!isdigit((unsigned char)str[pos]) && !(pos == 0 && str[pos] == '-')) {
+      nrdot = 2;
+    }
+    if (nrdot > 1) {
+      slot->type = VALUE_STRING;
+      return;
+    }
+  }
+  float var = atof(str);
+  float nr = 0;
+  if (modff(var, &nr) == 0) {
+    slot->type = VALUE_INT;
+    slot->value.i = (int32_t)var;
+  } else {
+    slot->type = VALUE_FLOAT;
+    slot->value.f = var;
+  }
+}
+
+void refresh_reset(refreshStruct *refresh) {
+  refresh->cycleStart = millis();
+  refresh->period = REFRESHRESENDTIME;
+  refresh->done = 0;
+}
+
+/*
+  Returns up to which topic the current cycle should have been refreshed
+  by now, topics from refresh->done (before calling) up to the returned
+  value are due.
+*/
+uint16_t refresh_due(refreshStruct *refresh, uint16_t count, unsigned int updateAllTime) {
+  if (refresh->period == 0) {
+    refresh_reset(refresh);
+  }
+  unsigned int period = (refresh->period < updateAllTime) ? refresh->period : updateAllTime;
+  unsigned long periodms = 1000UL * period;
+  unsigned long elapsed = millis() - refresh->cycleStart;
+  uint16_t due = count;
+  if (elapsed < periodms) {
+    due = (uint16_t)((((uint64_t)count * elapsed) + periodms - 1) / periodms);
+  }
+  if (due >= count) {
+    refresh->cycleStart = millis();
+    refresh->period = updateAllTime;
+    refresh->done = 0;
+    return count;
+  }
+  if (due < refresh->done) {
+    due = refresh->done;
+  }
+  refresh->done = due;
+  return due;
+}
+
 void resetlastalldatatime() {
-  lastalldatatime = 0;
-  lastallextradatatime = 0;
-  lastalloptdatatime = 0;
+  refresh_reset(&refreshMain);
+  refresh_reset(&refreshExtra);
+  refresh_reset(&refreshOpt);
 }
 
 String getDataValue(char* data, unsigned int Topic_Number) {
@@ -289,14 +356,11 @@ String getSecondByte(byte input) {
 
 
 // Decode ////////////////////////////////////////////////////////////////////////////
-void decode_heatpump_data(char* data, char* actData, PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime) {
-  bool updateTime = false;
+void decode_heatpump_data(char* data, char* actData, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime) {
+  uint16_t refreshFrom = refreshMain.done;
+  uint16_t refreshTo = refresh_due(&refreshMain, NUMBER_OF_TOPICS, updateAllTime);
   bool updateTopic[NUMBER_OF_TOPICS] = { false };
-
-  if ((lastalldatatime == 0) || ((unsigned long)(millis() - lastalldatatime) > (1000 * updateAllTime))) {
-    updateTime = true;
-    lastalldatatime = millis();
-  }
+  bool firstData = (actData[0] == '\0');
   for (unsigned int Topic_Number = 0 ; Topic_Number < NUMBER_OF_TOPICS ; Topic_Number++) {
     String Topic_Value;
     Topic_Value = getDataValue(data, Topic_Number);
@@ -304,17 +368,20 @@ void decode_heatpump_data(char* data, char* actData, PubSubClient &mqtt_client,
     if(getDataValue(actData, Topic_Number) != Topic_Value) {
       updateTopic[Topic_Number] = true;
     }
+    if (firstData || updateTopic[Topic_Number]) {
+      storeValue(&actValues[VALUE_MAIN + Topic_Number], Topic_Value.c_str());
+    }
 
+    bool updateTime = (Topic_Number >= refreshFrom) && (Topic_Number < refreshTo);
     if (updateTime || updateTopic[Topic_Number]) {
       char log_msg[256];
-      char mqtt_topic[256];
       sprintf_P(log_msg, PSTR("received TOP%d %s: %s"), Topic_Number, topics[Topic_Number], Topic_Value.c_str());
       log_message(log_msg);
-      sprintf_P(mqtt_topic, PSTR("%s/%s/%s"), mqtt_topic_base, mqtt_topic_values, topics[Topic_Number]);
-      mqtt_client.publish(mqtt_topic, Topic_Value.c_str(), MQTT_RETAIN_VALUES);
+      mqtt_publish_id(MQTT_TOPIC_MAIN + Topic_Number, Topic_Value.c_str(), MQTT_RETAIN_VALUES);
     }
   }
   memcpy(actData, data, DATASIZE);
+  rules_frame_begin(); //rules triggered by this frame run once it is fully decoded
   for (unsigned int Topic_Number = 0 ; Topic_Number < NUMBER_OF_TOPICS ; Topic_Number++) {
     if(updateTopic[Topic_Number]) {
       char log_msg[256];
@@ -330,19 +397,17 @@ void decode_heatpump_data(char* data, char* actData, PubSubClient &mqtt_client,
         sprintf_P(log_msg, PSTR("{\"data\": {\"heishavalues\": {\"topic\": \"TOP%u\", \"value\": %s, \"description\": \"%s\"}}}"), Topic_Number, dataValue.c_str(),topicDescription[Topic_Number][dataValue.toInt() + 1]);
       }
       websocket_write_all(log_msg, strlen(log_msg));          
-      rules_event_cb(_F("@"), topics[Topic_Number]);
+      rules_event_id(RULE_EVENT_MAIN + Topic_Number);
     }
   }
+  rules_frame_end();
 }
 
-void decode_heatpump_data_extra(char* data, char* actDataExtra, PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime) {
-  bool updateTime = false;
+void decode_heatpump_data_extra(char* data, char* actDataExtra, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime) {
+  uint16_t refreshFrom = refreshExtra.done;
+  uint16_t refreshTo = refresh_due(&refreshExtra, NUMBER_OF_TOPICS_EXTRA, updateAllTime);
   bool updateTopic[NUMBER_OF_TOPICS_EXTRA] = { false };
-
-  if ((lastallextradatatime == 0) || ((unsigned long)(millis() - lastallextradatatime) > (1000 * updateAllTime))) {
-    updateTime = true;
-    lastallextradatatime = millis();
-  }
+  bool firstData = (actDataExtra[0] == '\0');
   for (unsigned int Topic_Number = 0 ; Topic_Number < NUMBER_OF_TOPICS_EXTRA ; Topic_Number++) {
     String Topic_Value;
     Topic_Value = getDataValueExtra(data, Topic_Number);
@@ -350,17 +415,20 @@ void decode_heatpump_data_extra(char* data, char* actDataExtra, PubSubClient &mq
     if(getDataValueExtra(actDataExtra, Topic_Number) != Topic_Value) {
       updateTopic[Topic_Number] = true;
     }
+    if (firstData || updateTopic[Topic_Number]) {
+      storeValue(&actValues[VALUE_EXTRA + Topic_Number], Topic_Value.c_str());
+    }
 
+    bool updateTime = (Topic_Number >= refreshFrom) && (Topic_Number < refreshTo);
     if (updateTime || updateTopic[Topic_Number]) {
       char log_msg[256];
-      char mqtt_topic[256];
       sprintf_P(log_msg, PSTR("received XTOP%d %s: %s"), Topic_Number, xtopics[Topic_Number], Topic_Value.c_str());
       log_message(log_msg);
-      sprintf_P(mqtt_topic, PSTR("%s/%s/%s"), mqtt_topic_base, mqtt_topic_xvalues, xtopics[Topic_Number]);
-      mqtt_client.publish(mqtt_topic, Topic_Value.c_str(), MQTT_RETAIN_VALUES);
+      mqtt_publish_id(MQTT_TOPIC_EXTRA + Topic_Number, Topic_Value.c_str(), MQTT_RETAIN_VALUES);
     }
   }
   memcpy(actDataExtra, data, DATASIZE);
+  rules_frame_begin(); //rules triggered by this frame run once it is fully decoded
   for (unsigned int Topic_Number = 0 ; Topic_Number < NUMBER_OF_TOPICS_EXTRA ; Topic_Number++) {
     if(updateTopic[Topic_Number]) {
       char log_msg[256];
@@ -372,19 +440,17 @@ void decode_heatpump_data_extra(char* data, char* actDataExtra, PubSubClient &mq
         sprintf_P(log_msg, PSTR("{\"data\": {\"heishavalues\": {\"topic\": \"XTOP%u\", \"value\": %s, \"description\": \"%s\"}}}"), Topic_Number, dataValue.c_str(),xtopicDescription[Topic_Number][dataValue.toInt() + 1]);
       }
       websocket_write_all(log_msg, strlen(log_msg));         
-      rules_event_cb(_F("@"), xtopics[Topic_Number]);
+      rules_event_id(RULE_EVENT_EXTRA + Topic_Number);
     }
   }
+  rules_frame_end();
 }
 
-void decode_optional_heatpump_data(char* data, char* actOptData, PubSubClient & mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime) {
-  bool updateTime = false;
+void decode_optional_heatpump_data(char* data, char* actOptData, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime) {
+  uint16_t refreshFrom = refreshOpt.done;
+  uint16_t refreshTo = refresh_due(&refreshOpt, NUMBER_OF_OPT_TOPICS, updateAllTime);
   bool updateTopic[NUMBER_OF_OPT_TOPICS] = { false };
-
-  if ((lastalloptdatatime == 0) || ((unsigned long)(millis() - lastalloptdatatime) > (1000 * updateAllTime))) {
-    updateTime = true;
-    lastalloptdatatime = millis();
-  }
+  bool firstData = (actOptData[0] == '\0');
   for (unsigned int Topic_Number = 0 ; Topic_Number < NUMBER_OF_OPT_TOPICS ; Topic_Number++) {
     String Topic_Value;
     Topic_Value = getOptDataValue(data, Topic_Number);
@@ -392,14 +458,16 @@ void decode_optional_heatpump_data(char* data, char* actOptData, PubSubClient &
     if(getOptDataValue(actOptData, Topic_Number) != Topic_Value) {
       updateTopic[Topic_Number] = true;
     }
+    if (firstData || updateTopic[Topic_Number]) {
+      storeValue(&actValues[VALUE_OPT + Topic_Number], Topic_Value.c_str());
+    }
 
+    bool updateTime = (Topic_Number >= refreshFrom) && (Topic_Number < refreshTo);
     if (updateTime || updateTopic[Topic_Number]) {
       char log_msg[256];
-      char mqtt_topic[256];
       sprintf_P(log_msg, PSTR("received OPT%d %s: %s"), Topic_Number, optTopics[Topic_Number], Topic_Value.c_str());
       log_message(log_msg);
-      sprintf_P(mqtt_topic, PSTR("%s/%s/%s"), mqtt_topic_base, mqtt_topic_pcbvalues, optTopics[Topic_Number]);
-      mqtt_client.publish(mqtt_topic, Topic_Value.c_str(), MQTT_RETAIN_VALUES);
+      mqtt_publish_id(MQTT_TOPIC_OPT + Topic_Number, Topic_Value.c_str(), MQTT_RETAIN_VALUES);
 
     }
   }
@@ -410,6 +478,7 @@ void decode_optional_heatpump_data(char* data, char* actOptData, PubSubClient &
   optionalPCBQuery[5] = valueByte5;
 
   memcpy(actOptData, data, OPTDATASIZE);
+  rules_frame_begin(); //rules triggered by this frame run once it is fully decoded
   for (unsigned int Topic_Number = 0 ; Topic_Number < NUMBER_OF_OPT_TOPICS ; Topic_Number++) {
     if(updateTopic[Topic_Number]) {
       char log_msg[256];
@@ -421,8 +490,9 @@ void decode_optional_heatpump_data(char* data, char* actOptData, PubSubClient &
         sprintf_P(log_msg, PSTR("{\"data\": {\"heishavalues\": {\"topic\": \"OPT%u\", \"value\": %s, \"description\": \"%s\"}}}"), Topic_Number, dataValue.c_str(),opttopicDescription[Topic_Number][dataValue.toInt() + 1]);
       }      
       websocket_write_all(log_msg, strlen(log_msg));
-      rules_event_cb(_F("@"), optTopics[Topic_Number]);
+      rules_event_id(RULE_EVENT_OPT + Topic_Number);
     }
   }
+  rules_frame_end();
 
 }
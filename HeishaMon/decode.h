@@ -1,8 +1,27 @@
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
 #include <ArduinoJson.h>
 #include <PubSubClient.h>
 
 #define MQTT_RETAIN_VALUES 1
 
+/*
+  All values are resent every updateAllTime, but spread evenly over that
+  period: each frame only republishes the next slice of topics. After a
+  reset (mqtt reconnect) a new cycle starts which finishes within
+  REFRESHRESENDTIME seconds.
+*/
+#define REFRESHRESENDTIME 15
+
+struct refreshStruct {
+  unsigned long cycleStart; // millis when the current cycle started
+  unsigned int period; // seconds for the current cycle, 0 = not started
+  uint16_t done; // topics refreshed in the current cycle
+};
+
+void refresh_reset(refreshStruct *refresh);
+uint16_t refresh_due(refreshStruct *refresh, uint16_t count, unsigned int updateAllTime);
 void resetlastalldatatime();
 void websocket_write_all(char *data, uint16_t data_len);
 
@@ -10,9 +29,9 @@ void websocket_write_all(char *data, uint16_t data_len);
 String getDataValue(char* data, unsigned int Topic_Number);
 String getDataValueExtra(char* data, unsigned int Topic_Number);
 String getOptDataValue(char* data, unsigned int Topic_Number);
-void decode_heatpump_data(char* data, char* actData, PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime);
-void decode_heatpump_data_extra(char* data, char* actDataExtra, PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime);
-void decode_optional_heatpump_data(char* data, char* actOptDat, PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime);
+void decode_heatpump_data(char* data, char* actData, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime);
+void decode_heatpump_data_extra(char* data, char* actDataExtra, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime);
+void decode_optional_heatpump_data(char* data, char* actOptDat, void (*log_message)(char*), char* mqtt_topic_base, unsigned int updateAllTime);
 
 String unknown(byte input);
 String getBit1(byte input);
@@ -47,6 +66,32 @@ static const char _unknown[] PROGMEM = "unknown";
 #define NUMBER_OF_OPT_TOPICS 7 //last topic number + 1
 #define MAX_TOPIC_LEN 42 // max length + 1
 
+/*
+  The last decoded value of every topic is kept as a number as well, so
+  rules can read a value without decoding the frame and parsing a String.
+  Values which aren't numbers (error, model) are marked as string and
+  still have to be decoded from the frame.
+*/
+#define VALUE_MAIN 0
+#define VALUE_EXTRA (VALUE_MAIN + NUMBER_OF_TOPICS)
+#define VALUE_OPT (VALUE_EXTRA + NUMBER_OF_TOPICS_EXTRA)
+#define NUMBER_OF_VALUES (VALUE_OPT + NUMBER_OF_OPT_TOPICS)
+
+#define VALUE_NONE 0 // nothing received yet
+#define VALUE_INT 1
+#define VALUE_FLOAT 2
+#define VALUE_STRING 3
+
+struct decodedValueStruct {
+  uint8_t type;
+  union {
+    int32_t i;
+    float f;
+  } value;
+};
+
+extern decodedValueStruct actValues[NUMBER_OF_VALUES];
+
 static const char optTopics[][20] PROGMEM = {
   "Z1_Water_Pump", // OPT0
   "Z1_Mixing_Valve", // OPT1
@@ -709,3 +754,5 @@ static const char **topicDescription[] PROGMEM = {
   Minutes,         //TOP137
   Minutes,         //TOP138
 };
+
+#endif
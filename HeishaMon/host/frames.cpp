@@ -0,0 +1,72 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/common/writeframe.h"
+
+/*
+  Checks how buffered heatpump writes are merged.
+
+  Each case sets the bytes of two set_* commands on an
+  empty write frame and tells if the second one may be
+  merged into the first and what the frame looks like.
+*/
+
+#define FRAMESIZE 110
+
+typedef struct frame_t {
+  const char *name;
+  uint8_t a[2];
+  uint8_t b[2];
+  int merge;
+  uint8_t want;
+} frame_t;
+
+static struct frame_t frames[] = {
+  /* byte, value of the first and the second command */
+  { "heatpump on and pump on", { 4, 2 }, { 4, 32 }, 1, 0x22 },
+  { "pump off and force dhw", { 4, 16 }, { 4, 128 }, 1, 0x90 },
+  { "holiday and main schedule", { 5, 32 }, { 5, 64 }, 1, 0x60 },
+  { "sterilization and defrost", { 8, 4 }, { 8, 2 }, 1, 0x06 },
+  { "heatpump off and on", { 4, 1 }, { 4, 2 }, 0, 0x01 },
+  { "reset and defrost", { 8, 1 }, { 8, 2 }, 1, 0x03 },
+  { "sterilization twice", { 8, 4 }, { 8, 4 }, 0, 0x04 },
+  { "quiet and powerful", { 7, 16 }, { 7, 74 }, 0, 0x10 },
+  { "two different heat temps", { 38, 0x9e }, { 38, 0xa0 }, 0, 0x9e },
+  { "heat temp and dhw temp", { 38, 0x9e }, { 42, 0xb4 }, 1, 0x9e },
+  { "pump duty and pump on", { 45, 0x50 }, { 4, 32 }, 1, 0x50 },
+};
+
+int main(void) {
+  uint8_t frame[FRAMESIZE], cmd[FRAMESIZE];
+  unsigned int i = 0, failed = 0;
+  int merge = 0;
+
+  for(i=0;i<sizeof(frames)/sizeof(frames[0]);i++) {
+    struct frame_t *f = &frames[i];
+
+    memset(frame, 0, sizeof(frame));
+    memset(cmd, 0, sizeof(cmd));
+    frame[f->a[0]] = f->a[1];
+    cmd[f->b[0]] = f->b[1];
+
+    merge = writeframe_merge(frame, cmd, FRAMESIZE);
+    if(merge != f->merge || frame[f->a[0]] != f->want ||
+      (merge == 1 && frame[f->b[0]] != (f->b[0] == f->a[0] ? f->want : f->b[1])) ||
+      (merge == 0 && f->b[0] != f->a[0] && frame[f->b[0]] != 0)) {
+      printf("FAIL %s: merged %d, byte %d is 0x%02x\n", f->name, merge, f->a[0], frame[f->a[0]]);
+      failed++;
+    }
+  }
+
+  printf("frames: %u of %u cases merge as expected\n", i - failed, i);
+  return failed > 0;
+}
@@ -0,0 +1,65 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../src/common/mem.h"
+#include "host.h"
+
+/*
+  Feeds arbitrary text through the lexer and the bytecode
+  compiler. Every rule that compiles is run once as well.
+
+  Built with -fsanitize=fuzzer this is a libFuzzer target.
+  Otherwise it reads a single input from a file or stdin,
+  which is what AFL and a plain replay of a crash need.
+*/
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static uint8_t init = 0;
+  uint8_t i = 0;
+
+  if(init == 0) {
+    host_init();
+    host_quiet(1);
+    init = 1;
+  }
+  if(size == 0 || size > MEMPOOL_SIZE/2) {
+    return 0;
+  }
+
+  if(host_compile((const char *)data, size) == 0) {
+    for(i=0;i<nrrules;i++) {
+      host_run(i);
+    }
+  }
+  rules_gc(&rules, &nrrules);
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+int main(int argc, char **argv) {
+  static uint8_t buf[MEMPOOL_SIZE];
+  FILE *fp = stdin;
+  size_t len = 0;
+
+  if(argc > 1 && (fp = fopen(argv[1], "rb")) == NULL) {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 1;
+  }
+  len = fread(buf, 1, sizeof(buf), fp);
+  if(fp != stdin) {
+    fclose(fp);
+  }
+
+  return LLVMFuzzerTestOneInput(buf, len);
+}
+#endif
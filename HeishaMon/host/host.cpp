@@ -0,0 +1,565 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../src/common/mem.h"
+#include "../src/common/timerqueue.h"
+#include "host.h"
+
+#define HOST_MAXVARS 256
+
+struct serial_t Serial;
+void *MMU_SEC_HEAP = NULL;
+struct rule_options_t rule_options;
+
+struct rules_t **rules = NULL;
+uint8_t nrrules = 0;
+uint8_t host_trace = 0;
+
+typedef struct host_var_t {
+  char *name;
+  uint8_t type;
+  uint8_t interned; // the string is owned by the rules varstack
+  union {
+    int i;
+    float f;
+    char *s;
+  } val;
+} host_var_t;
+
+static struct host_var_t vars[HOST_MAXVARS];
+static uint16_t nrvars = 0;
+
+/*
+  The engine numbers every variable name once it's compiled,
+  so after that a lookup is a single index.
+*/
+static int16_t *slots = NULL;
+static uint16_t nrslots = 0;
+
+static unsigned char mempool[MEMPOOL_SIZE] __attribute__((aligned(4)));
+static struct pbuf mem;
+
+/*
+  Reloaded rules end up in a mempool at another address,
+  so every pointer in the dump has to be relocated.
+*/
+static unsigned char reloadpool[MEMPOOL_SIZE] __attribute__((aligned(4)));
+static unsigned char *dump = NULL;
+static uint32_t dumplen = 0;
+static uint32_t dumppos = 0;
+static uint8_t parsing = 0;
+static int stdout_fd = -1;
+
+int digitalRead(uint8_t) {
+  return 0;
+}
+
+void digitalWrite(uint8_t, uint8_t) {
+}
+
+void timer_cb(int) {
+}
+
+uint64_t host_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+  The engine reports its compile timings on stdout, which
+  would make the output of every run differ.
+*/
+void host_quiet(uint8_t on) {
+  fflush(stdout);
+  if(on == 1 && stdout_fd == -1) {
+    int fd = open("/dev/null", O_WRONLY);
+    if(fd == -1) {
+      return;
+    }
+    stdout_fd = dup(1);
+    dup2(fd, 1);
+    close(fd);
+  } else if(on == 0 && stdout_fd != -1) {
+    dup2(stdout_fd, 1);
+    close(stdout_fd);
+    stdout_fd = -1;
+  }
+}
+
+char *host_file(const char *file, uint16_t *len) {
+  FILE *fp = NULL;
+  char *buf = NULL;
+  long size = 0;
+
+  if((fp = fopen(file, "rb")) == NULL) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  if(size < 0 || size >= MEMPOOL_SIZE || (buf = (char *)MALLOC(size+1)) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  if(fread(buf, 1, size, fp) != (size_t)size) {
+    FREE(buf);
+    fclose(fp);
+    return NULL;
+  }
+  buf[size] = '\0';
+  fclose(fp);
+
+  *len = size;
+  return buf;
+}
+
+static struct host_var_t *host_var(const char *name, uint8_t add) {
+  uint16_t i = 0;
+
+  for(i=0;i<nrvars;i++) {
+    if(strcmp(vars[i].name, name) == 0) {
+      return &vars[i];
+    }
+  }
+  if(add == 0 || nrvars >= HOST_MAXVARS) {
+    return NULL;
+  }
+  vars[nrvars].name = STRDUP(name);
+  vars[nrvars].type = VNULL;
+  vars[nrvars].interned = 0;
+  vars[nrvars].val.s = NULL;
+  return &vars[nrvars++];
+}
+
+static struct host_var_t *host_var_slot(struct rules_t *obj, int8_t pos) {
+  int16_t nr = rules_tovar(obj, pos);
+
+  if(nr >= 0 && nr < nrslots && slots[nr] >= 0) {
+    return &vars[slots[nr]];
+  }
+  return host_var(rules_tostring(obj, pos), 1);
+}
+
+static void host_var_clear(struct host_var_t *var) {
+  if(var->type == VCHAR && var->val.s != NULL) {
+    if(var->interned == 1) {
+      rules_unref(var->val.s);
+    } else {
+      FREE(var->val.s);
+    }
+  }
+  var->type = VNULL;
+  var->interned = 0;
+  var->val.s = NULL;
+}
+
+/*
+  Values are given as they would arrive from the heatpump,
+  a number becomes an integer or a float, nil clears the
+  value and anything else is a string.
+*/
+void host_value(const char *name, const char *value) {
+  struct host_var_t *var = host_var(name, 1);
+  char *end = NULL;
+  long i = 0;
+  float f = 0;
+
+  if(var == NULL) {
+    return;
+  }
+  host_var_clear(var);
+
+  if(strcmp(value, "nil") == 0) {
+    return;
+  }
+  i = strtol(value, &end, 10);
+  if(*value != '\0' && *end == '\0') {
+    var->type = VINTEGER;
+    var->val.i = i;
+    return;
+  }
+  f = strtof(value, &end);
+  if(*value != '\0' && *end == '\0') {
+    var->type = VFLOAT;
+    var->val.f = f;
+    return;
+  }
+  var->type = VCHAR;
+  var->val.s = STRDUP(value);
+}
+
+/*
+  One "name value" pair per line, # at the start
+  of a line followed by a space is a comment.
+*/
+int8_t host_values(const char *file) {
+  char line[256], name[128], value[128];
+  FILE *fp = NULL;
+
+  if((fp = fopen(file, "r")) == NULL) {
+    return -1;
+  }
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if((line[0] == '#' && isspace(line[1])) || line[0] == '\n') {
+      continue;
+    }
+    if(sscanf(line, "%127s %127s", name, value) == 2) {
+      host_value(name, value);
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int8_t is_variable(char *text, uint16_t size) {
+  uint16_t i = 1;
+
+  if(size == strlen("ds18b20#2800000000000000") && strncmp(text, "ds18b20#", 8) == 0) {
+    return 24;
+  } else if(text[0] == '$' || text[0] == '#' || text[0] == '@' || text[0] == '%' || text[0] == '?') {
+    while(isalnum(text[i]) || text[i] == '_') {
+      i++;
+    }
+    return i;
+  }
+  return -1;
+}
+
+static int8_t is_event(char *text, uint16_t size) {
+  if(text[0] == '@' || text[0] == '?') {
+    return size;
+  }
+
+  if(size == strlen("ds18b20#2800000000000000") && strncmp(text, "ds18b20#", 8) == 0) {
+    return 24;
+  }
+
+  /*
+   * A rule may call a block defined further down,
+   * so any other name is taken as a rule block.
+   */
+  return size;
+}
+
+static void done_cb(struct rules_t *) {
+}
+
+static int8_t event_cb(struct rules_t *obj, char *name) {
+  int8_t nr = rule_by_name(rules, nrrules, name);
+  if(nr == -1) {
+    return -1;
+  }
+
+  obj->ctx.go = rules[nr];
+  rules[nr]->ctx.ret = obj;
+
+  return 1;
+}
+
+static int8_t vm_value_get(struct rules_t *obj) {
+  struct host_var_t *var = NULL;
+
+  if(rules_gettop(obj) < 1 || rules_type(obj, -1) != VCHAR) {
+    return -1;
+  }
+
+  if((var = host_var_slot(obj, -1)) == NULL) {
+    rules_pushnil(obj);
+    return 0;
+  }
+
+  switch(var->type) {
+    case VINTEGER: {
+      rules_pushinteger(obj, var->val.i);
+    } break;
+    case VFLOAT: {
+      rules_pushfloat(obj, var->val.f);
+    } break;
+    case VCHAR: {
+      if(var->interned == 1) {
+        rules_pushinterned(obj, var->val.s);
+      } else {
+        rules_pushstring(obj, var->val.s);
+      }
+    } break;
+    default: {
+      rules_pushnil(obj);
+    } break;
+  }
+
+  return 0;
+}
+
+static int8_t vm_value_set(struct rules_t *obj) {
+  struct host_var_t *var = NULL;
+  uint8_t type = 0;
+
+  if(rules_gettop(obj) < 2) {
+    return -1;
+  }
+  type = rules_type(obj, -1);
+
+  if(rules_type(obj, -2) != VCHAR
+    || (type != VINTEGER && type != VFLOAT && type != VNULL && type != VCHAR)) {
+    return -1;
+  }
+
+  /*
+    The engine runs the rules while compiling them, the firmware
+    keeps nothing of that as its variables don't exist yet.
+  */
+  if(parsing == 1) {
+    return 0;
+  }
+
+  if((var = host_var_slot(obj, -2)) == NULL) {
+    return 0;
+  }
+
+  if(type == VCHAR && var->type == VCHAR && var->interned == 1 && rules_tostring(obj, -1) == var->val.s) {
+    return 0;
+  }
+  host_var_clear(var);
+
+  switch(type) {
+    case VINTEGER: {
+      var->val.i = rules_tointeger(obj, -1);
+    } break;
+    case VFLOAT: {
+      var->val.f = rules_tofloat(obj, -1);
+    } break;
+    case VCHAR: {
+      var->val.s = (char *)rules_tostring(obj, -1);
+      var->interned = 1;
+      rules_ref(var->val.s);
+    } break;
+  }
+  var->type = type;
+
+  if(parsing == 0 && host_trace == 1) {
+    switch(type) {
+      case VINTEGER: {
+        printf("%s = %d\n", var->name, var->val.i);
+      } break;
+      case VFLOAT: {
+        printf("%s = %g\n", var->name, var->val.f);
+      } break;
+      case VCHAR: {
+        printf("%s = %s\n", var->name, var->val.s);
+      } break;
+      default: {
+        printf("%s = nil\n", var->name);
+      } break;
+    }
+  }
+
+  return 0;
+}
+
+void host_init(void) {
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.done_cb = done_cb;
+  rule_options.vm_value_set = vm_value_set;
+  rule_options.vm_value_get = vm_value_get;
+  rule_options.event_cb = event_cb;
+}
+
+/*
+  Compiles the rules the same way the firmware does, the text
+  is placed at the end of the mempool and the bytecode grows
+  from the start towards it.
+*/
+static int8_t host_parse(const char *text, uint16_t len) {
+  struct pbuf input;
+  uint16_t i = 0, txtoffset = 0;
+  int8_t ret = 0;
+
+  if(len+5 > MEMPOOL_SIZE) {
+    return -1;
+  }
+
+  rules_gc(&rules, &nrrules);
+  FREE(slots);
+  nrslots = 0;
+
+  for(i=0;i<nrvars;i++) {
+    if(vars[i].interned == 1) {
+      vars[i].type = VNULL;
+      vars[i].interned = 0;
+      vars[i].val.s = NULL;
+    }
+  }
+
+  memset(mempool, 0, MEMPOOL_SIZE);
+  txtoffset = alignedbuffer(MEMPOOL_SIZE-len-5);
+  memcpy(&mempool[txtoffset], text, len);
+
+  memset(&mem, 0, sizeof(struct pbuf));
+  memset(&input, 0, sizeof(struct pbuf));
+
+  mem.payload = mempool;
+  mem.len = 0;
+  mem.tot_len = MEMPOOL_SIZE;
+
+  input.payload = &mempool[txtoffset];
+  input.len = txtoffset;
+  input.tot_len = len;
+
+  parsing = 1;
+  while((ret = rule_initialize(&input, &rules, &nrrules, &mem, NULL)) == 0) {
+    input.payload = &mempool[input.len];
+  }
+  parsing = 0;
+
+  return (ret == -1) ? -1 : 0;
+}
+
+static void host_slots(void) {
+  uint16_t i = 0;
+
+  rules_strings_build(rules, nrrules, &mem);
+
+  if((nrslots = rules_nrvars()) > 0) {
+    if((slots = (int16_t *)MALLOC(nrslots*sizeof(int16_t))) == NULL) {
+      OUT_OF_MEMORY
+      nrslots = 0;
+      return;
+    }
+    for(i=0;i<nrslots;i++) {
+      struct host_var_t *var = NULL;
+      const char *name = rules_varname(i);
+      slots[i] = -1;
+      if(name != NULL && (var = host_var(name, 1)) != NULL) {
+        slots[i] = var - vars;
+      }
+    }
+  }
+}
+
+int8_t host_compile(const char *text, uint16_t len) {
+  if(host_parse(text, len) == -1) {
+    return -1;
+  }
+  host_slots();
+  return 0;
+}
+
+static uint16_t dump_write(unsigned char *buf, uint16_t len) {
+  unsigned char *tmp = NULL;
+
+  if(dumppos+len > dumplen) {
+    if((tmp = (unsigned char *)REALLOC(dump, dumppos+len+MEMPOOL_SIZE)) == NULL) {
+      OUT_OF_MEMORY
+      return 0;
+    }
+    dump = tmp;
+    dumplen = dumppos+len+MEMPOOL_SIZE;
+  }
+  memcpy(&dump[dumppos], buf, len);
+  dumppos += len;
+  return len;
+}
+
+static uint16_t dump_read(unsigned char *buf, uint16_t len) {
+  if(dumppos+len > dumplen) {
+    len = dumplen-dumppos;
+  }
+  memcpy(buf, &dump[dumppos], len);
+  dumppos += len;
+  return len;
+}
+
+/*
+  Like a boot with stored bytecode, the compiled rules are
+  dumped before the string index is built and loaded again
+  into the other mempool.
+*/
+int8_t host_reload(const char *text, uint16_t len) {
+  int8_t ret = 0;
+
+  if(host_parse(text, len) == -1) {
+    return -1;
+  }
+
+  dumppos = 0;
+  ret = rules_dump(rules, nrrules, &mem, dump_write);
+  dumplen = dumppos;
+  rules_gc(&rules, &nrrules);
+  if(ret == -1) {
+    FREE(dump);
+    dumplen = 0;
+    return -1;
+  }
+
+  memset(reloadpool, 0, MEMPOOL_SIZE);
+  memset(&mem, 0, sizeof(struct pbuf));
+  mem.payload = reloadpool;
+  mem.len = 0;
+  mem.tot_len = MEMPOOL_SIZE;
+
+  dumppos = 0;
+  ret = rules_load(&rules, &nrrules, &mem, dump_read);
+  FREE(dump);
+  dumplen = 0;
+  if(ret == -1) {
+    return -1;
+  }
+
+  host_slots();
+  return 0;
+}
+
+/*
+  Locals only live for a single run, just like
+  on the heatpump.
+*/
+int8_t host_run(int8_t nr) {
+  uint16_t i = 0;
+  int8_t ret = 0;
+
+  if(nr < 0 || nr >= nrrules) {
+    return -1;
+  }
+
+  ret = rule_run(rules[nr], 0);
+
+  for(i=0;i<nrvars;i++) {
+    if(vars[i].name[0] == '$') {
+      host_var_clear(&vars[i]);
+    }
+  }
+  return ret;
+}
+
+/*
+  Rule blocks named after a variable, a sensor, the system
+  or a timer are triggered from the outside, the others are
+  only called by other rules.
+*/
+int8_t host_is_event(const char *name) {
+  return (name[0] == '@' || name[0] == '?' || name[0] == '%' ||
+    strncmp(name, "ds18b20#", 8) == 0 ||
+    strncasecmp(name, "system#", 7) == 0 ||
+    strncasecmp(name, "timer=", 6) == 0);
+}
+
+uint16_t host_mempool(void) {
+  return mem.len;
+}
@@ -0,0 +1,44 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "rules.h"
+
+/*
+  A small stand-in for the firmware glue so the rules engine can be
+  compiled, run and measured on a Linux host. Variables live in a
+  flat table, events are rule blocks and nothing is sent anywhere.
+*/
+
+extern struct rules_t **rules;
+extern uint8_t nrrules;
+
+/*
+  Print every variable set by a rule when enabled.
+*/
+extern uint8_t host_trace;
+
+void host_init(void);
+void host_value(const char *name, const char *value);
+int8_t host_values(const char *file);
+int8_t host_compile(const char *text, uint16_t len);
+int8_t host_reload(const char *text, uint16_t len);
+int8_t host_run(int8_t nr);
+int8_t host_is_event(const char *name);
+uint16_t host_mempool(void);
+void host_quiet(uint8_t on);
+char *host_file(const char *file, uint16_t *len);
+
+uint64_t host_ns(void);
+
+#endif
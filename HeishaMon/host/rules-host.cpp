@@ -0,0 +1,164 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/common/mem.h"
+#include "host.h"
+
+/*
+  Runs a rules file on the host.
+
+  rules-host run <file> [block ...]
+    Runs the given rule blocks, or all event blocks in order,
+    and prints every variable they set. What the engine logs
+    while compiling is shown as well.
+
+  rules-host reload <file> [block ...]
+    Like run, but the compiled rules are dumped and loaded
+    into a mempool at another address first.
+
+  rules-host bench <file> [runs]
+    Reports the compile time, the mempool used and the time
+    and instructions each event block takes per rule_run.
+
+  Values for the variables read by the rules are taken from
+  a file next to it with the .values extension.
+*/
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s run <file> [block ...]\n", name);
+  fprintf(stderr, "       %s reload <file> [block ...]\n", name);
+  fprintf(stderr, "       %s bench <file> [runs]\n", name);
+}
+
+static void load_values(const char *file) {
+  char name[256];
+  const char *dot = strrchr(file, '.');
+  size_t len = (dot != NULL) ? (size_t)(dot - file) : strlen(file);
+
+  if(len + strlen(".values") >= sizeof(name)) {
+    return;
+  }
+  memcpy(name, file, len);
+  strcpy(&name[len], ".values");
+  host_values(name);
+}
+
+static int do_run(char *text, uint16_t len, int8_t reload, int argc, char **argv) {
+  int8_t nr = 0;
+  int i = 0;
+
+  nr = (reload == 1) ? host_reload(text, len) : host_compile(text, len);
+  if(nr == -1) {
+    printf("compile failed\n");
+    return 1;
+  }
+
+  host_trace = 1;
+  if(argc == 0) {
+    for(i=0;i<nrrules;i++) {
+      if(host_is_event(rules[i]->name)) {
+        printf("-- %s\n", rules[i]->name);
+        printf("ret %d\n", host_run(i));
+      }
+    }
+  } else {
+    for(i=0;i<argc;i++) {
+      if((nr = rule_by_name(rules, nrrules, argv[i])) == -1) {
+        printf("-- %s not found\n", argv[i]);
+        continue;
+      }
+      printf("-- %s\n", rules[nr]->name);
+      printf("ret %d\n", host_run(nr));
+    }
+  }
+  host_trace = 0;
+  return 0;
+}
+
+static int do_bench(char *text, uint16_t len, uint32_t runs) {
+  uint64_t start = 0, ns = 0;
+  uint32_t i = 0, compiles = (runs / 100) + 1, ops = 0;
+  uint8_t x = 0;
+
+  host_quiet(1);
+  start = host_ns();
+  for(i=0;i<compiles;i++) {
+    if(host_compile(text, len) == -1) {
+      host_quiet(0);
+      printf("compile failed\n");
+      return 1;
+    }
+  }
+  ns = host_ns() - start;
+  host_quiet(0);
+
+  printf("rules: %d, compile: %llu ns, mempool: %d/%d bytes\n",
+    nrrules, (unsigned long long)(ns / compiles), host_mempool(), MEMPOOL_SIZE);
+
+  for(x=0;x<nrrules;x++) {
+    if(!host_is_event(rules[x]->name)) {
+      continue;
+    }
+    host_quiet(1);
+    ops = rules_ops();
+    start = host_ns();
+    for(i=0;i<runs;i++) {
+      host_run(x);
+    }
+    ns = host_ns() - start;
+    ops = rules_ops() - ops;
+    host_quiet(0);
+
+    printf("%-24s bytecode: %4d bytes, %8llu ns/run, %5u ops/run\n",
+      rules[x]->name, rules[x]->bc.nrbytes,
+      (unsigned long long)(ns / runs), ops / runs);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  uint32_t runs = 100000;
+  uint16_t len = 0;
+  char *text = NULL;
+  int ret = 0;
+
+  if(argc < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if((text = host_file(argv[2], &len)) == NULL) {
+    fprintf(stderr, "cannot read %s\n", argv[2]);
+    return 1;
+  }
+
+  host_init();
+  load_values(argv[2]);
+
+  if(strcmp(argv[1], "run") == 0) {
+    ret = do_run(text, len, 0, argc-3, &argv[3]);
+  } else if(strcmp(argv[1], "reload") == 0) {
+    ret = do_run(text, len, 1, argc-3, &argv[3]);
+  } else if(strcmp(argv[1], "bench") == 0) {
+    if(argc > 3 && atoi(argv[3]) > 0) {
+      runs = atoi(argv[3]);
+    }
+    ret = do_bench(text, len, runs);
+  } else {
+    usage(argv[0]);
+    ret = 1;
+  }
+
+  rules_gc(&rules, &nrrules);
+  FREE(text);
+  return ret;
+}
@@ -0,0 +1,213 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+/*
+  Exercises the timer queue on the host.
+
+  timers bench [timers] [ops]
+    Sets thousands of timers and measures moving them
+    around and firing them.
+
+  timers check [ops]
+    Runs random operations against the queue and a simple
+    reference model and stops at the first difference.
+
+  The queue is included directly so it runs on a clock
+  that is moved by hand, which also crosses the 32 bit
+  micros() wrap many times.
+*/
+
+static uint32_t clock_us = 0;
+
+static int host_gettimeofday(struct timeval *tv, void *) {
+  tv->tv_sec = clock_us / 1000000;
+  tv->tv_usec = clock_us % 1000000;
+  return 0;
+}
+
+#define gettimeofday host_gettimeofday
+#include "../src/common/timerqueue.cpp"
+#undef gettimeofday
+
+static std::vector<int> fired;
+static uint8_t resched = 0;
+
+/*
+  Every seventh timer sets another one from its callback,
+  like a rule that sets a new timer from a timer event.
+*/
+void timer_cb(int nr) {
+  fired.push_back(nr);
+  if(resched == 1 && nr % 7 == 0) {
+    timerqueue_insert(0, 1, nr + 1000000);
+  }
+}
+
+static int keep(int nr) {
+  return ((nr % 3) + 3) % 3 != 0;
+}
+
+static uint64_t host_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench(int n, int ops) {
+  uint64_t start = 0, insert = 0, update = 0;
+  int i = 0;
+
+  if(n > TIMERQUEUE_SIZE) {
+    n = TIMERQUEUE_SIZE;
+  }
+
+  srand(1);
+  start = host_ns();
+  for(i=1;i<=n;i++) {
+    timerqueue_insert(100 + rand() % 10000, 0, i);
+  }
+  insert = host_ns() - start;
+
+  start = host_ns();
+  for(i=0;i<ops;i++) {
+    timerqueue_insert(100 + rand() % 10000, 0, 1 + rand() % n);
+    clock_us += 50000;
+    timerqueue_update();
+    if(timerqueue_size() < n) {
+      timerqueue_insert(100 + rand() % 10000, 0, 1 + rand() % n);
+    }
+  }
+  update = host_ns() - start;
+
+  printf("timers: %d, insert: %llu ns/timer, reschedule and update: %llu ns/op, fired: %zu\n",
+    n, (unsigned long long)(insert / n), (unsigned long long)(update / ops), fired.size());
+  return 0;
+}
+
+typedef struct model_t {
+  uint64_t time;
+  uint32_t seq;
+} model_t;
+
+static int check(int ops) {
+  std::map<int, struct model_t> model;
+  std::map<int, struct model_t>::iterator it;
+  uint64_t now = 0;
+  uint32_t nrseq = 0;
+  int i = 0;
+
+  srand(5);
+  resched = 1;
+
+  for(i=0;i<ops;i++) {
+    if(rand() % 500 == 0) {
+      timerqueue_filter(keep);
+      for(it=model.begin();it!=model.end();) {
+        if(keep(it->first) == 0) {
+          it = model.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    } else if(rand() % 10 < 6) {
+      int nr = rand() % 300 - 10, sec = rand() % 20 - 2;
+      int64_t time = (int64_t)now + (int64_t)sec * 1000000;
+
+      if(model.count(nr) > 0) {
+        if(sec <= 0) {
+          model.erase(nr);
+        } else {
+          model[nr].time = time;
+          model[nr].seq = nrseq++;
+        }
+      } else if(sec != 0 && (int)model.size() < TIMERQUEUE_SIZE) {
+        model[nr].time = (time < 0) ? 0 : time;
+        model[nr].seq = nrseq++;
+      }
+      timerqueue_insert(sec, 0, nr);
+    } else {
+      std::vector<std::pair<std::pair<uint64_t, uint32_t>, int> > due;
+      std::vector<int> want;
+      uint32_t step = rand() % 3000000;
+      size_t x = 0;
+
+      clock_us += step;
+      now += step;
+
+      for(it=model.begin();it!=model.end();++it) {
+        if(it->second.time <= now) {
+          due.push_back(std::make_pair(std::make_pair(it->second.time, it->second.seq), it->first));
+        }
+      }
+      std::sort(due.begin(), due.end());
+
+      /*
+       * A timer set by a callback is due after now, so it
+       * never fires in the same update.
+       */
+      for(x=0;x<due.size();x++) {
+        int nr = due[x].second;
+        if(model.count(nr) == 0 || model[nr].time > now) {
+          continue;
+        }
+        want.push_back(nr);
+        model.erase(nr);
+        if(nr % 7 == 0) {
+          model[nr + 1000000].time = now + 1;
+          model[nr + 1000000].seq = nrseq++;
+        }
+      }
+
+      fired.clear();
+      timerqueue_update();
+
+      if(fired != want) {
+        printf("op %d: fired", i);
+        for(x=0;x<fired.size();x++) {
+          printf(" %d", fired[x]);
+        }
+        printf(", expected");
+        for(x=0;x<want.size();x++) {
+          printf(" %d", want[x]);
+        }
+        printf("\n");
+        return 1;
+      }
+    }
+
+    if((int)model.size() != timerqueue_size()) {
+      printf("op %d: %d timers, expected %zu\n", i, timerqueue_size(), model.size());
+      return 1;
+    }
+  }
+
+  printf("timers: %d ops match the model\n", ops);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return bench((argc > 2) ? atoi(argv[2]) : 4000, (argc > 3) ? atoi(argv[3]) : 1000000);
+  } else if(argc > 1 && strcmp(argv[1], "check") == 0) {
+    return check((argc > 2) ? atoi(argv[2]) : 2000000);
+  }
+  fprintf(stderr, "usage: %s bench [timers] [ops]\n", argv[0]);
+  fprintf(stderr, "       %s check [ops]\n", argv[0]);
+  return 1;
+}
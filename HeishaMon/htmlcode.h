@@ -391,6 +391,7 @@ static const char webBodyRoot1[] PROGMEM =
   "<a href=\"/rules\" class=\"w3-bar-item w3-button\">Rules</a>"
   "<a href=\"/togglelog\" class=\"w3-bar-item w3-button\">Toggle mqtt log</a>"
   "<a href=\"/togglehexdump\" class=\"w3-bar-item w3-button\">Toggle hexdump log</a>"
+  "<a href=\"/toggleruletrace\" class=\"w3-bar-item w3-button\">Toggle rules trace</a>"
   "<hr><div class=\"w3-text-grey\">Version: ";
 
 static const char webBodyRoot2[] PROGMEM =
@@ -452,6 +453,7 @@ static const char showRulesPage1[] PROGMEM =
   "<a href=\"/settings\" class=\"w3-bar-item w3-button\">Settings</a>"
   "<a href=\"/togglelog\" class=\"w3-bar-item w3-button\">Toggle mqtt log</a>"
   "<a href=\"/togglehexdump\" class=\"w3-bar-item w3-button\">Toggle hexdump log</a>"
+  "<a href=\"/toggleruletrace\" class=\"w3-bar-item w3-button\">Toggle rules trace</a>"
   "</div>"
   "<div class=\"w3-container w3-center\">"
   "  <h2>Rules</h2>"
@@ -464,6 +466,20 @@ static const char showRulesPage2[] PROGMEM =
   "  </form>"
   "</div>";
 
+static const char showRulesProfile1[] PROGMEM =
+  "<div class=\"w3-container w3-center\">"
+  "<h2>Rules profile</h2>"
+  "<table class=\"w3-table-all\"><thead><tr class=\"w3-red\"><th>Rule</th><th>Runs</th><th>Average (us)</th><th>Max (us)</th><th>Recent (us)</th><th>Instructions</th><th>Budget hits</th><th>Last trigger</th></tr></thead><tbody>";
+
+static const char showRulesProfileRow[] PROGMEM =
+  "<tr><td>%s</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%s</td></tr>";
+
+static const char showRulesProfile2[] PROGMEM =
+  "</tbody></table></div>";
+
+static const char showRulesStrings[] PROGMEM =
+  "<div class=\"w3-container w3-center\"><p>Interned strings: %u (%lu bytes, index of %u), %lu lookups, %lu%% hits</p></div>";
+
 static const char webBodyFactoryResetWarning[] PROGMEM =
   "<div class=\"w3-container w3-center\">"
   "<p>Removing configuration. To reconfigure please connect to WiFi hotspot after reset.</p>"
@@ -502,6 +518,7 @@ static const char webBodySettings1[] PROGMEM =
   "<a href=\"/rules\" class=\"w3-bar-item w3-button\">Rules</a>"
   "<a href=\"/togglelog\" class=\"w3-bar-item w3-button\">Toggle mqtt log</a>"
   "<a href=\"/togglehexdump\" class=\"w3-bar-item w3-button\">Toggle hexdump log</a>"
+  "<a href=\"/toggleruletrace\" class=\"w3-bar-item w3-button\">Toggle rules trace</a>"
   "</div>";
 
 static const char webCSS[] PROGMEM =
@@ -914,6 +931,20 @@ static const char settingsForm2[] PROGMEM =
   "      </tr>"
   "      <tr>"
   "        <td style=\"text-align:right; width: 50%\">"
+  "          Store values in flash while MQTT broker is unreachable:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"checkbox\" name=\"mqttSpool\" value=\"enabled\">"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Use MQTT 5 with topic aliases:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"checkbox\" name=\"mqtt5\" value=\"enabled\">"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
   "          Enable WiFi hotspot when not connected:</td>"
   "        <td style=\"text-align:left\">"
   "          <input type=\"checkbox\" name=\"hotspot\" value=\"enabled\">"
@@ -961,6 +992,20 @@ static const char settingsForm2[] PROGMEM =
   "          <input type=\"checkbox\" name=\"force_rules\" value=\"enabled\">"
   "        </td>"
   "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Run triggered rules once per received frame:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"checkbox\" name=\"coalesce_rules\" value=\"enabled\">"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Max instructions of a single rule run:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"number\" name=\"rulesBudget\" value=\"\"> (0 = no limit)"
+  "        </td>"
+  "      </tr>"
   "    </table>"
   "    <table style=\"width:100%\">"
   "      <tr>"
@@ -1100,6 +1145,20 @@ static const char settingsForm2[] PROGMEM =
   "        </td>"
   "      </tr>"
   "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Store values in flash while MQTT broker is unreachable:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"checkbox\" name=\"mqttSpool\" value=\"enabled\">"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Use MQTT 5 with topic aliases:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"checkbox\" name=\"mqtt5\" value=\"enabled\">"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
   "      <tr>"
   "        <td style=\"text-align:right; width: 50%\">"
   "          Enable WiFi hotspot when not connected:</td>"
@@ -1150,10 +1209,31 @@ static const char settingsForm2[] PROGMEM =
   "      </tr>"
   "      <tr>"
   "        <td style=\"text-align:right; width: 50%\">"
+  "          Max age of data answered to cztaw proxy before a fresh poll is forced:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"number\" name=\"proxyMaxAge\" value=\"\"> seconds (0 = always answer from cache)"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
   "          Force loading rules on boot (despite crash conditions):</td>"
   "        <td style=\"text-align:left\">"
   "          <input type=\"checkbox\" name=\"force_rules\" value=\"enabled\">"
   "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Run triggered rules once per received frame:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"checkbox\" name=\"coalesce_rules\" value=\"enabled\">"
+  "        </td>"
+  "      </tr>"
+  "      <tr>"
+  "        <td style=\"text-align:right; width: 50%\">"
+  "          Max instructions of a single rule run:</td>"
+  "        <td style=\"text-align:left\">"
+  "          <input type=\"number\" name=\"rulesBudget\" value=\"\"> (0 = no limit)"
+  "        </td>"
   "      </tr>"  
   "    </table>"
   "    <table style=\"width:100%\">"
@@ -1382,6 +1462,7 @@ static const char showFirmwarePage[] PROGMEM =
   "<a href=\"/settings\" class=\"w3-bar-item w3-button\">Settings</a>"
   "<a href=\"/togglelog\" class=\"w3-bar-item w3-button\">Toggle mqtt log</a>"
   "<a href=\"/togglehexdump\" class=\"w3-bar-item w3-button\">Toggle hexdump log</a>"
+  "<a href=\"/toggleruletrace\" class=\"w3-bar-item w3-button\">Toggle rules trace</a>"
   "</div>"
   "<div class=\"w3-container w3-center\">"
   "   <form method=\"POST\" action=\"\" enctype=\"multipart/form-data\">"
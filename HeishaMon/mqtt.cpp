@@ -0,0 +1,451 @@
+#include <PubSubClient.h>
+#include <LittleFS.h>
+#include "mqtt.h"
+#include "mqtt5.h"
+#include "commands.h"
+#include "webfunctions.h"
+#include "src/common/mem.h"
+
+extern settingsStruct heishamonSettings;
+extern MQTT5Client mqtt_client;
+extern dallasDataStruct* actDallasData;
+extern int dallasDevicecount;
+
+static char *topicarena = NULL; // all full topic strings after each other
+static uint16_t topicoffset[MQTT_TOPIC_COUNT]; // offset of each topic id in the arena
+
+struct mqttmsg_t {
+  uint16_t id;
+  uint16_t len;
+  bool retain;
+  unsigned long queued; // millis when queued, for latency stats
+  uint8_t *payload;
+};
+
+struct mqttqueue_t {
+  struct mqttmsg_t *msgs;
+  uint16_t size;
+  uint16_t start;
+  uint16_t nr;
+};
+
+static struct mqttmsg_t highmsgs[MQTTQUEUESIZE_HIGH];
+static struct mqttmsg_t normalmsgs[MQTTQUEUESIZE_NORMAL];
+static struct mqttmsg_t lowmsgs[MQTTQUEUESIZE_LOW];
+
+static struct mqttqueue_t mqttqueue[3] = {
+  { highmsgs, MQTTQUEUESIZE_HIGH, 0, 0 },
+  { normalmsgs, MQTTQUEUESIZE_NORMAL, 0, 0 },
+  { lowmsgs, MQTTQUEUESIZE_LOW, 0, 0 }
+};
+
+static struct mqttqueuestats_t queuestats = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+static unsigned long latencysum = 0;
+static unsigned long latencycount = 0;
+
+struct mqttinmsg_t {
+  uint8_t type;
+  uint8_t topiclen;
+  uint16_t len;
+  unsigned long received; // millis when received, for latency stats
+  char data[MQTTINQUEUESLOT]; // subtopic and payload, both null terminated
+};
+
+static struct mqttinmsg_t inmsgs[MQTTINQUEUESIZE];
+static uint8_t instart = 0;
+static uint8_t innr = 0;
+static unsigned long inlatencysum = 0;
+static unsigned long inlatencycount = 0;
+
+static const char *spoolNew = "/spool.new";
+static const char *spoolOld = "/spool.old";
+static bool spoolPending = true; // spool files may be left from before a reboot
+static File spoolFile; // kept open for appending while the broker is unreachable
+static uint32_t spoolReplayPos = 0; // bytes of the oldest spool file already replayed
+static unsigned long spoolReplayTime = 0;
+
+static uint16_t topicPart(char *arena, uint16_t ptr, const char *str, bool progmem) {
+  size_t len = progmem ? strlen_P(str) : strlen(str);
+  if (arena != NULL) {
+    if (progmem) {
+      memcpy_P(&arena[ptr], str, len);
+    } else {
+      memcpy(&arena[ptr], str, len);
+    }
+  }
+  return ptr + len;
+}
+
+/*
+  Fills the arena with all topics and returns the number of bytes used.
+  When arena is NULL only the offsets and needed size are calculated.
+*/
+static uint16_t fillTopics(char *arena) {
+  uint16_t ptr = 0;
+  for (uint16_t i = 0; i < MQTT_TOPIC_COUNT; i++) {
+    const char *group = NULL;
+    const char *name = NULL;
+    const char *suffix = NULL;
+    bool progmem = false;
+    char port[4];
+
+    if (i < MQTT_TOPIC_EXTRA) {
+      group = mqtt_topic_values;
+      name = topics[i - MQTT_TOPIC_MAIN];
+      progmem = true;
+    } else if (i < MQTT_TOPIC_OPT) {
+      group = mqtt_topic_xvalues;
+      name = xtopics[i - MQTT_TOPIC_EXTRA];
+      progmem = true;
+    } else if (i < MQTT_TOPIC_S0_WATTHOUR) {
+      group = mqtt_topic_pcbvalues;
+      name = optTopics[i - MQTT_TOPIC_OPT];
+      progmem = true;
+    } else if (i < MQTT_TOPIC_OT) {
+      uint16_t s0 = (i - MQTT_TOPIC_S0_WATTHOUR) % NUM_S0_COUNTERS;
+      group = mqtt_topic_s0;
+      if (i < MQTT_TOPIC_S0_WATTHOURTOTAL) {
+        name = "Watthour";
+      } else if (i < MQTT_TOPIC_S0_WATT) {
+        name = "WatthourTotal";
+      } else {
+        name = "Watt";
+      }
+      itoa(s0 + 1, port, 10);
+      suffix = port;
+    } else if (i < MQTT_TOPIC_DALLAS) {
+      group = mqtt_topic_opentherm_write;
+      name = heishaOTDataStruct[i - MQTT_TOPIC_OT].name;
+    } else if (i < MQTT_TOPIC_DALLAS_ALIAS) {
+      if ((i - MQTT_TOPIC_DALLAS) < dallasDevicecount) {
+        group = mqtt_topic_1wire;
+        name = actDallasData[i - MQTT_TOPIC_DALLAS].address;
+      }
+    } else if (i < MQTT_TOPIC_LWT) {
+      if ((i - MQTT_TOPIC_DALLAS_ALIAS) < dallasDevicecount) {
+        group = mqtt_topic_1wire;
+        name = actDallasData[i - MQTT_TOPIC_DALLAS_ALIAS].address;
+        suffix = "alias";
+      }
+    } else {
+      switch (i) {
+        case MQTT_TOPIC_LWT: name = mqtt_willtopic; break;
+        case MQTT_TOPIC_IP: name = mqtt_iptopic; break;
+        case MQTT_TOPIC_LOG: name = mqtt_logtopic; break;
+        case MQTT_TOPIC_STATS: name = "stats"; break;
+        case MQTT_TOPIC_HISTORY: name = "history"; break;
+        case MQTT_TOPIC_RAW_DATA: group = "raw"; name = "data"; break;
+        case MQTT_TOPIC_RAW_DATAEXTRA: group = "raw"; name = "dataextra"; break;
+      }
+    }
+
+    topicoffset[i] = ptr;
+    if (name != NULL) {
+      ptr = topicPart(arena, ptr, heishamonSettings.mqtt_topic_base, false);
+      if (group != NULL) {
+        ptr = topicPart(arena, ptr, "/", false);
+        ptr = topicPart(arena, ptr, group, false);
+      }
+      ptr = topicPart(arena, ptr, "/", false);
+      ptr = topicPart(arena, ptr, name, progmem);
+      if (suffix != NULL) {
+        ptr = topicPart(arena, ptr, "/", false);
+        ptr = topicPart(arena, ptr, suffix, false);
+      }
+    }
+    if (arena != NULL) {
+      arena[ptr] = '\0';
+    }
+    ptr++;
+  }
+  return ptr;
+}
+
+void mqtt_topics_build() {
+  mqtt_client.resetAliases(); //the aliases point into the arena
+  uint16_t size = fillTopics(NULL);
+  char *arena = (char *)REALLOC(topicarena, size);
+  if (arena == NULL) {
+    OUT_OF_MEMORY
+    FREE(topicarena); //offsets don't match the old arena anymore
+    return;
+  }
+  topicarena = arena;
+  fillTopics(topicarena);
+}
+
+const char *mqtt_topic_by_id(uint16_t id) {
+  if (topicarena == NULL || id >= MQTT_TOPIC_COUNT) {
+    return "";
+  }
+  return &topicarena[topicoffset[id]];
+}
+
+static uint8_t topicPriority(uint16_t id) {
+  switch (id) {
+    case MQTT_TOPIC_LWT:
+    case MQTT_TOPIC_IP:
+      return MQTT_PRIO_HIGH;
+    case MQTT_TOPIC_LOG:
+    case MQTT_TOPIC_HISTORY:
+    case MQTT_TOPIC_RAW_DATA:
+    case MQTT_TOPIC_RAW_DATAEXTRA:
+      return MQTT_PRIO_LOW;
+  }
+  return MQTT_PRIO_NORMAL;
+}
+
+static bool queueMessage(uint16_t id, const uint8_t *value, unsigned int len, bool retain) {
+  if (id >= MQTT_TOPIC_COUNT || mqtt_topic_by_id(id)[0] == '\0') {
+    return false;
+  }
+  struct mqttqueue_t *queue = &mqttqueue[topicPriority(id)];
+  struct mqttmsg_t *msg = NULL;
+
+  if (id != MQTT_TOPIC_LOG && id != MQTT_TOPIC_HISTORY) {
+    //a newer value for a topic which is still waiting replaces the old value, so only the latest state is sent
+    for (uint16_t i = 0; i < queue->nr; i++) {
+      struct mqttmsg_t *tmp = &queue->msgs[(queue->start + i) % queue->size];
+      if (tmp->id == id) {
+        msg = tmp;
+        break;
+      }
+    }
+  }
+  if (msg == NULL) {
+    if (queue->nr >= queue->size) {
+      queuestats.drops++;
+      return false;
+    }
+    msg = &queue->msgs[(queue->start + queue->nr) % queue->size];
+    msg->payload = NULL;
+    msg->queued = millis();
+    queue->nr++;
+  }
+  uint8_t *payload = (uint8_t *)REALLOC(msg->payload, len + 1);
+  if (payload == NULL) {
+    OUT_OF_MEMORY
+    FREE(msg->payload);
+    msg->len = 0;
+    queuestats.drops++;
+    return false;
+  }
+  memcpy(payload, value, len);
+  payload[len] = '\0';
+  msg->payload = payload;
+  msg->len = len;
+  msg->id = id;
+  msg->retain = retain;
+
+  uint16_t depth = mqttqueue[MQTT_PRIO_HIGH].nr + mqttqueue[MQTT_PRIO_NORMAL].nr + mqttqueue[MQTT_PRIO_LOW].nr;
+  if (depth > queuestats.maxdepth) {
+    queuestats.maxdepth = depth;
+  }
+  return true;
+}
+
+static bool spoolTopic(uint16_t id) {
+  //only values, the dallas aliases, status topics and raw data are of no use afterwards
+  return id < MQTT_TOPIC_DALLAS_ALIAS;
+}
+
+static void spoolRotate() {
+  spoolFile.close();
+  if (LittleFS.exists(spoolOld)) {
+    //the oldest values are dropped, replay continues at the start of the next file
+    LittleFS.remove(spoolOld);
+    spoolReplayPos = 0;
+  }
+  LittleFS.rename(spoolNew, spoolOld);
+}
+
+static void spoolMessage(uint16_t id, const uint8_t *value, unsigned int len) {
+  if (!heishamonSettings.mqttSpool || !spoolTopic(id) || len > 255) {
+    return;
+  }
+  if (spoolFile && (spoolFile.size() + 7 + len) > MQTTSPOOLSIZE) {
+    spoolRotate();
+  }
+  if (!spoolFile) {
+    spoolFile = LittleFS.open(spoolNew, "a");
+    if (!spoolFile) {
+      return;
+    }
+  }
+  uint32_t now = time(NULL);
+  uint8_t size = len;
+  spoolFile.write((uint8_t *)&now, sizeof(now));
+  spoolFile.write((uint8_t *)&id, sizeof(id));
+  spoolFile.write(&size, sizeof(size));
+  spoolFile.write(value, len);
+  spoolPending = true;
+  queuestats.spooled++;
+}
+
+bool mqtt_publish_id(uint16_t id, const char *value, bool retain) {
+  if (!mqtt_client.connected()) {
+    spoolMessage(id, (const uint8_t *)value, strlen(value));
+  }
+  return queueMessage(id, (const uint8_t *)value, strlen(value), retain);
+}
+
+bool mqtt_publish_id(uint16_t id, const uint8_t *value, unsigned int len, bool retain) {
+  if (!mqtt_client.connected()) {
+    spoolMessage(id, value, len);
+  }
+  return queueMessage(id, value, len, retain);
+}
+
+void mqtt_queue_loop() {
+  unsigned long start = millis();
+  uint8_t prio = MQTT_PRIO_HIGH;
+
+  while (mqtt_client.connected() && ((unsigned long)(millis() - start) < MQTTQUEUEBUDGET)) {
+    while (prio <= MQTT_PRIO_LOW && mqttqueue[prio].nr == 0) {
+      prio++;
+    }
+    if (prio > MQTT_PRIO_LOW) {
+      break;
+    }
+    struct mqttqueue_t *queue = &mqttqueue[prio];
+    struct mqttmsg_t *msg = &queue->msgs[queue->start];
+    const char *topic = mqtt_topic_by_id(msg->id);
+    uint32_t expiry = 0;
+    const char *contentType = NULL;
+    if (msg->id == MQTT_TOPIC_RAW_DATA || msg->id == MQTT_TOPIC_RAW_DATAEXTRA) {
+      //raw data is only of use for a short while, only used with mqtt 5
+      expiry = MQTTRAWEXPIRY;
+      contentType = "application/octet-stream";
+    }
+    unsigned long skipped = mqtt_client.packetsSkipped();
+    if (msg->payload != NULL && topic[0] != '\0' && !mqtt_client.publish(topic, msg->payload, msg->len, msg->retain, expiry, contentType)) {
+      //connection is broken, keep the message so it is sent again after reconnecting
+      queuestats.failures++;
+      mqtt_client.disconnect();
+      break;
+    }
+    if (mqtt_client.packetsSkipped() != skipped) {
+      queuestats.drops++;
+    }
+    unsigned long latency = millis() - msg->queued;
+    latencysum += latency;
+    latencycount++;
+    if (latency > queuestats.latencymax) {
+      queuestats.latencymax = latency;
+    }
+    FREE(msg->payload);
+    queue->start = (queue->start + 1) % queue->size;
+    queue->nr--;
+  }
+}
+
+void mqtt_spool_loop() {
+  if (!mqtt_client.connected()) {
+    return;
+  }
+  if (spoolFile) {
+    spoolFile.close();
+  }
+  //current values go first, history is replayed when there is room left
+  if (!spoolPending || mqttqueue[MQTT_PRIO_NORMAL].nr > 0 || (mqttqueue[MQTT_PRIO_LOW].size - mqttqueue[MQTT_PRIO_LOW].nr) < MQTTSPOOLBATCH) {
+    return;
+  }
+  if ((unsigned long)(millis() - spoolReplayTime) < MQTTSPOOLINTERVAL) {
+    return;
+  }
+  spoolReplayTime = millis();
+
+  const char *fname = spoolOld;
+  if (!LittleFS.exists(spoolOld)) {
+    if (!LittleFS.exists(spoolNew)) {
+      spoolPending = false;
+      return;
+    }
+    fname = spoolNew;
+  }
+  File f = LittleFS.open(fname, "r");
+  if (!f) {
+    return;
+  }
+  f.seek(spoolReplayPos);
+  for (uint8_t i = 0; i < MQTTSPOOLBATCH && f.available() >= 7; i++) {
+    uint32_t recordtime = 0;
+    uint16_t id = 0;
+    uint8_t len = 0;
+    char value[256];
+    char history[MAX_TOPIC_LEN + 384];
+    f.read((uint8_t *)&recordtime, sizeof(recordtime));
+    f.read((uint8_t *)&id, sizeof(id));
+    f.read(&len, sizeof(len));
+    if (f.read((uint8_t *)value, len) != len) {
+      break;
+    }
+    value[len] = '\0';
+    const char *topic = mqtt_topic_by_id(id);
+    size_t baselen = strlen(heishamonSettings.mqtt_topic_base);
+    if (strncmp(topic, heishamonSettings.mqtt_topic_base, baselen) == 0 && topic[baselen] == '/') {
+      topic += baselen + 1;
+    }
+    snprintf_P(history, sizeof(history), PSTR("{\"time\":%lu,\"topic\":\"%s\",\"value\":\"%s\"}"), (unsigned long)recordtime, topic, value);
+    queueMessage(MQTT_TOPIC_HISTORY, (const uint8_t *)history, strlen(history), false);
+    queuestats.replayed++;
+  }
+  if (f.available() >= 7) {
+    spoolReplayPos = f.position();
+    f.close();
+  } else {
+    f.close();
+    LittleFS.remove(fname);
+    spoolReplayPos = 0;
+  }
+}
+
+bool mqtt_inqueue_push(uint8_t type, const char *subtopic, const uint8_t *payload, unsigned int len) {
+  size_t topiclen = strlen(subtopic);
+  if (innr >= MQTTINQUEUESIZE || (topiclen + len + 2) > MQTTINQUEUESLOT) {
+    queuestats.indrops++;
+    return false;
+  }
+  struct mqttinmsg_t *msg = &inmsgs[(instart + innr) % MQTTINQUEUESIZE];
+  msg->type = type;
+  msg->topiclen = topiclen;
+  msg->len = len;
+  msg->received = millis();
+  memcpy(msg->data, subtopic, topiclen + 1);
+  memcpy(&msg->data[topiclen + 1], payload, len);
+  msg->data[topiclen + 1 + len] = '\0';
+  innr++;
+  return true;
+}
+
+void mqtt_inqueue_loop(void (*cb)(uint8_t type, char *subtopic, char *payload, unsigned int len)) {
+  unsigned long start = millis();
+  while (innr > 0 && ((unsigned long)(millis() - start) < MQTTQUEUEBUDGET)) {
+    struct mqttinmsg_t *msg = &inmsgs[instart];
+    unsigned long latency = millis() - msg->received;
+    inlatencysum += latency;
+    inlatencycount++;
+    if (latency > queuestats.inlatencymax) {
+      queuestats.inlatencymax = latency;
+    }
+    //the slot is released after the callback, messages received meanwhile go into the next free slots
+    cb(msg->type, msg->data, &msg->data[msg->topiclen + 1], msg->len);
+    instart = (instart + 1) % MQTTINQUEUESIZE;
+    innr--;
+  }
+}
+
+void mqtt_queue_stats(struct mqttqueuestats_t *stats) {
+  queuestats.depth = mqttqueue[MQTT_PRIO_HIGH].nr + mqttqueue[MQTT_PRIO_NORMAL].nr + mqttqueue[MQTT_PRIO_LOW].nr;
+  queuestats.latencyavg = (latencycount > 0) ? (latencysum / latencycount) : 0;
+  queuestats.indepth = innr;
+  queuestats.inlatencyavg = (inlatencycount > 0) ? (inlatencysum / inlatencycount) : 0;
+  memcpy(stats, &queuestats, sizeof(struct mqttqueuestats_t));
+  //latency is measured per stats interval
+  queuestats.latencymax = 0;
+  latencysum = 0;
+  latencycount = 0;
+  queuestats.inlatencymax = 0;
+  inlatencysum = 0;
+  inlatencycount = 0;
+}
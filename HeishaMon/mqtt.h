@@ -0,0 +1,111 @@
+#ifndef _MQTT_H_
+#define _MQTT_H_
+
+#include <PubSubClient.h>
+#include "decode.h"
+#include "dallas.h"
+#include "s0.h"
+#include "HeishaOT.h"
+
+/*
+  Every topic we publish to gets a fixed id. The full topic strings
+  (<base>/<group>/<name>) are built once into a single arena when the
+  settings are loaded, so publishing doesn't need any formatting.
+*/
+enum mqtt_topic_id_t {
+  MQTT_TOPIC_MAIN = 0,
+  MQTT_TOPIC_EXTRA = MQTT_TOPIC_MAIN + NUMBER_OF_TOPICS,
+  MQTT_TOPIC_OPT = MQTT_TOPIC_EXTRA + NUMBER_OF_TOPICS_EXTRA,
+  MQTT_TOPIC_S0_WATTHOUR = MQTT_TOPIC_OPT + NUMBER_OF_OPT_TOPICS,
+  MQTT_TOPIC_S0_WATTHOURTOTAL = MQTT_TOPIC_S0_WATTHOUR + NUM_S0_COUNTERS,
+  MQTT_TOPIC_S0_WATT = MQTT_TOPIC_S0_WATTHOURTOTAL + NUM_S0_COUNTERS,
+  MQTT_TOPIC_OT = MQTT_TOPIC_S0_WATT + NUM_S0_COUNTERS,
+  MQTT_TOPIC_DALLAS = MQTT_TOPIC_OT + NUMBER_OF_OT_VALUES,
+  MQTT_TOPIC_DALLAS_ALIAS = MQTT_TOPIC_DALLAS + MAX_DALLAS_SENSORS,
+  MQTT_TOPIC_LWT = MQTT_TOPIC_DALLAS_ALIAS + MAX_DALLAS_SENSORS,
+  MQTT_TOPIC_IP,
+  MQTT_TOPIC_LOG,
+  MQTT_TOPIC_STATS,
+  MQTT_TOPIC_HISTORY,
+  MQTT_TOPIC_RAW_DATA,
+  MQTT_TOPIC_RAW_DATAEXTRA,
+  MQTT_TOPIC_COUNT
+};
+
+/*
+  Publishing only queues the message. The queues are drained from
+  mqtt_queue_loop() within a small time budget, so a slow broker never
+  blocks the main loop for long. LWT and ip go before the values, log
+  and raw data go last.
+*/
+#define MQTT_PRIO_HIGH 0
+#define MQTT_PRIO_NORMAL 1
+#define MQTT_PRIO_LOW 2
+
+#if defined(ESP8266)
+#define MQTTQUEUESIZE_NORMAL 160 // a full refresh of all values should fit
+#else
+#define MQTTQUEUESIZE_NORMAL 256
+#endif
+#define MQTTQUEUESIZE_HIGH 8
+#define MQTTQUEUESIZE_LOW 32
+#define MQTTQUEUEBUDGET 10 // max millis per loop spent on publishing
+#define MQTTRAWEXPIRY 60 // seconds the broker keeps raw data messages (mqtt 5 only)
+
+/*
+  Received messages are copied into a fixed pool of slots by the
+  PubSubClient callback and handled in order from loop(), so messages
+  arriving while another one is handled are not lost anymore.
+*/
+#define MQTT_IN_COMMAND 1 // <base>/commands/<name>
+#define MQTT_IN_RAW 2 // <base>/SendRawValue
+#define MQTT_IN_S0 3 // <base>/s0/WatthourTotal/<port>
+#define MQTT_IN_OPENTHERM 4 // <base>/opentherm/read/<name>
+#define MQTT_IN_GPIO 5 // <base>/gpio/<name>
+#define MQTT_IN_RAWDATA 6 // raw data from another heishamon for debugging
+
+#if defined(ESP8266)
+#define MQTTINQUEUESIZE 8
+#else
+#define MQTTINQUEUESIZE 24
+#endif
+#define MQTTINQUEUESLOT 240 // max bytes of subtopic and payload per message
+
+/*
+  When enabled, values published while the broker is unreachable are
+  also appended to a spool in LittleFS. The spool is two files of at
+  most MQTTSPOOLSIZE bytes, the oldest file is dropped when the newest
+  is full. After reconnecting the records are replayed in small batches
+  to <base>/history as {"time":..,"topic":..,"value":..}, so the
+  retained value topics are not overwritten with old values.
+*/
+#define MQTTSPOOLSIZE 16384
+#define MQTTSPOOLBATCH 8 // records replayed per batch
+#define MQTTSPOOLINTERVAL 200 // millis between replayed batches
+
+struct mqttqueuestats_t {
+  uint16_t depth; // messages currently waiting
+  uint16_t maxdepth; // max messages waiting since boot
+  unsigned long drops; // messages dropped because the queue was full or the broker would refuse them
+  unsigned long failures; // publishes failed on the connection, these are retried
+  unsigned long latencyavg; // average millis between queueing and publishing since last stats
+  unsigned long latencymax; // max millis between queueing and publishing since last stats
+  uint16_t indepth; // received messages currently waiting
+  unsigned long indrops; // received messages dropped because the queue was full or the message too large
+  unsigned long inlatencyavg; // average millis between receiving and handling since last stats
+  unsigned long inlatencymax; // max millis between receiving and handling since last stats
+  unsigned long spooled; // values stored in the spool since boot
+  unsigned long replayed; // values replayed from the spool since boot
+};
+
+void mqtt_topics_build();
+const char *mqtt_topic_by_id(uint16_t id);
+bool mqtt_publish_id(uint16_t id, const char *value, bool retain);
+bool mqtt_publish_id(uint16_t id, const uint8_t *value, unsigned int len, bool retain);
+void mqtt_queue_loop();
+void mqtt_spool_loop();
+bool mqtt_inqueue_push(uint8_t type, const char *subtopic, const uint8_t *payload, unsigned int len);
+void mqtt_inqueue_loop(void (*cb)(uint8_t type, char *subtopic, char *payload, unsigned int len));
+void mqtt_queue_stats(struct mqttqueuestats_t *stats);
+
+#endif
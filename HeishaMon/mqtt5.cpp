@@ -0,0 +1,646 @@
+#include "mqtt5.h"
+#include "src/common/mem.h"
+
+#define MQTT5HEADER 5 // room for the fixed header in front of each packet in the buffer
+
+#define MQTT5_PROP_PAYLOAD_FORMAT 0x01
+#define MQTT5_PROP_MESSAGE_EXPIRY 0x02
+#define MQTT5_PROP_CONTENT_TYPE 0x03
+#define MQTT5_PROP_SERVER_KEEPALIVE 0x13
+#define MQTT5_PROP_TOPIC_ALIAS_MAX 0x22
+#define MQTT5_PROP_TOPIC_ALIAS 0x23
+#define MQTT5_PROP_USER_PROPERTY 0x26
+#define MQTT5_PROP_MAX_PACKET_SIZE 0x27
+
+static uint32_t topicHash(const char *topic) {
+  //FNV-1a
+  uint32_t hash = 2166136261UL;
+  while (*topic) {
+    hash ^= (uint8_t)*topic++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+static uint8_t varintSize(uint32_t value) {
+  uint8_t size = 1;
+  while (value >= 128) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+static uint16_t writeVarint(uint8_t *buf, uint16_t pos, uint32_t value) {
+  do {
+    uint8_t b = value % 128;
+    value /= 128;
+    if (value > 0) {
+      b |= 0x80;
+    }
+    buf[pos++] = b;
+  } while (value > 0);
+  return pos;
+}
+
+static int readVarint(const uint8_t *buf, uint32_t length, uint32_t pos, uint32_t *value) {
+  uint32_t multiplier = 1;
+  *value = 0;
+  for (uint8_t i = 0; i < 4 && pos < length; i++) {
+    uint8_t b = buf[pos++];
+    *value += (b & 0x7F) * multiplier;
+    if ((b & 0x80) == 0) {
+      return pos;
+    }
+    multiplier *= 128;
+  }
+  return -1;
+}
+
+static uint16_t writeString(uint8_t *buf, uint16_t pos, const char *str) {
+  uint16_t len = strlen(str);
+  if ((uint32_t)pos + 2 + len > MQTT5BUFFERSIZE) {
+    return 0;
+  }
+  buf[pos++] = len >> 8;
+  buf[pos++] = len & 0xFF;
+  memcpy(&buf[pos], str, len);
+  return pos + len;
+}
+
+/*
+  Returns the number of bytes of a property value, so properties we
+  don't use can be skipped, or -1 if the property is unknown or doesn't fit.
+*/
+static int propertySize(uint8_t id, const uint8_t *buf, uint32_t length, uint32_t pos) {
+  switch (id) {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+      return 1;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+      return 2;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+      return 4;
+    case 0x0B: {
+        uint32_t value = 0;
+        int end = readVarint(buf, length, pos, &value);
+        return (end < 0) ? -1 : (end - pos);
+      } break;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+      if (pos + 2 > length) {
+        return -1;
+      }
+      return 2 + ((buf[pos] << 8) | buf[pos + 1]);
+    case MQTT5_PROP_USER_PROPERTY: {
+        if (pos + 2 > length) {
+          return -1;
+        }
+        uint32_t keylen = 2 + ((buf[pos] << 8) | buf[pos + 1]);
+        if (pos + keylen + 2 > length) {
+          return -1;
+        }
+        return keylen + 2 + ((buf[pos + keylen] << 8) | buf[pos + keylen + 1]);
+      } break;
+  }
+  return -1;
+}
+
+MQTT5Client::MQTT5Client() : PubSubClient() {
+  this->version5 = false;
+  this->client5 = NULL;
+  this->buffer5 = NULL;
+  this->state5 = MQTT_DISCONNECTED;
+  this->keepAlive5 = MQTT_KEEPALIVE;
+  this->nextMsgId = 0;
+  this->lastOutActivity = 0;
+  this->lastInActivity = 0;
+  this->pingOutstanding = false;
+  this->maxPacketSize = 0;
+  this->aliasMax = 0;
+  this->aliasCount = 0;
+  this->aliasSlots = 0;
+  this->aliasTopic = NULL;
+  this->aliasIndex = NULL;
+  this->skipped = 0;
+  this->callback = NULL;
+}
+
+void MQTT5Client::setVersion5(bool enabled) {
+  if (enabled && this->buffer5 == NULL) {
+    if ((this->buffer5 = (uint8_t *)MALLOC(MQTT5BUFFERSIZE)) == NULL) {
+      OUT_OF_MEMORY
+      enabled = false;
+    }
+  } else if (!enabled) {
+    FREE(this->buffer5);
+  }
+  this->version5 = enabled;
+}
+
+bool MQTT5Client::isVersion5() {
+  return this->version5;
+}
+
+MQTT5Client &MQTT5Client::setClient(Client &client) {
+  this->client5 = &client;
+  PubSubClient::setClient(client);
+  return *this;
+}
+
+MQTT5Client &MQTT5Client::setKeepAlive(uint16_t keepAlive) {
+  this->keepAlive5 = keepAlive;
+  PubSubClient::setKeepAlive(keepAlive);
+  return *this;
+}
+
+MQTT5Client &MQTT5Client::setCallback(MQTT_CALLBACK_SIGNATURE) {
+  this->callback = callback;
+  PubSubClient::setCallback(callback);
+  return *this;
+}
+
+uint16_t MQTT5Client::aliasesUsed() {
+  return this->version5 ? this->aliasCount : 0;
+}
+
+/*
+  Forgets all aliases, the next publish of a topic assigns a new one.
+  The broker takes the new mapping as it comes with the full topic.
+*/
+void MQTT5Client::resetAliases() {
+  this->aliasCount = 0;
+  if (this->aliasIndex != NULL) {
+    memset(this->aliasIndex, 0, sizeof(uint16_t) * this->aliasSlots);
+  }
+}
+
+unsigned long MQTT5Client::packetsSkipped() {
+  return this->skipped;
+}
+
+bool MQTT5Client::readByte(uint8_t *b) {
+  unsigned long start = millis();
+  while (!this->client5->available()) {
+    if (!this->client5->connected() || (unsigned long)(millis() - start) >= MQTT5TIMEOUT) {
+      return false;
+    }
+    yield();
+  }
+  *b = this->client5->read();
+  return true;
+}
+
+/*
+  Reads a whole packet, the variable header and payload end up in the
+  buffer. Packets larger than the buffer are read but truncated.
+*/
+bool MQTT5Client::readPacket(uint8_t *header, uint32_t *length) {
+  uint8_t b = 0;
+  uint32_t multiplier = 1;
+  if (!this->readByte(header)) {
+    return false;
+  }
+  *length = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    if (!this->readByte(&b)) {
+      return false;
+    }
+    *length += (b & 0x7F) * multiplier;
+    if ((b & 0x80) == 0) {
+      break;
+    }
+    multiplier *= 128;
+  }
+  for (uint32_t i = 0; i < *length; i++) {
+    if (!this->readByte(&b)) {
+      return false;
+    }
+    if (i < MQTT5BUFFERSIZE) {
+      this->buffer5[i] = b;
+    }
+  }
+  this->lastInActivity = millis();
+  return true;
+}
+
+/*
+  Sends the packet of which the variable header and payload are already
+  in the buffer after the room reserved for the fixed header.
+*/
+bool MQTT5Client::sendPacket(uint8_t header, uint16_t length) {
+  uint8_t size = 1 + varintSize(length);
+  uint16_t start = MQTT5HEADER - size;
+  this->buffer5[start] = header;
+  writeVarint(this->buffer5, start + 1, length);
+  this->lastOutActivity = millis();
+  return this->client5->write(&this->buffer5[start], size + length) == (size_t)(size + length);
+}
+
+bool MQTT5Client::allocAliases(uint16_t max) {
+  this->aliasCount = 0;
+  this->aliasMax = 0;
+  if (max == 0) {
+    return true;
+  }
+  uint16_t slots = 1;
+  while (slots < max * 2) {
+    slots <<= 1;
+  }
+  if (slots > this->aliasSlots) {
+    const char **topic = (const char **)REALLOC(this->aliasTopic, sizeof(const char *) * slots / 2);
+    if (topic == NULL) {
+      OUT_OF_MEMORY
+      return false;
+    }
+    this->aliasTopic = topic;
+    uint16_t *index = (uint16_t *)REALLOC(this->aliasIndex, sizeof(uint16_t) * slots);
+    if (index == NULL) {
+      OUT_OF_MEMORY
+      return false;
+    }
+    this->aliasIndex = index;
+    this->aliasSlots = slots;
+  }
+  memset(this->aliasIndex, 0, sizeof(uint16_t) * this->aliasSlots);
+  this->aliasMax = max;
+  return true;
+}
+
+/*
+  Returns the alias of a topic, or 0 if it has none yet. The slot it
+  is in or should go in is returned as well, for addAlias().
+*/
+uint16_t MQTT5Client::findAlias(const char *topic, uint16_t *slot) {
+  *slot = 0;
+  if (this->aliasMax == 0) {
+    return 0;
+  }
+  *slot = topicHash(topic) & (this->aliasSlots - 1);
+  while (this->aliasIndex[*slot] != 0) {
+    if (this->aliasTopic[this->aliasIndex[*slot] - 1] == topic) {
+      return this->aliasIndex[*slot];
+    }
+    *slot = (*slot + 1) & (this->aliasSlots - 1);
+  }
+  return 0;
+}
+
+/*
+  Only after the topic went out with its new alias, the broker knows
+  it from then on.
+*/
+void MQTT5Client::addAlias(const char *topic, uint16_t slot) {
+  this->aliasCount++;
+  this->aliasTopic[this->aliasCount - 1] = topic;
+  this->aliasIndex[slot] = this->aliasCount;
+}
+
+bool MQTT5Client::parseConnack(uint32_t length) {
+  if (length < 2 || length > MQTT5BUFFERSIZE) {
+    this->state5 = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  if (this->buffer5[1] != 0) {
+    this->state5 = this->buffer5[1]; //connect reason code from the broker
+    return false;
+  }
+  uint16_t brokerAliasMax = 0;
+  uint32_t proplen = 0;
+  int pos = readVarint(this->buffer5, length, 2, &proplen);
+  if (pos < 0 || pos + proplen > length) {
+    this->state5 = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  uint32_t end = pos + proplen;
+  while ((uint32_t)pos < end) {
+    uint8_t id = this->buffer5[pos++];
+    int size = propertySize(id, this->buffer5, end, pos);
+    if (size < 0 || pos + size > end) {
+      break;
+    }
+    const uint8_t *value = &this->buffer5[pos];
+    switch (id) {
+      case MQTT5_PROP_TOPIC_ALIAS_MAX:
+        brokerAliasMax = (value[0] << 8) | value[1];
+        break;
+      case MQTT5_PROP_SERVER_KEEPALIVE:
+        this->keepAlive5 = (value[0] << 8) | value[1];
+        break;
+      case MQTT5_PROP_MAX_PACKET_SIZE:
+        this->maxPacketSize = ((uint32_t)value[0] << 24) | ((uint32_t)value[1] << 16) | (value[2] << 8) | value[3];
+        break;
+    }
+    pos += size;
+  }
+  if (brokerAliasMax > MQTT5MAXALIASES) {
+    brokerAliasMax = MQTT5MAXALIASES;
+  }
+  this->allocAliases(brokerAliasMax); //without memory for aliases we publish with full topics
+  return true;
+}
+
+boolean MQTT5Client::connect(const char *id, const char *user, const char *pass, const char *willTopic, uint8_t willQos, boolean willRetain, const char *willMessage) {
+  if (!this->version5) {
+    return PubSubClient::connect(id, user, pass, willTopic, willQos, willRetain, willMessage);
+  }
+  //the tcp connection is opened by the caller, this only does the mqtt 5 handshake
+  if (this->client5 == NULL || !this->client5->connected()) {
+    this->state5 = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  uint8_t *buf = this->buffer5;
+  uint16_t pos = MQTT5HEADER;
+  uint8_t flags = 0x02; //clean start
+  if (willTopic != NULL) {
+    flags |= 0x04 | (willQos << 3) | (willRetain ? 0x20 : 0);
+  }
+  if (user != NULL && user[0] != '\0') {
+    flags |= 0x80;
+  }
+  if (pass != NULL && pass[0] != '\0') {
+    flags |= 0x40;
+  }
+  buf[pos++] = 0x00;
+  buf[pos++] = 0x04;
+  buf[pos++] = 'M';
+  buf[pos++] = 'Q';
+  buf[pos++] = 'T';
+  buf[pos++] = 'T';
+  buf[pos++] = 0x05; //protocol version
+  buf[pos++] = flags;
+  buf[pos++] = this->keepAlive5 >> 8;
+  buf[pos++] = this->keepAlive5 & 0xFF;
+  buf[pos++] = 0x00; //no properties, so the broker doesn't use aliases towards us
+  pos = writeString(buf, pos, id);
+  if (pos != 0 && willTopic != NULL) {
+    buf[pos++] = 0x00; //no will properties
+    pos = writeString(buf, pos, willTopic);
+    if (pos != 0) {
+      pos = writeString(buf, pos, willMessage);
+    }
+  }
+  if (pos != 0 && (flags & 0x80)) {
+    pos = writeString(buf, pos, user);
+  }
+  if (pos != 0 && (flags & 0x40)) {
+    pos = writeString(buf, pos, pass);
+  }
+  if (pos == 0 || !this->sendPacket(0x10, pos - MQTT5HEADER)) {
+    this->state5 = MQTT_CONNECT_FAILED;
+    this->client5->stop();
+    return false;
+  }
+
+  uint8_t header = 0;
+  uint32_t length = 0;
+  if (!this->readPacket(&header, &length)) {
+    this->state5 = MQTT_CONNECTION_TIMEOUT;
+    this->client5->stop();
+    return false;
+  }
+  if ((header & 0xF0) != 0x20 || !this->parseConnack(length)) {
+    if ((header & 0xF0) != 0x20) {
+      this->state5 = MQTT_CONNECT_FAILED;
+    }
+    this->client5->stop();
+    return false;
+  }
+  this->pingOutstanding = false;
+  this->lastInActivity = this->lastOutActivity = millis();
+  this->state5 = MQTT_CONNECTED;
+  return true;
+}
+
+void MQTT5Client::disconnect() {
+  if (!this->version5) {
+    PubSubClient::disconnect();
+    return;
+  }
+  if (this->client5 != NULL) {
+    if (this->client5->connected()) {
+      uint8_t packet[2] = { 0xE0, 0x00 };
+      this->client5->write(packet, 2);
+    }
+    this->client5->flush();
+    this->client5->stop();
+  }
+  this->state5 = MQTT_DISCONNECTED;
+}
+
+boolean MQTT5Client::publish(const char *topic, const uint8_t *payload, unsigned int plength, boolean retained, uint32_t expiry, const char *contentType) {
+  if (!this->version5) {
+    if (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + plength > this->getBufferSize()) {
+      //too large for the buffer, stream the payload instead
+      return this->beginPublish(topic, plength, retained) && this->write(payload, plength) == plength && this->endPublish();
+    }
+    return PubSubClient::publish(topic, payload, plength, retained);
+  }
+  if (!this->connected()) {
+    return false;
+  }
+  bool added = false;
+  uint16_t slot = 0;
+  uint16_t alias = this->findAlias(topic, &slot);
+  if (alias == 0 && this->aliasCount < this->aliasMax) {
+    alias = this->aliasCount + 1;
+    added = true;
+  }
+  uint16_t topiclen = (alias == 0 || added) ? strlen(topic) : 0;
+  uint16_t ctlen = (contentType != NULL) ? strlen(contentType) : 0;
+  uint32_t proplen = ((alias != 0) ? 3 : 0) + ((expiry != 0) ? 5 : 0) + ((contentType != NULL) ? (3 + ctlen) : 0);
+  uint32_t headerlen = 2 + topiclen + varintSize(proplen) + proplen;
+  uint32_t length = headerlen + plength;
+  if (MQTT5HEADER + headerlen > MQTT5BUFFERSIZE || (this->maxPacketSize != 0 && (1 + varintSize(length) + length) > this->maxPacketSize)) {
+    //the broker would disconnect on this packet, so it is skipped
+    this->skipped++;
+    return true;
+  }
+
+  uint8_t *buf = this->buffer5;
+  uint16_t pos = MQTT5HEADER;
+  buf[pos++] = topiclen >> 8;
+  buf[pos++] = topiclen & 0xFF;
+  memcpy(&buf[pos], topic, topiclen);
+  pos += topiclen;
+  pos = writeVarint(buf, pos, proplen);
+  if (alias != 0) {
+    buf[pos++] = MQTT5_PROP_TOPIC_ALIAS;
+    buf[pos++] = alias >> 8;
+    buf[pos++] = alias & 0xFF;
+  }
+  if (expiry != 0) {
+    buf[pos++] = MQTT5_PROP_MESSAGE_EXPIRY;
+    buf[pos++] = expiry >> 24;
+    buf[pos++] = (expiry >> 16) & 0xFF;
+    buf[pos++] = (expiry >> 8) & 0xFF;
+    buf[pos++] = expiry & 0xFF;
+  }
+  if (contentType != NULL) {
+    buf[pos++] = MQTT5_PROP_CONTENT_TYPE;
+    pos = writeString(buf, pos, contentType);
+  }
+
+  //fixed header and variable header from the buffer, the payload straight from the caller
+  uint8_t size = 1 + varintSize(length);
+  uint16_t start = MQTT5HEADER - size;
+  buf[start] = 0x30 | (retained ? 0x01 : 0x00);
+  writeVarint(buf, start + 1, length);
+  this->lastOutActivity = millis();
+  if (this->client5->write(&buf[start], size + headerlen) != (size_t)(size + headerlen)) {
+    return false;
+  }
+  if (plength > 0 && this->client5->write(payload, plength) != plength) {
+    return false;
+  }
+  if (added) {
+    this->addAlias(topic, slot);
+  }
+  return true;
+}
+
+boolean MQTT5Client::subscribe(const char *topic) {
+  if (!this->version5) {
+    return PubSubClient::subscribe(topic);
+  }
+  if (!this->connected()) {
+    return false;
+  }
+  uint8_t *buf = this->buffer5;
+  uint16_t pos = MQTT5HEADER;
+  if (++this->nextMsgId == 0) {
+    this->nextMsgId = 1;
+  }
+  buf[pos++] = this->nextMsgId >> 8;
+  buf[pos++] = this->nextMsgId & 0xFF;
+  buf[pos++] = 0x00; //no properties
+  pos = writeString(buf, pos, topic);
+  if (pos == 0 || pos >= MQTT5BUFFERSIZE) {
+    return false;
+  }
+  buf[pos++] = 0x00; //subscription options: qos 0
+  return this->sendPacket(0x82, pos - MQTT5HEADER);
+}
+
+boolean MQTT5Client::unsubscribe(const char *topic) {
+  if (!this->version5) {
+    return PubSubClient::unsubscribe(topic);
+  }
+  if (!this->connected()) {
+    return false;
+  }
+  uint8_t *buf = this->buffer5;
+  uint16_t pos = MQTT5HEADER;
+  if (++this->nextMsgId == 0) {
+    this->nextMsgId = 1;
+  }
+  buf[pos++] = this->nextMsgId >> 8;
+  buf[pos++] = this->nextMsgId & 0xFF;
+  buf[pos++] = 0x00; //no properties
+  pos = writeString(buf, pos, topic);
+  if (pos == 0) {
+    return false;
+  }
+  return this->sendPacket(0xA2, pos - MQTT5HEADER);
+}
+
+boolean MQTT5Client::loop() {
+  if (!this->version5) {
+    return PubSubClient::loop();
+  }
+  if (!this->connected()) {
+    return false;
+  }
+  unsigned long now = millis();
+  unsigned long keepAlive = this->keepAlive5 * 1000UL;
+  if (keepAlive > 0 && (((unsigned long)(now - this->lastInActivity) > keepAlive) || ((unsigned long)(now - this->lastOutActivity) > keepAlive))) {
+    if (this->pingOutstanding) {
+      this->state5 = MQTT_CONNECTION_TIMEOUT;
+      this->client5->stop();
+      return false;
+    }
+    uint8_t packet[2] = { 0xC0, 0x00 };
+    this->client5->write(packet, 2);
+    this->lastOutActivity = this->lastInActivity = now;
+    this->pingOutstanding = true;
+  }
+  if (!this->client5->available()) {
+    return true;
+  }
+
+  uint8_t header = 0;
+  uint32_t length = 0;
+  if (!this->readPacket(&header, &length)) {
+    this->state5 = MQTT_CONNECTION_LOST;
+    this->client5->stop();
+    return false;
+  }
+  switch (header & 0xF0) {
+    case 0x30: { //publish
+        uint8_t qos = (header >> 1) & 0x03;
+        if (length > MQTT5BUFFERSIZE || length < 2) {
+          break; //truncated, we can't handle it
+        }
+        uint8_t *buf = this->buffer5;
+        uint32_t topiclen = (buf[0] << 8) | buf[1];
+        uint32_t pos = 2 + topiclen;
+        uint16_t msgId = 0;
+        if (pos + ((qos > 0) ? 2 : 0) > length) {
+          break;
+        }
+        if (qos > 0) {
+          msgId = (buf[pos] << 8) | buf[pos + 1];
+          pos += 2;
+        }
+        uint32_t proplen = 0;
+        int end = readVarint(buf, length, pos, &proplen);
+        if (end < 0 || end + proplen > length) {
+          break;
+        }
+        pos = end + proplen;
+        //move the topic one byte so it can be null terminated, the payload starts after it
+        memmove(&buf[1], &buf[2], topiclen);
+        buf[1 + topiclen] = '\0';
+        if (this->callback) {
+          this->callback((char *)&buf[1], &buf[pos], length - pos);
+        }
+        if (qos == 1) {
+          uint8_t packet[4] = { 0x40, 0x02, (uint8_t)(msgId >> 8), (uint8_t)(msgId & 0xFF) };
+          this->client5->write(packet, 4);
+          this->lastOutActivity = millis();
+        }
+      } break;
+    case 0xD0: { //pingresp
+        this->pingOutstanding = false;
+      } break;
+    case 0xE0: { //disconnect by the broker
+        this->state5 = MQTT_DISCONNECTED;
+        this->client5->stop();
+        return false;
+      } break;
+  }
+  return true;
+}
+
+boolean MQTT5Client::connected() {
+  if (!this->version5) {
+    return PubSubClient::connected();
+  }
+  if (this->client5 == NULL) {
+    return false;
+  }
+  if (!this->client5->connected()) {
+    if (this->state5 == MQTT_CONNECTED) {
+      this->state5 = MQTT_CONNECTION_LOST;
+      this->client5->flush();
+      this->client5->stop();
+    }
+    return false;
+  }
+  return this->state5 == MQTT_CONNECTED;
+}
+
+int MQTT5Client::state() {
+  if (!this->version5) {
+    return PubSubClient::state();
+  }
+  return this->state5;
+}
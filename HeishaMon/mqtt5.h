@@ -0,0 +1,71 @@
+#ifndef _MQTT5_H_
+#define _MQTT5_H_
+
+#include <PubSubClient.h>
+
+/*
+  PubSubClient only talks MQTT 3.1.1. MQTT5Client keeps the PubSubClient
+  API, but when version 5 is enabled it talks MQTT 5 itself over the same
+  network client. Each topic gets a topic alias (as many as the broker
+  allows), so a topic string only goes over the wire once per session.
+  Aliases are kept by topic pointer, so topics have to stay in place,
+  like those in the topic arena. resetAliases() has to be called when
+  they move or change. Only QoS 0 is used, the same as with PubSubClient.
+*/
+#if defined(ESP8266)
+#define MQTT5MAXALIASES 256
+#else
+#define MQTT5MAXALIASES 512
+#endif
+#define MQTT5BUFFERSIZE 1024
+#define MQTT5TIMEOUT 2000 // max millis to wait for a connack or the rest of a packet
+
+class MQTT5Client : public PubSubClient {
+  public:
+    MQTT5Client();
+    void setVersion5(bool enabled);
+    bool isVersion5();
+    MQTT5Client &setClient(Client &client);
+    MQTT5Client &setKeepAlive(uint16_t keepAlive);
+    MQTT5Client &setCallback(MQTT_CALLBACK_SIGNATURE);
+    boolean connect(const char *id, const char *user, const char *pass, const char *willTopic, uint8_t willQos, boolean willRetain, const char *willMessage);
+    void disconnect();
+    boolean publish(const char *topic, const uint8_t *payload, unsigned int plength, boolean retained, uint32_t expiry = 0, const char *contentType = NULL);
+    boolean subscribe(const char *topic);
+    boolean unsubscribe(const char *topic);
+    boolean loop();
+    boolean connected();
+    int state();
+    uint16_t aliasesUsed();
+    void resetAliases();
+    unsigned long packetsSkipped();
+
+  private:
+    bool version5;
+    Client *client5;
+    uint8_t *buffer5;
+    int state5;
+    uint16_t keepAlive5;
+    uint16_t nextMsgId;
+    unsigned long lastOutActivity;
+    unsigned long lastInActivity;
+    bool pingOutstanding;
+    uint32_t maxPacketSize; // max packet size accepted by the broker, 0 = no limit
+    uint16_t aliasMax; // aliases we may use in this session
+    uint16_t aliasCount; // aliases assigned in this session
+    uint16_t aliasSlots; // size of the alias hash index, power of two
+    const char **aliasTopic; // topic per alias
+    uint16_t *aliasIndex; // alias per slot, 0 = free
+    unsigned long skipped; // publishes the broker would refuse, not sent
+    MQTT_CALLBACK_SIGNATURE;
+
+    bool readByte(uint8_t *b);
+    bool readPacket(uint8_t *header, uint32_t *length);
+    bool sendPacket(uint8_t header, uint16_t length);
+    bool allocAliases(uint16_t max);
+    uint16_t findAlias(const char *topic, uint16_t *slot);
+    void addAlias(const char *topic, uint16_t slot);
+    bool parseConnack(uint32_t length);
+};
+
+#endif
@@ -21,14 +21,17 @@
 #include "src/common/timerqueue.h"
 #include "src/common/progmem.h"
 #include "src/rules/rules.h"
+#include "src/rules/functions/filter.h"
 
 #include "dallas.h"
 #include "webfunctions.h"
 #include "decode.h"
 #include "HeishaOT.h"
 #include "commands.h"
+#include "rules.h"
 
 #define MAXCOMMANDSINBUFFER 10
+#define RULESBYTECODE "/rules.bc"
 #define OPTDATASIZE 20
 
 bool send_command(byte* command, int length);
@@ -54,23 +57,110 @@ typedef struct rule_timer_t {
 
 static struct rule_timer_t timestamp;
 
-typedef struct array_t {
+static int8_t ruleEvents[RULE_EVENT_COUNT];
+
+#define RULEPROFILEWEIGHT 8 // weight of the newest run in the moving average is 1/8
+
+static struct rule_profile_t *ruleProfile = NULL;
+bool ruleTrace = false;
+
+/*
+  Preserves state across a reload. Every rule block is hashed on its
+  source. A reload compares the hashes, so the timers and profiles of
+  the blocks that didn't change are kept, as are the #globals that are
+  still used. The state of the old rules is kept until a reload
+  succeeds, so it survives a failed reload followed by going back to
+  the old rules.
+
+  Only the state is preserved, not the compiled rules. All blocks share
+  the varstack and the mempool, so a changed file is still compiled as
+  a whole into a wiped mempool. Saving a single changed line costs the
+  same CPU time and temporary heap as compiling the full ruleset.
+*/
+typedef struct rule_global_t {
+  char *name;
+  char *str; // copy of a string value
+  struct rule_var_t var;
+} rule_global_t;
+
+static uint32_t *ruleHashes = NULL;
+static uint32_t ruleKept[8]; // one bit per rule, set when its block didn't change
+static bool ruleBoot = false; // System#Boot is new or changed
+
+static uint32_t *ruleOldHashes = NULL;
+static struct rule_profile_t *ruleOldProfile = NULL;
+static uint8_t ruleOldNr = 0;
+static struct rule_global_t *ruleOldGlobals = NULL;
+static uint16_t ruleOldNrGlobals = 0;
+
+static uint8_t ruleFrameDepth = 0;
+static uint8_t ruleFrameNr = 0;
+static uint8_t ruleFrameRules[RULEFRAMEPENDING];
+static uint8_t ruleFrameTriggers[RULEFRAMEPENDING];
+static uint32_t ruleFrameSeen[8]; // one bit per rule, nrrules is a uint8_t
+static uint32_t ruleCoalesced = 0; // rule runs saved by coalescing
+
+#define RULETIMEMDAY 1 // day of the month isn't *
+#define RULETIMEWDAY 2 // day of the week isn't *
+#define RULETIMESEARCH 2000 // steps to find the next due time, enough for a few years
+
+typedef struct rule_time_t {
+  uint64_t minutes; // one bit per minute
+  uint32_t hours;
+  uint32_t mdays; // bit 1 is the first day of the month
+  uint16_t months; // bit 0 is january
+  uint8_t wdays; // bit 0 is sunday
+  uint8_t flags;
+  uint8_t nr; // rule to run
+  time_t next; // 0 when not planned yet, -1 when it never matches
+} rule_time_t;
+
+static struct rule_time_t ruleTimes[RULETIMES];
+static uint8_t ruleNrTimes = 0;
+static time_t ruleTmTime = 0;
+static struct tm ruleTm;
+
+#define RULESLOTCACHE 64 // power of two
+
+typedef struct rule_slot_t {
   const char *key;
+  int16_t slot;
+} rule_slot_t;
+
+static struct rule_slot_t ruleSlots[RULESLOTCACHE];
+
+/*
+  Every $local and #global variable name gets a fixed slot when the
+  rules are loaded. The globals share one array, each rule using
+  locals gets a frame with just its own locals. The values live in the
+  mempool behind the rules, so reading or writing a variable is an
+  indexed load without any allocations. Only 32 bit fields are used,
+  because the mempool can be in iram on the ESP8266.
+*/
+typedef struct rule_var_t {
   union {
     int i;
     float f;
     void *n;
     const char *s;
   } val;
-  uint8_t type;
-} array_t;
-
-typedef struct varstack_t {
-  struct array_t *array;
-  uint16_t nr;
-} varstack_t;
-
-static struct varstack_t global_varstack = { .array = NULL, .nr = 0 };
+  uint32_t type;
+} rule_var_t;
+
+typedef struct rule_frame_t {
+  struct rule_var_t *vars;
+  uint8_t nr; // locals used by this rule
+  uint8_t used; // locals were touched since the last reset
+} rule_frame_t;
+
+static int16_t *ruleVarSlot = NULL; // engine variable nr -> global or local name slot
+static uint16_t ruleNrVars = 0;
+static struct rule_var_t *ruleGlobals = NULL;
+static uint16_t ruleNrGlobals = 0;
+static uint16_t ruleNrLocals = 0; // distinct $names over all rules
+static struct rule_frame_t *ruleFrames = NULL;
+static uint8_t *ruleLocalMap = NULL; // rule * ruleNrLocals + local name slot -> frame slot
+static void *ruleVarHeap = NULL; // only used when the mempool is full
 
 #if defined(ESP8266)
 unsigned char *mempool = (unsigned char *)MEMPOOL_ADDRESS;
@@ -79,41 +169,102 @@ unsigned char *mempool; //malloc in runtime
 #endif
 unsigned int memptr = 0;
 
-// static int readRuleFromFS(int i) {
-  // char fname[24];
-  // memset(&fname, 0, sizeof(fname));
-  // sprintf_P((char *)&fname, PSTR("/rule%d.bc"), i);
-  // File f = LittleFS.open(fname, "r");
-  // if(!f) {
-    // logprintf_P(F("failed to open file: %s"), fname);
-    // return -1;
-  // }
-  // FREE(rules[i]->ast.buffer);
-  // if((rules[i]->ast.buffer = (unsigned char *)MALLOC(rules[i]->ast.bufsize)) == NULL) {
-    // OUT_OF_MEMORY
-  // }
-  // memset(rules[i]->ast.buffer, 0, rules[i]->ast.bufsize);
-  // f.readBytes((char *)rules[i]->ast.buffer, rules[i]->ast.bufsize);
-  // f.close();
-  // return 0;
-// }
-
-// static int writeRuleToFS(int i) {
-  // char fname[24];
-  // memset(&fname, 0, sizeof(fname));
-  // sprintf_P((char *)&fname, PSTR("/rule%d.bc"), i);
-  // File f = LittleFS.open(fname, "w");
-  // if(!f) {
-    // logprintf_P(F("failed to open file: %s"), fname);
-    // return -1;
-  // }
-  // f.write((char *)rules[i]->ast.buffer, rules[i]->ast.bufsize);
-  // f.close();
-  // return 0;
-// }
+/*
+  The topic and opentherm names are looked up case insensitive through
+  one hash index, shared by the parser and the runtime. The index holds
+  the rule event id of the name, so its range tells the kind of value.
+*/
+#define RULESYMBOLSIZE 512 // power of two, at least twice the number of names
+#define RULESYMBOLUNKNOWN 0xFF
+
+static uint8_t ruleSymbols[RULESYMBOLSIZE];
+static bool ruleSymbolsBuilt = false;
+
+static uint32_t rules_symbol_hash(const char *name, size_t len) {
+  //case insensitive FNV-1a
+  uint32_t hash = 2166136261UL;
+  for(size_t i=0;i<len;i++) {
+    hash ^= (uint8_t)tolower(name[i]);
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+/*
+  The topic names are in progmem, the opentherm names are not.
+*/
+static const char *rules_symbol_name(uint8_t id) {
+  if(id < RULE_EVENT_EXTRA) {
+    return topics[id - RULE_EVENT_MAIN];
+  } else if(id < RULE_EVENT_OPT) {
+    return xtopics[id - RULE_EVENT_EXTRA];
+  } else if(id < RULE_EVENT_OT) {
+    return optTopics[id - RULE_EVENT_OPT];
+  }
+  return heishaOTDataStruct[id - RULE_EVENT_OT].name;
+}
+
+static void rules_symbol_add(uint8_t id) {
+  char name[MAX_TOPIC_LEN];
+  if(id < RULE_EVENT_OT) {
+    strncpy_P(name, rules_symbol_name(id), sizeof(name));
+    name[sizeof(name) - 1] = '\0';
+  } else {
+    snprintf(name, sizeof(name), "%s", rules_symbol_name(id));
+  }
+  uint16_t slot = rules_symbol_hash(name, strlen(name)) & (RULESYMBOLSIZE - 1);
+  while(ruleSymbols[slot] != RULESYMBOLUNKNOWN) {
+    slot = (slot + 1) & (RULESYMBOLSIZE - 1);
+  }
+  ruleSymbols[slot] = id;
+}
+
+static void rules_symbol_build(void) {
+  memset(ruleSymbols, RULESYMBOLUNKNOWN, sizeof(ruleSymbols));
+  for(uint16_t i=RULE_EVENT_MAIN;i<RULE_EVENT_OT;i++) {
+    rules_symbol_add(i);
+  }
+  for(uint16_t i=0;i<NUMBER_OF_OT_VALUES && heishaOTDataStruct[i].name != NULL;i++) {
+    rules_symbol_add(RULE_EVENT_OT + i);
+  }
+  ruleSymbolsBuilt = true;
+}
+
+/*
+  Returns the rule event id of a topic or opentherm name, or -1.
+*/
+static int16_t rules_symbol_id(const char *name, size_t len) {
+  if(!ruleSymbolsBuilt) {
+    rules_symbol_build();
+  }
+  uint16_t slot = rules_symbol_hash(name, len) & (RULESYMBOLSIZE - 1);
+  while(ruleSymbols[slot] != RULESYMBOLUNKNOWN) {
+    uint8_t id = ruleSymbols[slot];
+    const char *symname = rules_symbol_name(id);
+    if(id < RULE_EVENT_OT) {
+      if(strlen_P(symname) == len && strncasecmp_P(name, symname, len) == 0) {
+        return id;
+      }
+    } else if(strlen(symname) == len && strnicmp(name, symname, len) == 0) {
+      return id;
+    }
+    slot = (slot + 1) & (RULESYMBOLSIZE - 1);
+  }
+  return -1;
+}
+
+static int8_t is_topic(const char *name, size_t len) {
+  int16_t id = rules_symbol_id(name, len);
+  return id >= RULE_EVENT_MAIN && id < RULE_EVENT_OT;
+}
+
+static int8_t is_opentherm(const char *name, size_t len) {
+  int16_t id = rules_symbol_id(name, len);
+  return id >= RULE_EVENT_OT && id < RULE_EVENT_DALLAS;
+}
 
 static int8_t is_variable(char *text, uint16_t size) {
-  uint16_t i = 1, x = 0, match = 0;
+  uint16_t i = 1;
 
   if(size == strlen_P(PSTR("ds18b20#2800000000000000")) && strncmp_P(text, PSTR("ds18b20#"), 8) == 0) {
     return 24;
@@ -138,87 +289,17 @@ static int8_t is_variable(char *text, uint16_t size) {
     }
 
     if(text[0] == '@') {
-      int nrcommands = sizeof(commands)/sizeof(commands[0]);
-      for(x=0;x<nrcommands;x++) {
-        cmdStruct cmd;
-        memcpy_P(&cmd, &commands[x], sizeof(cmd));
-        size_t len = strlen(cmd.name);
-        if(size-1 == len && strnicmp(&text[1], cmd.name, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-      }
-
-      int nroptcommands = sizeof(optionalCommands)/sizeof(optionalCommands[0]);
-      for(x=0;x<nroptcommands;x++) {
-        optCmdStruct cmd;
-        memcpy_P(&cmd, &optionalCommands[x], sizeof(cmd));
-        size_t len = strlen(cmd.name);
-        if(size-1 == len && strnicmp(&text[1], cmd.name, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-      }
-      if(match == 0) {
-        int nrtopics = sizeof(topics)/sizeof(topics[0]);
-        for(x=0;x<nrtopics;x++) {
-          char cpy[MAX_TOPIC_LEN];
-          memcpy_P(&cpy, topics[x], MAX_TOPIC_LEN);
-          size_t len = strlen(cpy);
-          if(size-1 == len && strnicmp(&text[1], cpy, len) == 0) {
-            i = len+1;
-            match = 1;
-            break;
-          }
-        }
-      }
-      if(match == 0) {
-        int nrtopics = sizeof(optTopics)/sizeof(optTopics[0]);
-        for(x=0;x<nrtopics;x++) {
-          char cpy[MAX_TOPIC_LEN];
-          memcpy_P(&cpy, optTopics[x], MAX_TOPIC_LEN);
-          size_t len = strlen(cpy);
-          if(size-1 == len && strnicmp(&text[1], cpy, len) == 0) {
-            i = len+1;
-            match = 1;
-            break;
-          }
-        }
-      }
-      if(match == 0) {
-        int nrtopics = sizeof(xtopics)/sizeof(xtopics[0]);
-        for(x=0;x<nrtopics;x++) {
-          char cpy[MAX_TOPIC_LEN];
-          memcpy_P(&cpy, xtopics[x], MAX_TOPIC_LEN);
-          size_t len = strlen(cpy);
-          if(size-1 == len && strnicmp(&text[1], cpy, len) == 0) {
-            i = len+1;
-            match = 1;
-            break;
-          }
-        }
-      }
-      if(match == 0) {
+      if(find_command(&text[1], size-1) == COMMAND_UNKNOWN && !is_topic(&text[1], size-1)) {
         return -1;
       }
+      i = size;
     }
     if(text[0] == '?') {
-      int x = 0;
-      while(heishaOTDataStruct[x].name != NULL) {
-        size_t len = strlen(heishaOTDataStruct[x].name);
-        if(size-1 == len && strnicmp(&text[1], heishaOTDataStruct[x].name, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-        x++;
-      }
-      if(match == 0) {
+      if(!is_opentherm(&text[1], size-1)) {
         logprintf_P(F("err: %s %d"), __FUNCTION__, __LINE__);
         return -1;
       }
+      i = size;
     }
 
     return i;
@@ -227,94 +308,18 @@ static int8_t is_variable(char *text, uint16_t size) {
 }
 
 static int8_t is_event(char *text, uint16_t size) {
-  int i = 1, x = 0, match = 0;
   if(text[0] == '@') {
-    int nrcommands = sizeof(commands)/sizeof(commands[0]);
-    for(x=0;x<nrcommands;x++) {
-      cmdStruct cmd;
-      memcpy_P(&cmd, &commands[x], sizeof(cmd));
-      size_t len = strlen(cmd.name);
-      if(size-1 == len && strnicmp(&text[1], cmd.name, len) == 0) {
-        i = len+1;
-        match = 1;
-        break;
-      }
-    }
-
-    if(match == 0) {
-      int nroptcommands = sizeof(optionalCommands)/sizeof(optionalCommands[0]);
-      for(x=0;x<nroptcommands;x++) {
-        optCmdStruct cmd;
-        memcpy_P(&cmd, &optionalCommands[x], sizeof(cmd));
-        size_t len = strlen(cmd.name);
-        if(size-1 == len && strnicmp(&text[1], cmd.name, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-      }
-    }
-    if(match == 0) {
-      int nrtopics = sizeof(topics)/sizeof(topics[0]);
-      for(x=0;x<nrtopics;x++) {
-        size_t len = strlen_P(topics[x]);
-        char cpy[len];
-        memcpy_P(&cpy, &topics[x], len);
-        if(size-1 == len && strnicmp(&text[1], cpy, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-      }
-    }
-    if(match == 0) {
-      int nrtopics = sizeof(optTopics)/sizeof(optTopics[0]);
-      for(x=0;x<nrtopics;x++) {
-        size_t len = strlen_P(optTopics[x]);
-        char cpy[len];
-        memcpy_P(&cpy, &optTopics[x], len);
-        if(size-1 == len && strnicmp(&text[1], cpy, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-      }
-    }
-    if(match == 0) {
-      int nrtopics = sizeof(xtopics)/sizeof(xtopics[0]);
-      for(x=0;x<nrtopics;x++) {
-        size_t len = strlen_P(xtopics[x]);
-        char cpy[len];
-        memcpy_P(&cpy, &xtopics[x], len);
-        if(size-1 == len && strnicmp(&text[1], cpy, len) == 0) {
-          i = len+1;
-          match = 1;
-          break;
-        }
-      }
-    }
-    if(match == 0) {
+    if(find_command(&text[1], size-1) == COMMAND_UNKNOWN && !is_topic(&text[1], size-1)) {
       return -1;
     }
-
-    return i;
+    return size;
   }
 
   if(text[0] == '?') {
-    int x = 0;
-    while(heishaOTDataStruct[x].name != NULL) {
-      size_t len = strlen(heishaOTDataStruct[x].name);
-      if(size-1 == len && strnicmp(&text[1], heishaOTDataStruct[x].name, len) == 0) {
-        i = len+1;
-        match = 1;
-        break;
-      }
-      x++;
-    }
-    if(match == 0) {
+    if(!is_opentherm(&text[1], size-1)) {
       return -1;
     }
-    return i;
+    return size;
   }
 
   if(size == strlen_P(PSTR("ds18b20#2800000000000000")) && strncmp_P((const char *)text, PSTR("ds18b20#"), 8) == 0) {
@@ -379,9 +384,140 @@ static int8_t check_is_number(const char *str) {
   return 0;
 }
 
-static int8_t vm_value_get(struct rules_t *obj) {
-  int16_t x = 0;
+/*
+  Values read by rules (@topic, ?opentherm and ds18b20#address) are
+  resolved to a slot the first time a compiled variable is read. The
+  variable names are fixed strings of the compiled rules, so their
+  address is used as key until the rules are parsed again. Slots share
+  their ids with the rule events.
+*/
+static int16_t rules_topic_id(const char *name) {
+  int16_t id = rules_symbol_id(name, strlen(name));
+  if(id >= RULE_EVENT_OT) {
+    return -1;
+  }
+  return id;
+}
+
+static int16_t rules_opentherm_id(const char *name) {
+  int16_t id = rules_symbol_id(name, strlen(name));
+  if(id < RULE_EVENT_OT) {
+    return -1;
+  }
+  return id;
+}
+
+static int16_t rules_value_resolve(const char *key) {
+  if(key[0] == '@') {
+    return rules_topic_id(&key[1]);
+  } else if(key[0] == '?') {
+    int16_t id = rules_opentherm_id(&key[1]);
+    if(id >= 0 && heishaOTDataStruct[id - RULE_EVENT_OT].rw >= 2) {
+      return id;
+    }
+  } else {
+    for(int i=0;i<dallasDevicecount;i++) {
+      if(strncmp(actDallasData[i].address, (const char *)&key[8], 16) == 0) {
+        return RULE_EVENT_DALLAS + i;
+      }
+    }
+  }
+  return -1;
+}
+
+static int16_t rules_value_slot(const char *key) {
+  uint16_t pos = ((uintptr_t)key >> 2) & (RULESLOTCACHE-1);
+  for(uint16_t i=0;i<RULESLOTCACHE;i++) {
+    struct rule_slot_t *entry = &ruleSlots[(pos+i) & (RULESLOTCACHE-1)];
+    if(entry->key == key) {
+      return entry->slot;
+    }
+    if(entry->key == NULL) {
+      entry->key = key;
+      entry->slot = rules_value_resolve(key);
+      return entry->slot;
+    }
+  }
+  return rules_value_resolve(key); // cache full
+}
+
+static void rules_push_slot(struct rules_t *obj, int16_t slot) {
+  if(slot < 0) {
+    rules_pushnil(obj);
+  } else if(slot < RULE_EVENT_OT) {
+    struct decodedValueStruct *value = &actValues[slot];
+    switch(value->type) {
+      case VALUE_INT: {
+        rules_pushinteger(obj, value->value.i);
+      } break;
+      case VALUE_FLOAT: {
+        rules_pushfloat(obj, value->value.f);
+      } break;
+      case VALUE_STRING: {
+        String dataValue;
+        if(slot < RULE_EVENT_EXTRA) {
+          dataValue = getDataValue(actData, slot - RULE_EVENT_MAIN);
+        } else if(slot < RULE_EVENT_OPT) {
+          dataValue = getDataValueExtra(actDataExtra, slot - RULE_EVENT_EXTRA);
+        } else {
+          dataValue = getOptDataValue(actOptData, slot - RULE_EVENT_OPT);
+        }
+        rules_pushstring(obj, (char *)dataValue.c_str());
+      } break;
+      default: {
+        rules_pushnil(obj);
+      } break;
+    }
+  } else if(slot < RULE_EVENT_DALLAS) {
+    struct heishaOTDataStruct_t *member = &heishaOTDataStruct[slot - RULE_EVENT_OT];
+    if(member->type == TBOOL) {
+      rules_pushinteger(obj, (int)member->value.b);
+    } else if(member->type == TFLOAT) {
+      rules_pushfloat(obj, member->value.f);
+    } else {
+      logprintf_P(F("err: %s %d"), __FUNCTION__, __LINE__);
+      rules_pushnil(obj);
+    }
+  } else if(slot - RULE_EVENT_DALLAS < dallasDevicecount) {
+    rules_pushfloat(obj, actDallasData[slot - RULE_EVENT_DALLAS].temperature);
+  } else {
+    rules_pushnil(obj);
+  }
+}
+
+static struct rule_var_t *rules_var(struct rules_t *obj, const char *key, int16_t nr) {
+  if(nr < 0 || nr >= ruleNrVars || ruleVarSlot[nr] < 0) {
+    return NULL;
+  }
+  if(key[0] == '#') {
+    return &ruleGlobals[ruleVarSlot[nr]];
+  }
+  struct rule_frame_t *frame = (struct rule_frame_t *)obj->userdata;
+  if(frame == NULL) {
+    return NULL;
+  }
+  uint8_t slot = ruleLocalMap[(frame-ruleFrames)*ruleNrLocals+ruleVarSlot[nr]];
+  if(slot >= frame->nr) {
+    return NULL;
+  }
+  frame->used = 1;
+  return &frame->vars[slot];
+}
 
+/*
+  The local time is only converted again when the second changed, so
+  a rule reading %hour and %minute doesn't do it twice.
+*/
+static struct tm *rules_localtime(void) {
+  time_t now = time(NULL);
+  if(now != ruleTmTime) {
+    ruleTmTime = now;
+    localtime_r(&now, &ruleTm);
+  }
+  return &ruleTm;
+}
+
+static int8_t vm_value_get(struct rules_t *obj) {
   if(rules_gettop(obj) < 1) {
     return -1;
   }
@@ -391,27 +527,10 @@ static int8_t vm_value_get(struct rules_t *obj) {
 
   const char *key = rules_tostring(obj, -1);
 
-  if(key[0] == '?') {
-    int x = 0;
-    while(heishaOTDataStruct[x].name != NULL) {
-      if(heishaOTDataStruct[x].rw >= 2 &&
-         stricmp((char *)&key[1], heishaOTDataStruct[x].name) == 0) {
-        if(heishaOTDataStruct[x].type == TBOOL) {
-          rules_pushinteger(obj, (int)heishaOTDataStruct[x].value.b);
-          return 0;
-        }
-        if(heishaOTDataStruct[x].type == TFLOAT) {
-          rules_pushfloat(obj, heishaOTDataStruct[x].value.f);
-          return 0;
-        }
-        break;
-      }
-      x++;
-    }
-    logprintf_P(F("err: %s %d"), __FUNCTION__, __LINE__);
+  if(key[0] == '?' || key[0] == '@' || strncasecmp_P(key, PSTR("ds18b20#"), 8) == 0) {
+    rules_push_slot(obj, rules_value_slot(key));
   } else if(key[0] == '%') {
-    time_t now = time(NULL);
-    struct tm *tm_struct = localtime(&now);
+    struct tm *tm_struct = rules_localtime();
     if(stricmp((char *)&key[1], "hour") == 0) {
       rules_pushinteger(obj, (int)tm_struct->tm_hour);
       return 0;
@@ -425,124 +544,24 @@ static int8_t vm_value_get(struct rules_t *obj) {
       rules_pushinteger(obj, (int)tm_struct->tm_wday+1);
       return 0;
     }
-  } else if(strnicmp((const char *)key, _F("ds18b20#"), 8) == 0) {
-    uint8_t i = 0;
-    for(i=0;i<dallasDevicecount;i++) {
-      if(strncmp(actDallasData[i].address, (const char *)&key[8], 16) == 0) {
-        rules_pushfloat(obj, actDallasData[i].temperature);
-        return 0;
-      }
-    }
-    rules_pushnil(obj);
-    return 0;
-  } else if(key[0] == '@') {
-    uint16_t i = 0;
-    for(i=0;i<NUMBER_OF_TOPICS;i++) {
-      char cpy[MAX_TOPIC_LEN];
-      memcpy_P(&cpy, topics[i], MAX_TOPIC_LEN);
-      if(stricmp(cpy, (char *)&key[1]) == 0) {
-        String dataValue = actData[0] == '\0' ? "" : getDataValue(actData, i);
-        char *str = (char *)dataValue.c_str();
-        if(strlen(str) == 0) {
-          rules_pushnil(obj);
-        } else if(check_is_number(str) == 0) {
-          float var = atof(str);
-          float nr = 0;
-
-          if(modff(var, &nr) == 0) {
-            rules_pushinteger(obj, (int)var);
-            return 0;
-          } else {
-            rules_pushfloat(obj, var);
-            return 0;
-          }
-        } else {
-          rules_pushstring(obj, str);
-        }
-      }
-    }
-    for(i=0;i<NUMBER_OF_OPT_TOPICS;i++) {
-      char cpy[MAX_TOPIC_LEN];
-      memcpy_P(&cpy, topics[i], MAX_TOPIC_LEN);
-      if(stricmp(cpy, (char *)&key[1]) == 0) {
-        String dataValue = actOptData[0] == '\0' ? "" : getOptDataValue(actOptData, i);
-        char *str = (char *)dataValue.c_str();
-        if(strlen(str) == 0) {
-          rules_pushnil(obj);
-        } else if(check_is_number(str) == 0) {
-          float var = atof(str);
-          float nr = 0;
-
-          if(modff(var, &nr) == 0) {
-            rules_pushinteger(obj, (int)var);
-            return 0;
-          } else {
-            rules_pushfloat(obj, var);
-            return 0;
-          }
-        } else {
-          rules_pushstring(obj, str);
-        }
-      }
-    }
-    for(i=0;i<NUMBER_OF_TOPICS_EXTRA;i++) {
-      char cpy[MAX_TOPIC_LEN];
-      memcpy_P(&cpy, xtopics[i], MAX_TOPIC_LEN);
-      if(stricmp(cpy, (char *)&key[1]) == 0) {
-        String dataValue = actDataExtra[0] == '\0' ? "" : getDataValueExtra(actDataExtra, i);
-        char *str = (char *)dataValue.c_str();
-        if(strlen(str) == 0) {
-          rules_pushnil(obj);
-        } else if(check_is_number(str) == 0) {
-          float var = atof(str);
-          float nr = 0;
-
-          if(modff(var, &nr) == 0) {
-            rules_pushinteger(obj, (int)var);
-            return 0;
-          } else {
-            rules_pushfloat(obj, var);
-            return 0;
-          }
-        } else {
-          rules_pushstring(obj, str);
-        }
-      }
-    }
   } else {
-    struct varstack_t *table = NULL;
-    struct array_t *array = NULL;
-    if(key[0] == '$') {
-      table = (struct varstack_t *)obj->userdata;
-    } else if(key[0] == '#') {
-      table = &global_varstack;
-    }
-    if(table == NULL) {
+    struct rule_var_t *var = rules_var(obj, key, rules_tovar(obj, -1));
+    if(var == NULL) {
       rules_pushnil(obj);
     } else {
-      for(x=0;x<table->nr;x++) {
-        if(strcmp(table->array[x].key, key) == 0) {
-          array = &table->array[x];
-          break;
-        }
-      }
-      if(array == NULL) {
-        rules_pushnil(obj);
-      } else {
-        switch(array->type) {
-          case VINTEGER: {
-            rules_pushinteger(obj, array->val.i);
-          } break;
-          case VFLOAT: {
-            rules_pushfloat(obj, array->val.f);
-          } break;
-          case VCHAR: {
-            rules_pushstring(obj, (char *)array->val.s);
-          } break;
-          case VNULL: {
-            rules_pushnil(obj);
-          } break;
-        }
+      switch(var->type) {
+        case VINTEGER: {
+          rules_pushinteger(obj, var->val.i);
+        } break;
+        case VFLOAT: {
+          rules_pushfloat(obj, var->val.f);
+        } break;
+        case VCHAR: {
+          rules_pushinterned(obj, var->val.s);
+        } break;
+        default: {
+          rules_pushnil(obj);
+        } break;
       }
     }
   }
@@ -551,8 +570,6 @@ static int8_t vm_value_get(struct rules_t *obj) {
 }
 
 static int8_t vm_value_set(struct rules_t *obj) {
-  struct varstack_t *table = NULL;
-  uint16_t x = 0;
   uint8_t type = 0;
 
   if(rules_gettop(obj) < 2) {
@@ -601,223 +618,690 @@ static int8_t vm_value_set(struct rules_t *obj) {
       unsigned char cmd[256] = { 0 };
       char log_msg[256] = { 0 };
 
-      for(uint8_t x = 0; x < sizeof(commands) / sizeof(commands[0]); x++) {
-        cmdStruct tmp;
-        memcpy_P(&tmp, &commands[x], sizeof(tmp));
-        if(stricmp((char *)&key[1], tmp.name) == 0) {
-          uint16_t len = tmp.func(payload, cmd, log_msg);
-          log_message(log_msg);
+      uint8_t idx = find_command((char *)&key[1], strlen((char *)&key[1]));
+      if(idx != COMMAND_UNKNOWN && (!(idx & COMMAND_OPTIONAL) || heishamonSettings.optionalPCB)) {
+        uint16_t len = run_command(idx, payload, cmd, log_msg);
+        log_message(log_msg);
+        if(len > 0) {
           send_command(cmd, len);
-          break;
-        }
-      }
-
-      memset(&cmd, 0, sizeof(cmd));
-      memset(&log_msg, 0, sizeof(log_msg));
-
-      if(heishamonSettings.optionalPCB) {
-        //optional commands
-        for(uint8_t x = 0; x < sizeof(optionalCommands) / sizeof(optionalCommands[0]); x++) {
-          optCmdStruct tmp;
-          memcpy_P(&tmp, &optionalCommands[x], sizeof(tmp));
-          if(stricmp((char *)&key[1], tmp.name) == 0) {
-            uint16_t len = tmp.func(payload, log_msg);
-            log_message(log_msg);
-            break;
-          }
         }
       }
     }
     FREE(payload);
   } else if(key[0] == '?') {
-    int x = 0;
-    while(heishaOTDataStruct[x].name != NULL) {
-      if(heishaOTDataStruct[x].rw <= 2 && stricmp((char *)&key[1], heishaOTDataStruct[x].name) == 0) {
-        if(heishaOTDataStruct[x].type == TBOOL) {
-          switch(type) {
-            case VINTEGER: {
-              heishaOTDataStruct[x].value.b = (bool)rules_tointeger(obj, -1);
-            } break;
-            case VFLOAT: {
-              heishaOTDataStruct[x].value.b = (bool)rules_tofloat(obj, -1);
-            } break;
-          }
-        } else if(heishaOTDataStruct[x].type == TFLOAT) {
-          switch(type) {
-            case VINTEGER: {
-              heishaOTDataStruct[x].value.f = (float)rules_tointeger(obj, -1);
-            } break;
-            case VFLOAT: {
-              heishaOTDataStruct[x].value.f = rules_tointeger(obj, -1);
-            } break;
-          }
+    int16_t id = rules_opentherm_id(&key[1]);
+    struct heishaOTDataStruct_t *member = (id >= 0) ? &heishaOTDataStruct[id - RULE_EVENT_OT] : NULL;
+    if(member != NULL && member->rw <= 2) {
+      if(member->type == TBOOL) {
+        switch(type) {
+          case VINTEGER: {
+            member->value.b = (bool)rules_tointeger(obj, -1);
+          } break;
+          case VFLOAT: {
+            member->value.b = (bool)rules_tofloat(obj, -1);
+          } break;
         }
-        break;
-      }
-      x++;
-    }
-  } else {
-    if(key[0] == '$') {
-      table = (struct varstack_t *)obj->userdata;
-      if(table == NULL) {
-        if((table = (struct varstack_t *)MALLOC(sizeof(struct varstack_t))) == NULL) {
-          OUT_OF_MEMORY
+      } else if(member->type == TFLOAT) {
+        switch(type) {
+          case VINTEGER: {
+            member->value.f = (float)rules_tointeger(obj, -1);
+          } break;
+          case VFLOAT: {
+            member->value.f = rules_tointeger(obj, -1);
+          } break;
         }
-        memset(table, 0, sizeof(struct varstack_t));
-        obj->userdata = table;
       }
-    } else if(key[0] == '#') {
-      table = (struct varstack_t *)&global_varstack;
     }
-
-    struct array_t *array = NULL;
-    for(x=0;x<table->nr;x++) {
-      if(strcmp(table->array[x].key, key) == 0) {
-        array = &table->array[x];
-        break;
-      }
+  } else {
+    struct rule_var_t *var = rules_var(obj, key, rules_tovar(obj, -2));
+    if(var == NULL) {
+      return 0;
     }
 
-    if(array == NULL) {
-      if((table->array = (struct array_t *)REALLOC(table->array, sizeof(struct array_t)*(table->nr+1))) == NULL) {
-        OUT_OF_MEMORY
+    if(var->type == VCHAR && var->val.s != NULL) {
+      if(type == VCHAR && rules_tostring(obj, -1) == var->val.s) { // interned
+        return 0;
       }
-      array = &table->array[table->nr];
-      memset(array, 0, sizeof(struct array_t));
-      table->nr++;
-      rules_ref(key);
+      rules_unref(var->val.s);
     }
 
-    array->key = key;
-
     switch(type) {
       case VINTEGER: {
-        if(array->type == VCHAR && array->val.s != NULL) {
-          rules_unref(array->val.s);
-        }
-        array->val.i = rules_tointeger(obj, -1);
-        array->type = VINTEGER;
+        var->val.i = rules_tointeger(obj, -1);
       } break;
       case VFLOAT: {
-        if(array->type == VCHAR && array->val.s != NULL) {
-          rules_unref(array->val.s);
-        }
-        array->val.f = rules_tofloat(obj, -1);
-        array->type = VFLOAT;
+        var->val.f = rules_tofloat(obj, -1);
       } break;
       case VCHAR: {
-        uint8_t doref = 1;
-        if(array->type == VCHAR && array->val.s != NULL) {
-          if(strcmp(rules_tostring(obj, -1), array->val.s) != 0) {
-            rules_unref(array->val.s);
-          } else {
-            doref = 0;
-          }
-        }
-        array->val.s = rules_tostring(obj, -1);
-        array->type = VCHAR;
-        if(doref == 1) {
-          rules_ref(array->val.s);
-        }
+        var->val.s = rules_tostring(obj, -1);
+        rules_ref(var->val.s);
       } break;
       case VNULL: {
-        if(array->type == VCHAR && array->val.s != NULL) {
-          rules_unref(array->val.s);
-        }
-        array->val.n = NULL;
-        array->type = VNULL;
+        var->val.n = NULL;
       } break;
     }
+    var->type = type;
   }
   return 0;
 }
 
+/*
+  Locals only live for a single run, so they are reset
+  after every run. Only frames touched by it are cleared.
+*/
 static void rules_free_stack(void) {
-  int x = 0;
+  uint8_t x = 0, y = 0;
+  if(ruleFrames == NULL) {
+    return;
+  }
   for(x=0;x<nrrules;x++) {
-    struct varstack_t *node = (struct varstack_t *)rules[x]->userdata;
-    if(node != NULL) {
-      FREE(node->array);
-      FREE(node);
+    struct rule_frame_t *frame = &ruleFrames[x];
+    if(frame->used == 0) {
+      continue;
     }
-    rules[x]->userdata = NULL;
+    for(y=0;y<frame->nr;y++) {
+      if(frame->vars[y].type == VCHAR && frame->vars[y].val.s != NULL) {
+        rules_unref(frame->vars[y].val.s);
+      }
+      frame->vars[y].val.n = NULL;
+      frame->vars[y].type = VNULL;
+    }
+    frame->used = 0;
   }
 }
 
-static void rules_print_stack(struct varstack_t *table) {
-  struct array_t *array = NULL;
-  if(table == NULL) {
-    return;
-  } else {
-    uint16_t x = 0;
-    for(x=0;x<table->nr;x++) {
-      array = &table->array[x];
-      switch(array->type) {
-        case VINTEGER: {
-#if defined(ESP8266) || defined(ESP32)
-          logprintf_P(F("%2d %s = %d"), x, array->key, array->val.i);
-#else
-          printf("%2d %s = %d\n", x, array->key, array->val.i);
-#endif
-        } break;
-        case VFLOAT: {
-#if defined(ESP8266) || defined(ESP32)
-          logprintf_P(F("%2d %s = %g"), x, array->key, array->val.f);
-#else
-          printf("%2d %s = %g\n", x, array->key, array->val.f);
-#endif
-        } break;
-        case VCHAR: {
-#if defined(ESP8266) || defined(ESP32)
-          logprintf_P(F("%2d %s = %s"), x, array->key, array->val.s);
-#else
-          printf("%2d %s = %s\n", x, array->key, array->val.s);
-#endif
-        } break;
-        case VNULL: {
-#if defined(ESP8266) || defined(ESP32)
-          logprintf_P(F("%d %s = NULL"), x, array->key);
-#else
-          printf("%2d %s = NULL\n", x, array->key);
-#endif
-        } break;
-      }
-    }
+static void rules_vars_reset(void) {
+  FREE(ruleVarSlot);
+  FREE(ruleFrames);
+  FREE(ruleLocalMap);
+  FREE(ruleVarHeap);
+  ruleVarSlot = NULL;
+  ruleFrames = NULL;
+  ruleLocalMap = NULL;
+  ruleVarHeap = NULL;
+  ruleGlobals = NULL;
+  ruleNrVars = 0;
+  ruleNrGlobals = 0;
+  ruleNrLocals = 0;
+  for(uint8_t i=0;i<nrrules;i++) {
+    rules[i]->userdata = NULL;
   }
 }
 
-void rules_timer_cb(int nr) {
-  char *name = NULL;
-  int x = 0, i = 0;
+/*
+  Gives every variable name its slot and carves the globals and
+  the frames out of the mempool. Must run after the rules are
+  compiled or loaded and before any of them runs.
+*/
+static void rules_vars_build(struct pbuf *mem) {
+  uint16_t nr = 0, size = 0;
+  uint8_t i = 0, cnt = 0;
 
-  i = snprintf_P(NULL, 0, PSTR("timer=%d"), nr);
-  if((name = (char *)MALLOC(i+2)) == NULL) {
+  rules_vars_reset();
+
+  ruleNrVars = rules_nrvars();
+  if(ruleNrVars == 0 || nrrules == 0) {
+    return;
+  }
+  if((ruleVarSlot = (int16_t *)MALLOC(sizeof(int16_t)*ruleNrVars)) == NULL) {
     OUT_OF_MEMORY
+    ruleNrVars = 0;
+    return;
+  }
+  for(nr=0;nr<ruleNrVars;nr++) {
+    const char *name = rules_varname(nr);
+    ruleVarSlot[nr] = -1;
+    if(name == NULL) {
+      continue;
+    }
+    if(name[0] == '#') {
+      ruleVarSlot[nr] = ruleNrGlobals++;
+    } else if(name[0] == '$') {
+      ruleVarSlot[nr] = ruleNrLocals++;
+    }
   }
-  memset(name, 0, i+2);
-  snprintf_P(name, i+1, PSTR("timer=%d"), nr);
 
-  // logprintf_P(F("_______ %s %s"), __FUNCTION__, name);
+  if((ruleFrames = (struct rule_frame_t *)MALLOC(sizeof(struct rule_frame_t)*nrrules)) == NULL) {
+    OUT_OF_MEMORY
+    rules_vars_reset();
+    return;
+  }
+  memset(ruleFrames, 0, sizeof(struct rule_frame_t)*nrrules);
 
-  nr = rule_by_name(rules, nrrules, name);
-  if(nr > -1) {
-    logprintf_P(F("%s %s %s"), F("===="), name, F("===="));
+  if(ruleNrLocals > 0) {
+    if((ruleLocalMap = (uint8_t *)MALLOC(nrrules*ruleNrLocals)) == NULL) {
+      OUT_OF_MEMORY
+      rules_vars_reset();
+      return;
+    }
+    memset(ruleLocalMap, 0xFF, nrrules*ruleNrLocals);
+    for(i=0;i<nrrules;i++) {
+      cnt = 0;
+      for(nr=0;nr<ruleNrVars;nr++) {
+        const char *name = rules_varname(nr);
+        if(name != NULL && name[0] == '$' && cnt < 0xFF && rules_usesvar(rules[i], nr) == 1) {
+          ruleLocalMap[i*ruleNrLocals+ruleVarSlot[nr]] = cnt++;
+        }
+      }
+      ruleFrames[i].nr = cnt;
+      size += cnt;
+    }
+  }
+  size += ruleNrGlobals;
 
-    timestamp.first = micros();
+  struct rule_var_t *vars = NULL;
+  if(size > 0) {
+    if((vars = (struct rule_var_t *)rules_alloc(mem, sizeof(struct rule_var_t)*size)) == NULL) {
+      logprintln_P(F("no room for the rule variables in the mempool"));
+      if((vars = (struct rule_var_t *)MALLOC(sizeof(struct rule_var_t)*size)) == NULL) {
+        OUT_OF_MEMORY
+        rules_vars_reset();
+        return;
+      }
+      ruleVarHeap = vars;
+    }
+    for(nr=0;nr<size;nr++) {
+      vars[nr].val.n = NULL;
+      vars[nr].type = VNULL;
+    }
+  }
 
-    int ret = rule_run(rules[nr], 0);
+  ruleGlobals = vars;
+  vars += ruleNrGlobals;
+  for(i=0;i<nrrules;i++) {
+    ruleFrames[i].vars = vars;
+    vars += ruleFrames[i].nr;
+    rules[i]->userdata = &ruleFrames[i];
+  }
+}
 
-    timestamp.second = micros();
+static void rules_print_var(const char *name, struct rule_var_t *var) {
+  switch(var->type) {
+    case VINTEGER: {
+      logprintf_P(F("%s = %d"), name, var->val.i);
+    } break;
+    case VFLOAT: {
+      logprintf_P(F("%s = %g"), name, var->val.f);
+    } break;
+    case VCHAR: {
+      logprintf_P(F("%s = %s"), name, var->val.s);
+    } break;
+  }
+}
 
-    if(ret == 0) {
-      logprintf_P(F("%s%d %s %d %s"), F("rule #"), rules[nr]->nr, F("was executed in"), timestamp.second - timestamp.first, F("microseconds"));
+static void rules_print_stack(struct rules_t *obj) {
+  uint16_t nr = 0;
+  for(nr=0;nr<ruleNrVars;nr++) {
+    const char *name = rules_varname(nr);
+    struct rule_var_t *var = NULL;
+    if(name == NULL || (obj == NULL && name[0] != '#') || (obj != NULL && name[0] != '$')) {
+      continue;
+    }
+    if((var = rules_var(obj, name, nr)) != NULL) {
+      rules_print_var(name, var);
+    }
+  }
+}
+
+static const char *rules_trigger_name(uint8_t trigger) {
+  switch(trigger) {
+    case RULE_TRIGGER_VALUE: return "value";
+    case RULE_TRIGGER_OPENTHERM: return "opentherm";
+    case RULE_TRIGGER_DALLAS: return "1wire";
+    case RULE_TRIGGER_TIMER: return "timer";
+    case RULE_TRIGGER_BOOT: return "boot";
+    case RULE_TRIGGER_TIME: return "time";
+  }
+  return "none";
+}
+
+static uint8_t rules_trigger_by_id(uint16_t id) {
+  if(id < RULE_EVENT_OT) {
+    return RULE_TRIGGER_VALUE;
+  } else if(id < RULE_EVENT_DALLAS) {
+    return RULE_TRIGGER_OPENTHERM;
+  } else if(id < RULE_EVENT_TIMER) {
+    return RULE_TRIGGER_DALLAS;
+  }
+  return RULE_TRIGGER_TIMER;
+}
+
+static void rules_run_nr(int8_t nr, const char *name, uint8_t trigger) {
+  if(ruleTrace) {
+    logprintf_P(F("%s %s %s"), F("===="), name, F("===="));
+  }
+
+  uint32_t ops = rules_ops();
+  rules_budget(heishamonSettings.rulesBudget);
+  timestamp.first = micros();
+
+  int ret = rule_run(rules[nr], 0);
+
+  timestamp.second = micros();
+
+  if(ruleProfile != NULL) {
+    struct rule_profile_t *profile = &ruleProfile[nr];
+    uint32_t us = timestamp.second - timestamp.first;
+    profile->runs++;
+    profile->total += us;
+    if(us > profile->max) {
+      profile->max = us;
+    }
+    if(profile->runs == 1) {
+      profile->ewma = us;
+    } else {
+      profile->ewma = (int32_t)profile->ewma + (((int32_t)us - (int32_t)profile->ewma) / RULEPROFILEWEIGHT);
+    }
+    profile->ops += rules_ops() - ops;
+    profile->trigger = trigger;
+    if(ret == -2) {
+      profile->budgethits++;
+    }
+  }
+
+  if(ret == 0 && ruleTrace) {
+    logprintf_P(F("%s%d %s %d %s"), F("rule #"), rules[nr]->nr, F("was executed in"), timestamp.second - timestamp.first, F("microseconds"));
+
+    logprintf_P(F("\n>>> local variables\n"));
+    rules_print_stack(rules[nr]);
+    logprintf_P(F("\n>>> global variables\n"));
+    rules_print_stack(NULL);
+  }
+  if(ret == 0 || ret == -2) { // a stopped run starts over the next time
+    rules_free_stack();
+  }
+}
+
+void rules_profile_reset(void) {
+  FREE(ruleProfile);
+  if(nrrules > 0) {
+    if((ruleProfile = (struct rule_profile_t *)MALLOC(sizeof(struct rule_profile_t)*nrrules)) == NULL) {
+      OUT_OF_MEMORY
+      return;
+    }
+    memset(ruleProfile, 0, sizeof(struct rule_profile_t)*nrrules);
+  }
+}
+
+const struct rule_profile_t *rules_profile(uint8_t nr, const char **name, const char **trigger) {
+  if(ruleProfile == NULL || nr >= nrrules) {
+    return NULL;
+  }
+  *name = rules[nr]->name;
+  *trigger = rules_trigger_name(ruleProfile[nr].trigger);
+  return &ruleProfile[nr];
+}
+
+/*
+  Map a rule name to its event id, or -1 when the rule
+  isn't triggered by a value, sensor or low numbered timer.
+*/
+static int16_t rules_event_by_name(const char *name) {
+  if(name == NULL) {
+    return -1;
+  }
+  if(name[0] == '@') {
+    return rules_topic_id(&name[1]);
+  } else if(name[0] == '?') {
+    return rules_opentherm_id(&name[1]);
+  } else if(strnicmp(name, "ds18b20#", 8) == 0) {
+    for(int i=0;i<dallasDevicecount;i++) {
+      if(stricmp(&name[8], actDallasData[i].address) == 0) {
+        return RULE_EVENT_DALLAS + i;
+      }
+    }
+  } else if(strnicmp(name, "timer=", 6) == 0 && check_is_number(&name[6]) == 0) {
+    int nr = atoi(&name[6]);
+    if(nr >= 0 && nr < RULE_EVENT_TIMERS) {
+      return RULE_EVENT_TIMER + nr;
+    }
+  }
+  return -1;
+}
+
+/*
+  Parses one cron field: *, a number or a range, each with an optional
+  /step, separated by commas.
+*/
+static int8_t rules_cron_field(const char **spec, uint8_t min, uint8_t max, uint64_t *bits, uint8_t *star) {
+  const char *p = *spec;
+
+  *bits = 0;
+  *star = 0;
+  while(*p == ' ') {
+    p++;
+  }
+  while(1) {
+    long from = min, to = max, step = 1;
+    if(*p == '*') {
+      *star = 1;
+      p++;
+    } else if(isdigit(*p)) {
+      from = strtol(p, (char **)&p, 10);
+      to = from;
+      if(*p == '-') {
+        p++;
+        if(!isdigit(*p)) {
+          return -1;
+        }
+        to = strtol(p, (char **)&p, 10);
+      } else if(*p == '/') {
+        to = max;
+      }
+    } else {
+      return -1;
+    }
+    if(*p == '/') {
+      p++;
+      if(!isdigit(*p)) {
+        return -1;
+      }
+      step = strtol(p, (char **)&p, 10);
+    }
+    if(from < min || to > max || from > to || step < 1) {
+      return -1;
+    }
+    for(long i=from;i<=to;i+=step) {
+      *bits |= (1ULL << i);
+    }
+    if(*p != ',') {
+      break;
+    }
+    p++;
+  }
+  if(*p != ' ' && *p != '"' && *p != '\0') {
+    return -1;
+  }
+  *spec = p;
+  return 0;
+}
+
+static int8_t rules_cron_parse(const char *spec, struct rule_time_t *t) {
+  uint64_t bits = 0;
+  uint8_t star = 0;
+
+  if(rules_cron_field(&spec, 0, 59, &bits, &star) != 0) {
+    return -1;
+  }
+  t->minutes = bits;
+  if(rules_cron_field(&spec, 0, 23, &bits, &star) != 0) {
+    return -1;
+  }
+  t->hours = bits;
+  if(rules_cron_field(&spec, 1, 31, &bits, &star) != 0) {
+    return -1;
+  }
+  t->mdays = bits;
+  t->flags |= star ? 0 : RULETIMEMDAY;
+  if(rules_cron_field(&spec, 1, 12, &bits, &star) != 0) {
+    return -1;
+  }
+  t->months = bits >> 1;
+  if(rules_cron_field(&spec, 0, 7, &bits, &star) != 0) {
+    return -1;
+  }
+  t->wdays = (bits | (bits >> 7)) & 0x7F; // 7 is sunday as well
+  t->flags |= star ? 0 : RULETIMEWDAY;
+  while(*spec == ' ') {
+    spec++;
+  }
+  if(*spec == '"') {
+    spec++;
+  }
+  return (*spec == '\0') ? 0 : -1;
+}
+
+/*
+  As in cron, a day matches either field when both are restricted.
+*/
+static uint8_t rules_time_day(struct rule_time_t *t, struct tm *tm) {
+  uint8_t mday = (t->mdays >> tm->tm_mday) & 1;
+  uint8_t wday = (t->wdays >> tm->tm_wday) & 1;
+  if((t->flags & RULETIMEMDAY) && (t->flags & RULETIMEWDAY)) {
+    return mday || wday;
+  }
+  return mday && wday;
+}
+
+static int8_t rules_time_bit(uint64_t bits, uint8_t from, uint8_t max) {
+  for(uint8_t i=from;i<=max;i++) {
+    if(bits & (1ULL << i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  Returns the first local minute after the given time that matches,
+  skipping whole months, days and hours that don't. mktime takes care
+  of month ends and daylight saving time.
+*/
+static time_t rules_time_next(struct rule_time_t *t, time_t after) {
+  time_t next = after - (after % 60) + 60;
+  struct tm tm;
+  int8_t x = 0;
+
+  localtime_r(&next, &tm);
+  for(uint16_t i=0;i<RULETIMESEARCH;i++) {
+    if(!(t->months & (1 << tm.tm_mon))) {
+      tm.tm_mon++;
+      tm.tm_mday = 1;
+      tm.tm_hour = 0;
+      tm.tm_min = 0;
+    } else if(!rules_time_day(t, &tm)) {
+      tm.tm_mday++;
+      tm.tm_hour = 0;
+      tm.tm_min = 0;
+    } else if((x = rules_time_bit(t->hours, tm.tm_hour, 23)) != tm.tm_hour) {
+      if(x < 0) {
+        tm.tm_mday++;
+        tm.tm_hour = 0;
+      } else {
+        tm.tm_hour = x;
+      }
+      tm.tm_min = 0;
+    } else if((x = rules_time_bit(t->minutes, tm.tm_min, 59)) != tm.tm_min) {
+      if(x < 0) {
+        tm.tm_hour++;
+        tm.tm_min = 0;
+      } else {
+        tm.tm_min = x;
+      }
+    } else {
+      return next;
+    }
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    next = mktime(&tm);
+    localtime_r(&next, &tm);
+  }
+  return -1;
+}
+
+/*
+  Sets the time rules timer to the first due rule. Until ntp gave a
+  valid time it is checked again every minute.
+*/
+static void rules_time_schedule(void) {
+  time_t now = time(NULL), first = 0;
+  struct tm tm;
+
+  if(ruleNrTimes == 0) {
+    timerqueue_insert(0, 0, RULE_TIMER_TIME);
+    return;
+  }
+  localtime_r(&now, &tm);
+  if(tm.tm_year == 70) {
+    timerqueue_insert(60, 0, RULE_TIMER_TIME);
+    return;
+  }
+  for(uint8_t i=0;i<ruleNrTimes;i++) {
+    struct rule_time_t *t = &ruleTimes[i];
+    if(t->next == 0) {
+      t->next = rules_time_next(t, now);
+      if(t->next == -1) {
+        logprintf_P(F("rule %s never runs"), rules[t->nr]->name);
+      }
+    }
+    if(t->next > 0 && (first == 0 || t->next < first)) {
+      first = t->next;
+    }
+  }
+  if(first == 0) {
+    timerqueue_insert(0, 0, RULE_TIMER_TIME);
+  } else if(first > now) {
+    timerqueue_insert(first - now, 0, RULE_TIMER_TIME);
+  } else {
+    timerqueue_insert(0, 1, RULE_TIMER_TIME);
+  }
+}
+
+static void rules_time_build(void) {
+  ruleNrTimes = 0;
+  for(uint8_t i=0;i<nrrules;i++) {
+    const char *name = rules[i]->name, *spec = NULL;
+    if(name == NULL) {
+      continue;
+    }
+    if(stricmp(name, "System#Minute") == 0) {
+      spec = "* * * * *";
+    } else if(stricmp(name, "System#Hour") == 0) {
+      spec = "0 * * * *";
+    } else if(strnicmp(name, "Time#\"", 6) == 0) {
+      spec = &name[6];
+    } else {
+      continue;
+    }
+    if(ruleNrTimes == RULETIMES) {
+      logprintf_P(F("rule %s not planned, max %d time rules"), name, RULETIMES);
+      continue;
+    }
+    struct rule_time_t *t = &ruleTimes[ruleNrTimes];
+    memset(t, 0, sizeof(struct rule_time_t));
+    if(rules_cron_parse(spec, t) != 0) {
+      logprintf_P(F("rule %s has an invalid time"), name);
+      continue;
+    }
+    t->nr = i;
+    ruleNrTimes++;
+  }
+  rules_time_schedule();
+}
+
+void rules_time_cb(void) {
+  time_t now = time(NULL);
+
+  for(uint8_t i=0;i<ruleNrTimes;i++) {
+    struct rule_time_t *t = &ruleTimes[i];
+    if(t->next > 0 && t->next <= now && t->nr < nrrules) {
+      t->next = 0;
+      rules_run_nr(t->nr, rules[t->nr]->name, RULE_TRIGGER_TIME);
+    }
+  }
+  rules_time_schedule();
+}
+
+/*
+  The clock or the timezone changed, so plan all time rules again.
+*/
+void rules_time_reload(void) {
+  for(uint8_t i=0;i<ruleNrTimes;i++) {
+    ruleTimes[i].next = 0;
+  }
+  rules_time_schedule();
+}
+
+void rules_index_build(void) {
+  memset(ruleEvents, -1, sizeof(ruleEvents));
+  memset(ruleSlots, 0, sizeof(ruleSlots));
+  memset(ruleFrameSeen, 0, sizeof(ruleFrameSeen));
+  ruleFrameNr = 0;
+  for(uint8_t i=0;i<nrrules;i++) {
+    int16_t id = rules_event_by_name(rules[i]->name);
+    if(id > -1 && ruleEvents[id] == -1) { // the first rule wins, as with rule_by_name
+      ruleEvents[id] = i;
+    }
+  }
+  rules_time_build();
+}
+
+/*
+  Runs an event rule, or queues it when a frame is being decoded. A
+  rule already queued for this frame isn't queued again.
+*/
+static void rules_trigger(int8_t nr, const char *name, uint8_t trigger) {
+  if(ruleFrameDepth > 0 && heishamonSettings.coalesce_rules) {
+    if(ruleFrameSeen[nr >> 5] & (1UL << (nr & 31))) {
+      ruleCoalesced++;
+      return;
+    }
+    if(ruleFrameNr < RULEFRAMEPENDING) {
+      ruleFrameSeen[nr >> 5] |= (1UL << (nr & 31));
+      ruleFrameRules[ruleFrameNr] = nr;
+      ruleFrameTriggers[ruleFrameNr] = trigger;
+      ruleFrameNr++;
+      return;
+    }
+  }
+  rules_run_nr(nr, name, trigger);
+}
 
-      logprintf_P(F("\n>>> local variables\n"));
-      rules_print_stack((struct varstack_t *)rules[nr]->userdata);
-      logprintf_P(F("\n>>> global variables\n"));
-      rules_print_stack(&global_varstack);
-      rules_free_stack();
+void rules_frame_begin(void) {
+  ruleFrameDepth++;
+}
+
+void rules_frame_end(void) {
+  if(ruleFrameDepth == 0 || --ruleFrameDepth > 0) {
+    return;
+  }
+  uint8_t i = 0;
+  while(i < ruleFrameNr) {
+    uint8_t nr = ruleFrameRules[i];
+    ruleFrameSeen[nr >> 5] &= ~(1UL << (nr & 31));
+    if(nr < nrrules) {
+      rules_run_nr(nr, rules[nr]->name, ruleFrameTriggers[i]);
     }
+    i++;
+  }
+  ruleFrameNr = 0;
+}
+
+uint32_t rules_coalesced(void) {
+  return ruleCoalesced;
+}
+
+void rules_event_id(uint16_t id) {
+  if(id >= RULE_EVENT_COUNT) {
+    return;
+  }
+  int8_t nr = ruleEvents[id];
+  if(nr > -1 && nr < nrrules) {
+    rules_trigger(nr, rules[nr]->name, rules_trigger_by_id(id));
+  }
+}
+
+void rules_timer_cb(int nr) {
+  char *name = NULL;
+  int i = 0;
+
+  if(nr >= 0 && nr < RULE_EVENT_TIMERS) {
+    rules_event_id(RULE_EVENT_TIMER + nr);
+    return;
+  }
+
+  i = snprintf_P(NULL, 0, PSTR("timer=%d"), nr);
+  if((name = (char *)MALLOC(i+2)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  memset(name, 0, i+2);
+  snprintf_P(name, i+1, PSTR("timer=%d"), nr);
+
+  // logprintf_P(F("_______ %s %s"), __FUNCTION__, name);
+
+  nr = rule_by_name(rules, nrrules, name);
+  if(nr > -1) {
+    rules_run_nr(nr, name, RULE_TRIGGER_TIMER);
   }
   FREE(name);
 }
@@ -853,6 +1337,169 @@ void rules_setup(void) {
   }
 }
 
+static void rules_keep_free(void) {
+  for(uint16_t i=0;i<ruleOldNrGlobals;i++) {
+    FREE(ruleOldGlobals[i].name);
+    FREE(ruleOldGlobals[i].str);
+  }
+  FREE(ruleOldGlobals);
+  FREE(ruleOldHashes);
+  FREE(ruleOldProfile);
+  ruleOldNrGlobals = 0;
+  ruleOldNr = 0;
+}
+
+/*
+  Takes what should survive a reload out of the rules that are about
+  to be freed.
+*/
+static void rules_keep_save(void) {
+  uint16_t nr = 0, n = 0;
+
+  rules_keep_free();
+  ruleOldNr = nrrules;
+  ruleOldHashes = ruleHashes;
+  ruleOldProfile = ruleProfile;
+  ruleHashes = NULL;
+  ruleProfile = NULL;
+
+  if(ruleNrGlobals > 0) {
+    if((ruleOldGlobals = (struct rule_global_t *)MALLOC(sizeof(struct rule_global_t)*ruleNrGlobals)) == NULL) {
+      OUT_OF_MEMORY
+    }
+  }
+  for(nr=0;nr<ruleNrVars && ruleOldGlobals != NULL;nr++) {
+    const char *name = rules_varname(nr);
+    if(name == NULL || name[0] != '#' || ruleVarSlot[nr] < 0) {
+      continue;
+    }
+    struct rule_var_t *var = &ruleGlobals[ruleVarSlot[nr]];
+    if(var->type == VNULL || (var->type == VCHAR && var->val.s == NULL)) {
+      continue;
+    }
+    struct rule_global_t *global = &ruleOldGlobals[n];
+    memset(global, 0, sizeof(struct rule_global_t));
+    global->var = *var;
+    if((global->name = STRDUP(name)) == NULL ||
+       (var->type == VCHAR && (global->str = STRDUP(var->val.s)) == NULL)) {
+      OUT_OF_MEMORY
+      FREE(global->name);
+      continue;
+    }
+    n++;
+  }
+  ruleOldNrGlobals = n;
+  rule_filter_save();
+}
+
+static bool rules_kept(uint8_t nr) {
+  return (ruleKept[nr >> 5] & (1UL << (nr & 31))) != 0;
+}
+
+/*
+  Matches the new rule blocks to the old ones and puts back the
+  profiles of the unchanged blocks and the #globals that are still
+  used. Must run after the variables, index and profiles are built.
+*/
+static void rules_keep_restore(void) {
+  uint16_t nr = 0, x = 0;
+  uint8_t i = 0, j = 0;
+
+  memset(ruleKept, 0, sizeof(ruleKept));
+  for(i=0;i<nrrules && ruleHashes != NULL && ruleOldHashes != NULL;i++) {
+    for(j=0;j<ruleOldNr;j++) {
+      if(ruleOldHashes[j] != 0 && ruleOldHashes[j] == ruleHashes[i]) {
+        ruleKept[i >> 5] |= (1UL << (i & 31));
+        if(ruleProfile != NULL && ruleOldProfile != NULL) {
+          ruleProfile[i] = ruleOldProfile[j];
+        }
+        ruleOldHashes[j] = 0; // an old block is only matched once
+        break;
+      }
+    }
+  }
+
+  for(nr=0;nr<ruleNrVars && ruleGlobals != NULL;nr++) {
+    const char *name = rules_varname(nr);
+    if(name == NULL || name[0] != '#' || ruleVarSlot[nr] < 0) {
+      continue;
+    }
+    for(x=0;x<ruleOldNrGlobals;x++) {
+      if(strcmp(ruleOldGlobals[x].name, name) == 0) {
+        struct rule_var_t *var = &ruleGlobals[ruleVarSlot[nr]];
+        *var = ruleOldGlobals[x].var;
+        if(var->type == VCHAR && (var->val.s = rules_addstring(ruleOldGlobals[x].str)) == NULL) {
+          var->type = VNULL;
+        }
+        break;
+      }
+    }
+  }
+
+  int8_t boot = rule_by_name(rules, nrrules, (char *)"System#Boot");
+  ruleBoot = (boot > -1 && !rules_kept(boot));
+
+  rule_filter_restore();
+  rules_keep_free();
+}
+
+static int8_t rules_timer_rule(int nr) {
+  char name[20];
+
+  if(nr >= 0 && nr < RULE_EVENT_TIMERS) {
+    return ruleEvents[RULE_EVENT_TIMER + nr];
+  }
+  snprintf_P(name, sizeof(name), PSTR("timer=%d"), nr);
+  return rule_by_name(rules, nrrules, name);
+}
+
+/*
+  The system timers are always kept, rule timers only when their
+  block didn't change.
+*/
+static int rules_timer_keep(int nr) {
+  if(nr <= 0) {
+    return 1;
+  }
+  int8_t i = rules_timer_rule(nr);
+  return i > -1 && rules_kept(i);
+}
+
+/*
+  Hashes the source of a rule block, with every run of whitespace
+  taken as a single space, so only an edit of the block changes it.
+*/
+static void rules_block_hash(File &f, uint32_t start, uint32_t end) {
+  uint32_t hash = 2166136261UL;
+  uint8_t space = 0;
+  char content[64];
+
+  if((ruleHashes = (uint32_t *)REALLOC(ruleHashes, sizeof(uint32_t)*nrrules)) == NULL) {
+    OUT_OF_MEMORY
+    return;
+  }
+  f.seek(start, SeekSet);
+  while(start < end) {
+    int len = f.readBytes(content, (end - start) < sizeof(content) ? (end - start) : sizeof(content));
+    if(len <= 0) {
+      break;
+    }
+    for(int i=0;i<len;i++) {
+      if(isspace(content[i])) {
+        space = 1;
+        continue;
+      }
+      if(space == 1 && hash != 2166136261UL) {
+        hash = (hash ^ ' ') * 16777619UL;
+      }
+      space = 0;
+      hash = (hash ^ (uint8_t)content[i]) * 16777619UL;
+    }
+    start += len;
+  }
+  ruleHashes[nrrules-1] = hash;
+}
+
 bool existsRulesFile(char *file) {
   if (LittleFS.begin() && (LittleFS.exists(file))) {
     File f = LittleFS.open(file, "r");
@@ -864,6 +1511,69 @@ bool existsRulesFile(char *file) {
   return false;
 }
 
+/*
+  The compiled rules are stored next to the source together with a
+  hash of the source, so the next boot or reload of the same rules
+  doesn't need to compile them again.
+*/
+static File rulesBytecode;
+
+static uint16_t rules_bytecode_write(unsigned char *buf, uint16_t len) {
+  return rulesBytecode.write(buf, len);
+}
+
+static uint16_t rules_bytecode_read(unsigned char *buf, uint16_t len) {
+  return rulesBytecode.read(buf, len);
+}
+
+static int rules_bytecode_load(uint32_t hash, uint32_t len, struct pbuf *mem) {
+  uint32_t header[2] = { 0, 0 };
+  if(!LittleFS.exists(RULESBYTECODE)) {
+    return -1;
+  }
+  rulesBytecode = LittleFS.open(RULESBYTECODE, "r");
+  if(!rulesBytecode) {
+    return -1;
+  }
+  int ret = -1;
+  if(rulesBytecode.read((uint8_t *)header, sizeof(header)) == sizeof(header) && header[0] == hash && header[1] == len) {
+    timestamp.first = micros();
+    ret = rules_load(&rules, &nrrules, mem, rules_bytecode_read);
+    timestamp.second = micros();
+    if(ret == 0 && nrrules > 0) {
+      if((ruleHashes = (uint32_t *)MALLOC(sizeof(uint32_t)*nrrules)) == NULL) {
+        OUT_OF_MEMORY
+      } else if(rulesBytecode.read((uint8_t *)ruleHashes, sizeof(uint32_t)*nrrules) != sizeof(uint32_t)*nrrules) {
+        memset(ruleHashes, 0, sizeof(uint32_t)*nrrules); // from before the blocks were hashed, nothing is kept
+      }
+    }
+    if(ret == 0) {
+      logprintf_P(F("%d rules loaded from bytecode in %d microseconds"), nrrules, timestamp.second - timestamp.first);
+    } else {
+      logprintln_P(F("rules bytecode invalid, compiling rules"));
+    }
+  }
+  rulesBytecode.close();
+  return ret;
+}
+
+static void rules_bytecode_save(uint32_t hash, uint32_t len, struct pbuf *mem) {
+  uint32_t header[2] = { hash, len };
+  rulesBytecode = LittleFS.open(RULESBYTECODE, "w");
+  if(!rulesBytecode) {
+    return;
+  }
+  bool ok = rulesBytecode.write((uint8_t *)header, sizeof(header)) == sizeof(header) &&
+            rules_dump(rules, nrrules, mem, rules_bytecode_write) == 0 &&
+            ruleHashes != NULL &&
+            rulesBytecode.write((uint8_t *)ruleHashes, sizeof(uint32_t)*nrrules) == sizeof(uint32_t)*nrrules;
+  rulesBytecode.close();
+  if(!ok) {
+    LittleFS.remove(RULESBYTECODE);
+    logprintln_P(F("failed to store rules bytecode"));
+  }
+}
+
 int rules_parse(char *file) {
   if (existsRulesFile(file)) { //only parse an existing and not empty, file
     rules_setup(); //check there if done already
@@ -872,15 +1582,11 @@ int rules_parse(char *file) {
     parsing = 1;
 
     if(nrrules > 0) {
-      rules_free_stack();
+      rules_keep_save();
+      rules_vars_reset();
       rules_gc(&rules, &nrrules);
-
-      struct varstack_t *table = (struct varstack_t *)&global_varstack;
-      if(table->array != NULL) {
-        FREE(table->array);
-      }
-      table->nr = 0;
     }
+    FREE(ruleHashes);
     memset(mempool, 0, MEMPOOL_SIZE);
 
 #define BUFFER_SIZE 128
@@ -888,6 +1594,7 @@ int rules_parse(char *file) {
     memset(content, 0, BUFFER_SIZE);
     int len = frules.size();
     int chunk = 0, len1 = 0;
+    uint32_t hash = 2166136261UL;
 
     unsigned int txtoffset = alignedbuffer(MEMPOOL_SIZE-len-5);
 	
@@ -895,10 +1602,12 @@ int rules_parse(char *file) {
       memset(content, 0, BUFFER_SIZE);
       frules.seek(chunk*BUFFER_SIZE, SeekSet);
       len1 = frules.readBytes(content, BUFFER_SIZE);
+      for(int i=0;i<len1;i++) {
+        hash = (hash ^ (uint8_t)content[i]) * 16777619UL;
+      }
       memcpy(&mempool[txtoffset+(chunk*BUFFER_SIZE)], &content, alignedbuffer(len1));
       chunk++;
     }
-    frules.close();
 
     struct pbuf mem;
     struct pbuf input;
@@ -914,34 +1623,48 @@ int rules_parse(char *file) {
     input.tot_len = len;
 
     int ret = 0;
-    while((ret = rule_initialize(&input, &rules, &nrrules, &mem, NULL)) == 0) {
-      input.payload = &mempool[input.len];
+    if(rules_bytecode_load(hash, len, &mem) == 0) {
+      ret = 1;
+    } else {
+      uint32_t start = input.len;
+      while((ret = rule_initialize(&input, &rules, &nrrules, &mem, NULL)) == 0) {
+        rules_block_hash(frules, start - txtoffset, input.len - txtoffset);
+        start = input.len;
+        input.payload = &mempool[input.len];
+      }
+      if(ret != -1) {
+        rules_bytecode_save(hash, len, &mem);
+      }
     }
+    frules.close();
 
-    logprintf_P(F("rules memory used: %d / %d"), mem.len, mem.tot_len);
-
-    /*
-     * Clear all timers
-     */
-    struct timerqueue_t *node = NULL;
-    while((node = timerqueue_pop()) != NULL) {
-      FREE(node);
+    if(ret != -1) {
+      rules_vars_build(&mem);
+      rules_strings_build(rules, nrrules, &mem);
     }
 
-    struct varstack_t *table = (struct varstack_t *)&global_varstack;
-    if(table->array != NULL) {
-      FREE(table->array);
-    }
-    table->nr = 0;
+    logprintf_P(F("rules memory used: %d / %d"), mem.len, mem.tot_len);
 
     if(ret == -1) {
       if(nrrules > 0) {
-        rules_free_stack();
+        rules_vars_reset();
         rules_gc(&rules, &nrrules);
       }
+      FREE(ruleHashes);
+      rules_index_build();
+      rules_profile_reset();
       return -1;
     }
 
+    rules_index_build();
+    rules_profile_reset();
+    rules_keep_restore();
+
+    /*
+     * Clear the timers of changed rules
+     */
+    timerqueue_filter(rules_timer_keep);
+
     parsing = 0;
     return 0;
   } else {
@@ -950,53 +1673,30 @@ int rules_parse(char *file) {
 }
 
 void rules_event_cb(const char *prefix, const char *name) {
-  uint8_t len = strlen(name), len1 = strlen(prefix), tlen = 0;
+  if(strcmp_P(prefix, PSTR("?")) == 0) {
+    int16_t id = rules_opentherm_id(name);
+    if(id >= 0) {
+      rules_event_id(id);
+      return;
+    }
+  }
+
   char buf[100] = { '\0' };
   snprintf_P((char *)&buf, 100, PSTR("%s%s"), prefix, name);
   int8_t nr = rule_by_name(rules, nrrules, (char *)buf);
   if(nr > -1) {
-    logprintf_P(F("%s %s %s"), F("===="), name, F("===="));
-
-    timestamp.first = micros();
-
-    int ret = rule_run(rules[nr], 0);
-
-    timestamp.second = micros();
-
-    if(ret == 0) {
-      logprintf_P(F("%s%d %s %d %s"), F("rule #"), rules[nr]->nr, F("was executed in"), timestamp.second - timestamp.first, F("microseconds"));
-
-      logprintf_P(F("\n>>> local variables\n"));
-      rules_print_stack((struct varstack_t *)rules[nr]->userdata);
-      logprintf_P(F("\n>>> global variables\n"));
-      rules_print_stack(&global_varstack);
-      rules_free_stack();
-    }
-
-    return;
+    rules_trigger(nr, name, (strcmp_P(prefix, PSTR("?")) == 0) ? RULE_TRIGGER_OPENTHERM : RULE_TRIGGER_VALUE);
   }
 }
 
+/*
+  Runs System#Boot after a boot or when its block changed.
+*/
 void rules_boot(void) {
   int8_t nr = rule_by_name(rules, nrrules, (char *)"System#Boot");
-  if(nr > -1) {
-    logprintf_P(F("%s %s %s"), F("===="), F("System#Boot"), F("===="));
-
-    timestamp.first = micros();
-
-    int ret = rule_run(rules[nr], 0);
-
-    timestamp.second = micros();
-
-    if(ret == 0) {
-      logprintf_P(F("%s%d %s %d %s"), F("rule #"), rules[nr]->nr, F("was executed in"), timestamp.second - timestamp.first, F("microseconds"));
-
-      logprintf_P(F("\n>>> local variables\n"));
-      rules_print_stack((struct varstack_t *)rules[nr]->userdata);
-      logprintf_P(F("\n>>> global variables\n"));
-      rules_print_stack(&global_varstack);
-      rules_free_stack();
-    }
+  if(nr > -1 && ruleBoot) {
+    ruleBoot = false;
+    rules_run_nr(nr, "System#Boot", RULE_TRIGGER_BOOT);
   }
 }
 
@@ -1007,14 +1707,14 @@ void rules_deinitialize() {
     FREE(mempool);
 #endif 
     if(nrrules > 0) {
-      for(int i=0;i<nrrules;i++) {
-        if(rules[i]->userdata != NULL) {
-          FREE(rules[i]->userdata);
-        }
-      }
+      rules_vars_reset();
       rules_gc(&rules, &nrrules);
-	  rules_free_stack();
     }
+    FREE(ruleHashes);
+    rules_keep_free();
+    rule_filter_reset();
+    rules_index_build();
+    rules_profile_reset();
 
 
     // set this to NULL so a new initialize can start if necessary. 
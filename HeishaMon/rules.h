@@ -17,14 +17,91 @@
 
 #include "src/common/mem.h"
 
+#include "decode.h"
+#include "dallas.h"
+#include "HeishaOT.h"
+
+/*
+  Every event a rule can listen to gets a fixed id. When the rules are
+  parsed a table is built that maps each id to the rule handling it, so
+  triggering a rule is a single lookup instead of a search by name.
+*/
+#define RULE_EVENT_TIMERS 32 // timer=0 .. timer=31 go through the table, others by name
+
+enum rule_event_id_t {
+  RULE_EVENT_MAIN = 0,
+  RULE_EVENT_EXTRA = RULE_EVENT_MAIN + NUMBER_OF_TOPICS,
+  RULE_EVENT_OPT = RULE_EVENT_EXTRA + NUMBER_OF_TOPICS_EXTRA,
+  RULE_EVENT_OT = RULE_EVENT_OPT + NUMBER_OF_OPT_TOPICS,
+  RULE_EVENT_DALLAS = RULE_EVENT_OT + NUMBER_OF_OT_VALUES,
+  RULE_EVENT_TIMER = RULE_EVENT_DALLAS + MAX_DALLAS_SENSORS,
+  RULE_EVENT_COUNT = RULE_EVENT_TIMER + RULE_EVENT_TIMERS
+};
+
+/*
+  Every rule keeps a profile of its runs, shown on /rules and in stats.
+  The variables are only logged after each run when the rule trace is
+  toggled on.
+*/
+#define RULE_TRIGGER_NONE 0
+#define RULE_TRIGGER_VALUE 1
+#define RULE_TRIGGER_OPENTHERM 2
+#define RULE_TRIGGER_DALLAS 3
+#define RULE_TRIGGER_TIMER 4
+#define RULE_TRIGGER_BOOT 5
+#define RULE_TRIGGER_TIME 6
+
+#define RULEPROFILESTATS 16 // max rules listed in stats, /rules shows all
+
+struct rule_profile_t {
+  uint32_t runs;
+  uint32_t total; // microseconds spent in all runs
+  uint32_t max; // microseconds of the slowest run
+  uint32_t ewma; // moving average of the microseconds per run
+  uint32_t ops; // bytecode instructions executed in all runs
+  uint32_t budgethits; // runs stopped because they went over the instruction budget
+  uint8_t trigger; // what triggered the last run
+};
+
+/*
+  With coalesce_rules enabled the rule events of a received frame are
+  collected between rules_frame_begin() and rules_frame_end(). Each
+  triggered rule then runs once, after the whole frame is decoded, so
+  it sees all new values of that frame.
+*/
+#define RULEFRAMEPENDING 32 // rules collected per frame, more run right away
+
+/*
+  Rules named System#Minute, System#Hour or Time#"<cron>" run on the
+  clock. The cron spec has the usual five fields: minute, hour, day of
+  the month, month and day of the week. All of them share one system
+  timer, set to the first due time, so the clock isn't polled.
+*/
+#if defined(ESP8266)
+  #define RULETIMES 8
+#else
+  #define RULETIMES 32
+#endif
+#define RULE_TIMER_TIME -7
+
 extern uint8_t nrrules;
+extern bool ruleTrace;
 
 void rules_boot(void);
 void rules_deinitialize(void);
 int rules_parse(char *file);
 void rules_setup(void);
 void rules_timer_cb(int nr);
+void rules_time_cb(void);
+void rules_time_reload(void);
 void rules_event_cb(const char *prefix, const char *name);
+void rules_event_id(uint16_t id);
+void rules_index_build(void);
+void rules_profile_reset(void);
+const struct rule_profile_t *rules_profile(uint8_t nr, const char **name, const char **trigger);
 void rules_execute(void);
+void rules_frame_begin(void);
+void rules_frame_end(void);
+uint32_t rules_coalesced(void);
 
 #endif
@@ -1,6 +1,7 @@
 #include <PubSubClient.h>
 #include "commands.h"
 #include "s0.h"
+#include "mqtt.h"
 
 #define MQTT_RETAIN_VALUES 1 // do we retain 1wire values?
 
@@ -107,7 +108,7 @@ void restore_s0_Watthour(int s0Port, float watthour) {
 
 
 
-void s0Loop(PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_topic_base, s0SettingsStruct s0Settings[]) {
+void s0Loop(void (*log_message)(char*), char* mqtt_topic_base, s0SettingsStruct s0Settings[]) {
 
   unsigned long millisThisLoop = millis();
 
@@ -142,7 +143,6 @@ void s0Loop(PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_to
 
       //report using mqtt
       char log_msg[256];
-      char mqtt_topic[256];
       char valueStr[20];
 
       //debug
@@ -166,19 +166,16 @@ void s0Loop(PubSubClient &mqtt_client, void (*log_message)(char*), char* mqtt_to
       sprintf_P(log_msg, PSTR("Measured Watthour on S0 port %d: %.2f"), (i + 1),  Watthour );
       log_message(log_msg);
       sprintf(valueStr, "%.2f", Watthour);
-      sprintf_P(mqtt_topic, PSTR("%s/%s/Watthour/%d"), mqtt_topic_base, mqtt_topic_s0, (i + 1));
-      mqtt_client.publish(mqtt_topic, valueStr, MQTT_RETAIN_VALUES);
+      mqtt_publish_id(MQTT_TOPIC_S0_WATTHOUR + i, valueStr, MQTT_RETAIN_VALUES);
 
       sprintf(log_msg, PSTR("Measured total Watthour on S0 port %d: %.2f"), (i + 1),  WatthourTotal );
       log_message(log_msg);
       sprintf(valueStr, "%.2f", WatthourTotal);
-      sprintf(mqtt_topic, PSTR("%s/%s/WatthourTotal/%d"), mqtt_topic_base, mqtt_topic_s0, (i + 1));
-      mqtt_client.publish(mqtt_topic, valueStr, MQTT_RETAIN_VALUES);
+      mqtt_publish_id(MQTT_TOPIC_S0_WATTHOURTOTAL + i, valueStr, MQTT_RETAIN_VALUES);
       sprintf(log_msg, PSTR("Calculated Watt on S0 port %d: %u"), (i + 1), actS0Data[i].watt);
       log_message(log_msg);
       sprintf(valueStr, "%u",  actS0Data[i].watt);
-      sprintf(mqtt_topic, PSTR("%s/%s/Watt/%d"), mqtt_topic_base, mqtt_topic_s0, (i + 1));
-      mqtt_client.publish(mqtt_topic, valueStr, MQTT_RETAIN_VALUES);
+      mqtt_publish_id(MQTT_TOPIC_S0_WATT + i, valueStr, MQTT_RETAIN_VALUES);
       //update GUI over websocket
       sprintf_P(log_msg, PSTR("{\"data\": {\"s0values\": {\"s0port\": %d, \"Watt\": %u, \"Watthour\": %.2f, \"WatthourTotal\": %.2f}}}"), i+1, actS0Data[i].watt,Watthour,WatthourTotal);
       websocket_write_all(log_msg, strlen(log_msg));         
@@ -14,9 +14,10 @@
 
 #include "mem.h"
 #include "../../webfunctions.h"
+#include "../../mqtt5.h"
 
 extern settingsStruct heishamonSettings;
-extern PubSubClient mqtt_client;
+extern MQTT5Client mqtt_client;
 extern const char* mqtt_logtopic;
 
 void _logprintln(const char *file, unsigned int line, char *msg) {
@@ -9,6 +9,7 @@
 #ifndef _LOG_H_
 #define _LOG_H_
 
+#if defined(ESP8266) || defined(ESP32)
 #include <Arduino.h>
 
 #define logprintln(a) _logprintln(__FILE__, __LINE__, a)
@@ -20,5 +21,16 @@ void _logprintln(const char *file, unsigned int line, char *msg);
 void _logprintf(const char *file, unsigned int line, char *fmt, ...);
 void _logprintln_P(const char *file, unsigned int line, const __FlashStringHelper *msg);
 void _logprintf_P(const char *file, unsigned int line, const __FlashStringHelper *fmt, ...);
+#else
+/*
+  Host builds of the rules engine log to stdout.
+*/
+#include <stdio.h>
+
+#define logprintln(a) printf("%s\n", a)
+#define logprintf(a, ...) do { printf(a, ##__VA_ARGS__); printf("\n"); } while(0)
+#define logprintln_P(a) logprintln(a)
+#define logprintf_P(a, ...) logprintf(a, ##__VA_ARGS__)
+#endif
 
 #endif
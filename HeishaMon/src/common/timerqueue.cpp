@@ -17,12 +17,32 @@
 #include <unistd.h>
 #include <sys/time.h>
 
-#include "mem.h"
+#include "log.h"
 #include "timerqueue.h"
 
-static unsigned int lasttime = 0;
-static unsigned int *calls = NULL;
-static unsigned int nrcalls = 0;
+#if !defined(ESP8266) && !defined(ESP32) && !defined(F)
+  #define F
+#endif
+
+/*
+  The hash is twice the heap size so probe runs stay short. A slot
+  holds the heap position + 1 of the timer, 0 is a free slot.
+*/
+#define TIMERQUEUE_SLOTS (TIMERQUEUE_SIZE*2)
+
+static struct timerqueue_t heap[TIMERQUEUE_SIZE];
+static uint16_t slots[TIMERQUEUE_SLOTS];
+static struct timerqueue_t popped;
+static int size = 0;
+static uint32_t seq = 0;
+
+/*
+  micros() wraps every ~71 minutes, the timers can be set for days.
+  The elapsed micros are therefore added to a 64 bit clock, which only
+  needs timerqueue_update() to be called at least once per wrap.
+*/
+static uint32_t lasttime = 0;
+static uint64_t now = 0;
 
 #if !defined(ESP8266) && !defined(ESP32)
 static unsigned int micros() {
@@ -33,201 +53,205 @@ static unsigned int micros() {
 }
 #endif
 
-static void timerqueue_sort() {
-  int matched = 1;
-  while(matched) {
-    int a = 0;
-    matched = 0;
-    for(a=0;a<timerqueue_size-1;a++) {
-      if(timerqueue[a]->remove < timerqueue[a+1]->remove ||
-         (timerqueue[a]->remove == timerqueue[a+1]->remove && timerqueue[a]->sec > timerqueue[a+1]->sec) ||
-         (timerqueue[a]->remove == timerqueue[a+1]->remove && timerqueue[a]->sec == timerqueue[a+1]->sec && timerqueue[a]->usec > timerqueue[a+1]->usec)) {
-        struct timerqueue_t *node = timerqueue[a+1];
-        timerqueue[a+1] = timerqueue[a];
-        timerqueue[a] = node;
-        matched = 1;
-        break;
-      }
-    }
+static uint64_t timerqueue_now(void) {
+  uint32_t curtime = micros();
+  now += (uint32_t)(curtime - lasttime);
+  lasttime = curtime;
+  return now;
+}
+
+static uint16_t timerqueue_hash(int nr) {
+  return ((uint32_t)nr * 2654435761u) % TIMERQUEUE_SLOTS;
+}
+
+/*
+  Returns the slot of timer nr, or the free slot it should go in.
+*/
+static uint16_t timerqueue_slot(int nr) {
+  uint16_t i = timerqueue_hash(nr);
+  while(slots[i] != 0 && heap[slots[i]-1].nr != nr) {
+    i = (i + 1) % TIMERQUEUE_SLOTS;
   }
+  return i;
 }
 
-struct timerqueue_t *timerqueue_pop() {
-  if(timerqueue_size == 0) {
-    return NULL;
+/*
+  Linear probing without tombstones: after freeing a slot, shift back
+  the entries of the run behind it that would no longer be found.
+*/
+static void timerqueue_slot_free(uint16_t i) {
+  uint16_t j = i, k = 0;
+
+  slots[i] = 0;
+  while(1) {
+    j = (j + 1) % TIMERQUEUE_SLOTS;
+    if(slots[j] == 0) {
+      break;
+    }
+    k = timerqueue_hash(heap[slots[j]-1].nr);
+    if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      slots[i] = slots[j];
+      heap[slots[i]-1].slot = i;
+      slots[j] = 0;
+      i = j;
+    }
   }
-  struct timerqueue_t *x = timerqueue[0];
-  timerqueue[0] = timerqueue[timerqueue_size-1];
-
-  timerqueue_size--;
-
-  if(timerqueue_size == 0) {
-    free(timerqueue);
-    timerqueue = NULL;
-  } else {
-    if((timerqueue = (struct timerqueue_t **)realloc(timerqueue, sizeof(struct timerqueue_t *)*timerqueue_size)) == NULL) {
-  #if defined(ESP8266) || defined(ESP32)
-      //loggingSerial.printf("Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-      ESP.restart();
-      exit(-1);
-  #else
-      fprintf(stderr, "Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-      exit(-1);
-  #endif
+}
+
+static int timerqueue_lt(struct timerqueue_t *a, struct timerqueue_t *b) {
+  return a->time < b->time || (a->time == b->time && (int32_t)(a->seq - b->seq) < 0);
+}
+
+static void timerqueue_place(int pos, struct timerqueue_t *node) {
+  heap[pos] = *node;
+  slots[node->slot] = pos + 1;
+}
+
+static int timerqueue_sift_up(int pos) {
+  struct timerqueue_t node = heap[pos];
+  while(pos > 0) {
+    int parent = (pos - 1) / 2;
+    if(!timerqueue_lt(&node, &heap[parent])) {
+      break;
     }
+    timerqueue_place(pos, &heap[parent]);
+    pos = parent;
   }
+  timerqueue_place(pos, &node);
+  return pos;
+}
 
-  int a = 0;
-  for(a=0;a<timerqueue_size;a++) {
-    timerqueue[a]->sec -= x->sec;
-    timerqueue[a]->usec -= x->usec;
-    if(timerqueue[a]->usec < 0) {
-      timerqueue[a]->sec -= 1;
-      timerqueue[a]->usec += 1000000;
+static void timerqueue_sift_down(int pos) {
+  struct timerqueue_t node = heap[pos];
+  while(1) {
+    int child = pos * 2 + 1;
+    if(child >= size) {
+      break;
+    }
+    if(child + 1 < size && timerqueue_lt(&heap[child+1], &heap[child])) {
+      child++;
+    }
+    if(!timerqueue_lt(&heap[child], &node)) {
+      break;
     }
+    timerqueue_place(pos, &heap[child]);
+    pos = child;
   }
+  timerqueue_place(pos, &node);
+}
 
-  timerqueue_sort();
+static void timerqueue_fix(int pos) {
+  if(timerqueue_sift_up(pos) == pos) {
+    timerqueue_sift_down(pos);
+  }
+}
 
-  return x;
+static void timerqueue_remove(int pos) {
+  timerqueue_slot_free(heap[pos].slot);
+  size--;
+  if(pos < size) {
+    timerqueue_place(pos, &heap[size]);
+    timerqueue_fix(pos);
+  }
+}
+
+struct timerqueue_t *timerqueue_pop() {
+  if(size == 0) {
+    return NULL;
+  }
+  popped = heap[0];
+  timerqueue_remove(0);
+
+  return &popped;
 }
 
 struct timerqueue_t *timerqueue_peek() {
-  if(timerqueue_size == 0) {
+  if(size == 0) {
     return NULL;
   }
-  return timerqueue[0];
+  return &heap[0];
 }
 
+/*
+  Sets timer nr to fire sec seconds and usec micros from now. An
+  existing timer is moved to its new deadline, or cleared when both
+  are zero or less.
+*/
 void timerqueue_insert(int sec, int usec, int nr) {
-  struct timerqueue_t *node = NULL;
-  int a = 0, matched = 0, x = 0, y = 0;
-
-  for(a=0;a<timerqueue_size;a++) {
-    if(timerqueue[a]->nr == nr) {
-      timerqueue[a]->sec = sec;
-      timerqueue[a]->usec = usec;
-      if(sec <= 0 && usec <= 0) {
-        timerqueue[a]->remove = 1;
-        for(x=0;x<nrcalls;x++) {
-          if(calls[x] == timerqueue[a]->nr) {
-            if(nrcalls > 0) {
-              for(y=x;y<nrcalls-1;y++) {
-                calls[y] = calls[y+1];
-              }
-              nrcalls--;
-            }
-            break;
-          }
-        }
-      }
-      timerqueue_sort();
-      matched = 1;
-      break;
-    }
-  }
+  uint16_t slot = timerqueue_slot(nr);
+  int64_t time = (int64_t)timerqueue_now() + (int64_t)sec * 1000000 + usec;
+  int pos = 0;
 
-  if(matched == 1) {
-    while((node = timerqueue_peek()) != NULL) {
-      if(node->remove == 1) {
-        struct timerqueue_t *node = timerqueue_pop();
-        free(node);
-      } else {
-        break;
-      }
+  if(slots[slot] != 0) {
+    pos = slots[slot] - 1;
+    if(sec <= 0 && usec <= 0) {
+      timerqueue_remove(pos);
+      return;
     }
-
+    heap[pos].time = time < 0 ? 0 : time;
+    heap[pos].seq = seq++;
+    timerqueue_fix(pos);
     return;
   } else if(sec == 0 && usec == 0) {
     return;
   }
 
-  if((timerqueue = (struct timerqueue_t **)realloc(timerqueue, sizeof(struct timerqueue_t *)*(timerqueue_size+1))) == NULL) {
-#if defined(ESP8266) || defined(ESP32)
-    //loggingSerial.printf("Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-    ESP.restart();
-    exit(-1);
-#else
-    fprintf(stderr, "Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-    exit(-1);
-#endif
-  }
-
-  node = (struct timerqueue_t *)malloc(sizeof(struct timerqueue_t));
-  if(node == NULL) {
-#if defined(ESP8266) || defined(ESP32)
-    //loggingSerial.printf("Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-    ESP.restart();
-    exit(-1);
-#else
-    fprintf(stderr, "Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-    exit(-1);
-#endif
+  if(size == TIMERQUEUE_SIZE) {
+    logprintf_P(F("timer #%d not set, all %d timers are in use"), nr, TIMERQUEUE_SIZE);
+    return;
   }
-  memset(node, 0, sizeof(struct timerqueue_t));
-  node->sec = sec;
-  node->usec = usec;
-  node->nr = nr;
 
-  timerqueue[timerqueue_size++] = node;
-  timerqueue_sort();
+  pos = size++;
+  heap[pos].time = time < 0 ? 0 : time;
+  heap[pos].seq = seq++;
+  heap[pos].nr = nr;
+  heap[pos].slot = slot;
+  slots[slot] = pos + 1;
+  timerqueue_sift_up(pos);
 }
 
-void timerqueue_update(void) {
-  struct timeval tv;
-  unsigned int curtime = 0;
-
-  curtime = micros();
-
-  unsigned int diff = curtime - lasttime;
-  unsigned int sec = diff / 1000000;
-  unsigned int usec = diff - ((diff / 1000000) * 1000000);
-  int a = 0, x = 0;
-
-  lasttime = curtime;
+void timerqueue_clear(void) {
+  size = 0;
+  memset(slots, 0, sizeof(slots));
+}
 
-  for(a=0;a<timerqueue_size;a++) {
-    timerqueue[a]->sec -= sec;
-    timerqueue[a]->usec -= usec;
-    if(timerqueue[a]->usec < 0) {
-      timerqueue[a]->usec = 1000000 + timerqueue[a]->usec;
-      timerqueue[a]->sec -= 1;
-    }
+/*
+  Removes every timer for which keep returns 0. The kept timers are
+  moved to the front and the heap and hash are built again.
+*/
+void timerqueue_filter(int (*keep)(int nr)) {
+  int i = 0, n = 0;
 
-    if(timerqueue[a]->sec < 0 || (timerqueue[a]->sec == 0 && timerqueue[a]->usec <= 0)) {
-      int nr = timerqueue[a]->nr;
-      if((calls = (unsigned int *)realloc(calls, (nrcalls+1)*sizeof(unsigned int))) == NULL) {
-#if defined(ESP8266) || defined(ESP32)
-        ///loggingSerial.printf("Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-        ESP.restart();
-        exit(-1);
-#else
-        fprintf(stderr, "Out of memory %s:#%d\n", __FUNCTION__, __LINE__);
-        exit(-1);
-#endif
-      }
-      calls[nrcalls++] = nr;
+  for(i=0;i<size;i++) {
+    if(keep(heap[i].nr) != 0) {
+      heap[n++] = heap[i];
     }
   }
-  for(a=0;a<timerqueue_size;a++) {
-    if(timerqueue[a]->sec < 0 || (timerqueue[a]->sec == 0 && timerqueue[a]->usec == 0)) {
-      struct timerqueue_t *node = timerqueue_pop();
-      free(node);
-      a--;
-    }
+  size = n;
+  memset(slots, 0, sizeof(slots));
+  for(i=0;i<size;i++) {
+    heap[i].slot = timerqueue_slot(heap[i].nr);
+    slots[heap[i].slot] = i + 1;
   }
-  while(nrcalls > 0) {
-    timer_cb(calls[0]);
-    if(nrcalls > 0) {
-      for(a=0;a<nrcalls-1;a++) {
-        calls[a] = calls[a+1];
-      }
-      nrcalls--;
-    }
+  for(i=size/2-1;i>=0;i--) {
+    timerqueue_sift_down(i);
   }
-  if(calls != NULL) {
-    free(calls);
-    calls = NULL;
+}
+
+int timerqueue_size(void) {
+  return size;
+}
+
+/*
+  Fires all timers that expired before this call. Timers set from
+  a callback are due after now, so they wait for the next update.
+*/
+void timerqueue_update(void) {
+  uint64_t curtime = timerqueue_now();
+
+  while(size > 0 && heap[0].time <= curtime) {
+    int nr = heap[0].nr;
+    timerqueue_remove(0);
+    timer_cb(nr);
   }
-  nrcalls = 0;
 }
@@ -11,21 +11,37 @@
 
 #include <stdint.h>
 
+/*
+  The timers are kept in a fixed size binary min-heap ordered by
+  their absolute deadline in micros. A small hash on the timer number
+  points to the heap position, so setting, resetting or clearing a
+  timer is O(log n) and nothing is allocated.
+*/
+#ifndef TIMERQUEUE_SIZE
+  #if defined(ESP8266)
+    #define TIMERQUEUE_SIZE 32
+  #elif defined(ESP32)
+    #define TIMERQUEUE_SIZE 128
+  #else
+    #define TIMERQUEUE_SIZE 4096
+  #endif
+#endif
+
 typedef struct timerqueue_t {
-	int sec;
-	int usec;
+  uint64_t time; // absolute deadline in micros
+  uint32_t seq; // insertion order, so equal deadlines fire in order
   int nr;
-  int remove;
+  uint16_t slot; // position in the timer number hash
 } timerqueue_t;
 
-extern struct timerqueue_t **timerqueue;
-extern int timerqueue_size;
 extern void timer_cb(int nr);
 
 struct timerqueue_t *timerqueue_pop();
 struct timerqueue_t *timerqueue_peek();
 void timerqueue_update(void);
 void timerqueue_insert(int sec, int usec, int nr);
+void timerqueue_clear(void);
+void timerqueue_filter(int (*keep)(int nr));
+int timerqueue_size(void);
 
-
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,62 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdint.h>
+
+#include "writeframe.h"
+
+typedef struct writeframe_field_t {
+  uint8_t byte;
+  uint8_t mask;
+} writeframe_field_t;
+
+static const struct writeframe_field_t fields[] = {
+  { 4, 0x03 }, /* heatpump */
+  { 4, 0x30 }, /* pump */
+  { 4, 0xc0 }, /* force dhw */
+  { 5, 0x30 }, /* holiday */
+  { 5, 0xc0 }, /* main schedule */
+  { 8, 0x01 }, /* reset */
+  { 8, 0x02 }, /* defrost */
+  { 8, 0x04 }, /* sterilization */
+};
+
+/*
+  Merges the changes of cmd into frame, both from the fourth byte on.
+  The settings sharing a byte are combined as long as each of them
+  is set by only one of both, any other byte may only be set by one
+  of them. Nothing is changed and false is returned otherwise, the
+  commands then have to be sent one after the other.
+*/
+bool writeframe_merge(uint8_t *frame, const uint8_t *cmd, unsigned int len) {
+  unsigned int i = 0, x = 0;
+  uint8_t rest = 0;
+
+  for (i = 4; i < len; i++) {
+    if (frame[i] == 0 || cmd[i] == 0) {
+      continue;
+    }
+    rest = 0xff;
+    for (x = 0; x < sizeof(fields) / sizeof(fields[0]); x++) {
+      if (fields[x].byte != i) {
+        continue;
+      }
+      if ((frame[i] & fields[x].mask) && (cmd[i] & fields[x].mask)) {
+        return false;
+      }
+      rest &= ~fields[x].mask;
+    }
+    if ((frame[i] & rest) && (cmd[i] & rest)) {
+      return false;
+    }
+  }
+  for (i = 4; i < len; i++) {
+    frame[i] |= cmd[i];
+  }
+  return true;
+}
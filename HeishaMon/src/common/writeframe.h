@@ -0,0 +1,23 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _WRITEFRAME_H_
+#define _WRITEFRAME_H_
+
+#include <stdint.h>
+
+/*
+  In a heatpump write frame a zero byte means no change. Bytes 4, 5
+  and 8 hold several settings each, every setting in its own bits,
+  e.g. byte 4 holds the heatpump (1/2), the pump (16/32) and the
+  force DHW (64/128) state. The quiet and powerful mode in byte 7
+  share bits, so they count as a single setting.
+*/
+bool writeframe_merge(uint8_t *frame, const uint8_t *cmd, unsigned int len);
+
+#endif
@@ -34,6 +34,10 @@
 #include "functions/concat.h"
 #include "functions/print.h"
 #include "functions/gpio.h"
+#include "functions/ema.h"
+#include "functions/avg.h"
+#include "functions/hysteresis.h"
+#include "functions/rate.h"
 
 struct rule_function_t rule_functions[] = {
   { "max", rule_function_max_callback },
@@ -46,7 +50,11 @@ struct rule_function_t rule_functions[] = {
   { "isset", rule_function_isset_callback },
   { "print", rule_function_print_callback },
   { "concat", rule_function_concat_callback },
-  { "gpio", rule_function_gpio_callback }
+  { "gpio", rule_function_gpio_callback },
+  { "ema", rule_function_ema_callback },
+  { "avg", rule_function_avg_callback },
+  { "hysteresis", rule_function_hysteresis_callback },
+  { "rate", rule_function_rate_callback }
 };
 
 uint16_t nr_rule_functions = sizeof(rule_functions)/sizeof(rule_functions[0]);
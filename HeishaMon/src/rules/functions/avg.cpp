@@ -0,0 +1,71 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../function.h"
+#include "../rules.h"
+#include "filter.h"
+
+/*
+  avg(key, value, n): average of the last n values. The window is fixed
+  on the first call. A nil value returns the current average.
+*/
+int8_t rule_function_avg_callback(struct rules_t *obj) {
+  struct rule_filter_t *filter = NULL;
+  float value = 0, sum = 0, *window = NULL;
+  uint8_t nr = rules_gettop(obj), i = 0;
+  int8_t ret = 0;
+  int n = 0;
+
+  if(nr != 3 || rules_type(obj, 3) != VINTEGER) {
+    return -1;
+  }
+  if((ret = rule_filter_tofloat(obj, 2, &value)) == -1) {
+    return -1;
+  }
+  n = rules_tointeger(obj, 3);
+  if(n < 1 || n > RULEFILTERWINDOW) {
+    return -1;
+  }
+  if((filter = rule_filter_get(obj, RULE_FILTER_AVG)) == NULL) {
+    return -1;
+  }
+  if((window = rule_filter_samples(filter, n)) == NULL) {
+    return -1;
+  }
+  while(nr > 0) {
+    rules_remove(obj, nr--);
+  }
+
+  if(ret == 0) {
+    window[filter->next] = value;
+    filter->next = (filter->next + 1) % filter->n;
+    if(filter->nr < filter->n) {
+      filter->nr++;
+    }
+  }
+
+  if(filter->nr == 0) {
+    rules_pushnil(obj);
+  } else {
+    for(i=0;i<filter->nr;i++) {
+      sum += window[i];
+    }
+#ifdef DEBUG
+    printf("\tavg = %f\n", sum / filter->nr);
+#endif
+    rule_filter_push(obj, sum / filter->nr);
+  }
+
+  return 0;
+}
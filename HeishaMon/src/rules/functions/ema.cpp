@@ -0,0 +1,62 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../function.h"
+#include "../rules.h"
+#include "filter.h"
+
+/*
+  ema(key, value, alpha): exponential moving average, the first value
+  is taken as is. A nil value returns the current average.
+*/
+int8_t rule_function_ema_callback(struct rules_t *obj) {
+  struct rule_filter_t *filter = NULL;
+  float value = 0, alpha = 0;
+  uint8_t nr = rules_gettop(obj);
+  int8_t ret = 0;
+
+  if(nr != 3) {
+    return -1;
+  }
+  if((ret = rule_filter_tofloat(obj, 2, &value)) == -1 ||
+     rule_filter_tofloat(obj, 3, &alpha) != 0 || alpha <= 0 || alpha > 1) {
+    return -1;
+  }
+  if((filter = rule_filter_get(obj, RULE_FILTER_EMA)) == NULL) {
+    return -1;
+  }
+  while(nr > 0) {
+    rules_remove(obj, nr--);
+  }
+
+  if(ret == 0) {
+    if(filter->nr == 0) {
+      filter->value = value;
+      filter->nr = 1;
+    } else {
+      filter->value += alpha * (value - filter->value);
+    }
+  }
+
+  if(filter->nr == 0) {
+    rules_pushnil(obj);
+  } else {
+#ifdef DEBUG
+    printf("\tema = %f\n", filter->value);
+#endif
+    rule_filter_push(obj, filter->value);
+  }
+
+  return 0;
+}
@@ -0,0 +1,234 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "../function.h"
+#include "../../common/mem.h"
+#include "../../common/log.h"
+#include "../rules.h"
+#include "filter.h"
+
+static struct rule_filter_t filters[RULEFILTERS];
+static float samples[RULEFILTERSAMPLES];
+static uint16_t nrsamples = 0;
+static char *names[RULEFILTERS]; // string keys while the rules are reloaded
+static struct rule_filter_t scratch; // what the validation of a new rule works on
+static float scratchsamples[RULEFILTERWINDOW];
+
+struct rule_filter_t *rule_filter_get(struct rules_t *obj, uint8_t type) {
+  struct rule_filter_t *slot = NULL;
+  int32_t key = 0;
+  uint8_t str = 0, i = 0;
+
+  switch(rules_type(obj, 1)) {
+    case VINTEGER: {
+      key = rules_tointeger(obj, 1);
+    } break;
+    case VCHAR: {
+      int16_t nr = rules_tovar(obj, 1);
+      if(nr < 0 || rules_varname(nr) == NULL) {
+        logprintf_P(F("filter key %s is not a constant"), rules_tostring(obj, 1));
+        return NULL;
+      }
+      key = nr;
+      str = 1;
+    } break;
+    default: {
+      return NULL;
+    } break;
+  }
+
+  for(i=0;i<RULEFILTERS;i++) {
+    if(filters[i].type == 0) {
+      if(slot == NULL) {
+        slot = &filters[i];
+      }
+    } else if(filters[i].key == key && filters[i].str == str && filters[i].type == type) {
+      break;
+    }
+  }
+
+  /*
+    The state of the filters is kept over a reload, so validating a
+    new rule mustn't change it.
+  */
+  if(rules_validating()) {
+    memset(&scratch, 0, sizeof(struct rule_filter_t));
+    if(i < RULEFILTERS) {
+      scratch = filters[i];
+      memcpy(scratchsamples, &samples[filters[i].pos], sizeof(float)*filters[i].n);
+    } else {
+      scratch.key = key;
+      scratch.str = str;
+      scratch.type = type;
+    }
+    return &scratch;
+  }
+  if(i < RULEFILTERS) {
+    return &filters[i];
+  }
+
+  if(slot == NULL) {
+    logprintf_P(F("no room for another filter, all %d are in use"), RULEFILTERS);
+    return NULL;
+  }
+  memset(slot, 0, sizeof(struct rule_filter_t));
+  slot->key = key;
+  slot->str = str;
+  slot->type = type;
+  return slot;
+}
+
+/*
+  The avg windows are taken from a shared pool on first use, they are
+  only given back when the rules are reloaded.
+*/
+float *rule_filter_samples(struct rule_filter_t *filter, uint8_t n) {
+  if(filter == &scratch) {
+    if(filter->n == 0) {
+      if(n == 0 || n > RULEFILTERWINDOW) {
+        return NULL;
+      }
+      filter->n = n;
+    }
+    return scratchsamples;
+  }
+  if(filter->n == 0) {
+    if(n == 0 || n > RULEFILTERWINDOW || nrsamples + n > RULEFILTERSAMPLES) {
+      logprintf_P(F("no room for an average of %d samples"), n);
+      return NULL;
+    }
+    filter->n = n;
+    filter->pos = nrsamples;
+    nrsamples += n;
+  }
+  return &samples[filter->pos];
+}
+
+/*
+  Returns 0 for a number, 1 for nil and -1 for anything else.
+*/
+int8_t rule_filter_tofloat(struct rules_t *obj, uint8_t pos, float *out) {
+  switch(rules_type(obj, pos)) {
+    case VINTEGER: {
+      *out = (float)rules_tointeger(obj, pos);
+    } break;
+    case VFLOAT: {
+      *out = rules_tofloat(obj, pos);
+    } break;
+    case VNULL: {
+      return 1;
+    } break;
+    default: {
+      return -1;
+    } break;
+  }
+  return 0;
+}
+
+void rule_filter_push(struct rules_t *obj, float x) {
+  float z = 0;
+
+  if(modff(x, &z) == 0) {
+    rules_pushinteger(obj, x);
+  } else {
+    rules_pushfloat(obj, x);
+  }
+}
+
+uint32_t rule_filter_millis(void) {
+#if defined(ESP8266) || defined(ESP32)
+  return millis();
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+
+  return 1000 * tv.tv_sec + tv.tv_usec / 1000;
+#endif
+}
+
+/*
+  The varstack indexes of string keys change when the rules are
+  compiled again, so their names are kept during a reload and looked
+  up again afterwards. Filters of names that are gone are dropped.
+*/
+void rule_filter_save(void) {
+  uint8_t i = 0;
+
+  for(i=0;i<RULEFILTERS;i++) {
+    if(filters[i].type == 0 || filters[i].str == 0 || names[i] != NULL) {
+      continue;
+    }
+    const char *name = rules_varname(filters[i].key);
+    if(name == NULL || (names[i] = STRDUP(name)) == NULL) {
+      filters[i].type = 0;
+    }
+  }
+}
+
+void rule_filter_restore(void) {
+  uint16_t nr = 0, nrvars = rules_nrvars();
+  uint8_t i = 0;
+
+  for(i=0;i<RULEFILTERS;i++) {
+    if(names[i] == NULL) {
+      continue;
+    }
+    for(nr=0;nr<nrvars;nr++) {
+      const char *name = rules_varname(nr);
+      if(name != NULL && strcmp(name, names[i]) == 0) {
+        break;
+      }
+    }
+    if(nr < nrvars) {
+      filters[i].key = nr;
+    } else {
+      filters[i].type = 0;
+    }
+    FREE(names[i]);
+  }
+
+  /*
+    Give the windows of dropped filters back by moving the others
+    down, lowest offset first so none is overwritten.
+  */
+  uint16_t pos = 0, last = 0;
+  while(1) {
+    uint8_t next = RULEFILTERS;
+    for(i=0;i<RULEFILTERS;i++) {
+      if(filters[i].type != 0 && filters[i].n > 0 && filters[i].pos >= last &&
+         (next == RULEFILTERS || filters[i].pos < filters[next].pos)) {
+        next = i;
+      }
+    }
+    if(next == RULEFILTERS) {
+      break;
+    }
+    last = filters[next].pos + filters[next].n;
+    memmove(&samples[pos], &samples[filters[next].pos], sizeof(float)*filters[next].n);
+    filters[next].pos = pos;
+    pos += filters[next].n;
+  }
+  nrsamples = pos;
+}
+
+void rule_filter_reset(void) {
+  uint8_t i = 0;
+
+  for(i=0;i<RULEFILTERS;i++) {
+    FREE(names[i]);
+  }
+  memset(filters, 0, sizeof(filters));
+  nrsamples = 0;
+}
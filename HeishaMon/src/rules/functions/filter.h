@@ -0,0 +1,57 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _RULES_FILTER_H_
+#define _RULES_FILTER_H_
+
+#include <stdint.h>
+#include "../rules.h"
+
+/*
+  The ema, avg, hysteresis and rate functions keep their state in a
+  fixed table instead of in rule variables. A filter is found by its
+  first argument: an integer, or a string constant of which the
+  varstack index is used, so no string is compared at runtime. A
+  reload keeps the filters of names that are still used.
+*/
+#if defined(ESP8266)
+  #define RULEFILTERS 16
+  #define RULEFILTERSAMPLES 64 // shared by all avg windows
+#else
+  #define RULEFILTERS 64
+  #define RULEFILTERSAMPLES 256
+#endif
+#define RULEFILTERWINDOW 32 // max samples of one avg
+
+#define RULE_FILTER_EMA 1
+#define RULE_FILTER_AVG 2
+#define RULE_FILTER_HYSTERESIS 3
+#define RULE_FILTER_RATE 4
+
+typedef struct rule_filter_t {
+  int32_t key;
+  uint8_t type; // 0 is a free slot
+  uint8_t str; // key is the varstack index of a string constant
+  uint8_t n; // avg window
+  uint8_t nr; // samples seen, at most n
+  uint16_t pos; // avg window offset in the sample pool
+  uint16_t next; // avg sample to overwrite next
+  float value; // ema and rate last value, hysteresis state
+  uint32_t time; // rate millis of the last value
+} rule_filter_t;
+
+struct rule_filter_t *rule_filter_get(struct rules_t *obj, uint8_t type);
+float *rule_filter_samples(struct rule_filter_t *filter, uint8_t n);
+int8_t rule_filter_tofloat(struct rules_t *obj, uint8_t pos, float *out);
+void rule_filter_push(struct rules_t *obj, float x);
+uint32_t rule_filter_millis(void);
+void rule_filter_save(void);
+void rule_filter_restore(void);
+void rule_filter_reset(void);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../function.h"
+#include "../rules.h"
+#include "filter.h"
+
+/*
+  hysteresis(key, value, on, off): returns 1 from the moment value
+  reaches on until it reaches off, then 0 again. With on below off
+  this works the other way around. It starts at 0, a nil value
+  returns the current state.
+*/
+int8_t rule_function_hysteresis_callback(struct rules_t *obj) {
+  struct rule_filter_t *filter = NULL;
+  float value = 0, on = 0, off = 0;
+  uint8_t nr = rules_gettop(obj);
+  int8_t ret = 0;
+
+  if(nr != 4) {
+    return -1;
+  }
+  if((ret = rule_filter_tofloat(obj, 2, &value)) == -1 ||
+     rule_filter_tofloat(obj, 3, &on) != 0 ||
+     rule_filter_tofloat(obj, 4, &off) != 0) {
+    return -1;
+  }
+  if((filter = rule_filter_get(obj, RULE_FILTER_HYSTERESIS)) == NULL) {
+    return -1;
+  }
+  while(nr > 0) {
+    rules_remove(obj, nr--);
+  }
+
+  if(ret == 0) {
+    if(on >= off) {
+      if(value >= on) {
+        filter->value = 1;
+      } else if(value <= off) {
+        filter->value = 0;
+      }
+    } else {
+      if(value <= on) {
+        filter->value = 1;
+      } else if(value >= off) {
+        filter->value = 0;
+      }
+    }
+  }
+
+#ifdef DEBUG
+  printf("\thysteresis = %d\n", (int)filter->value);
+#endif
+  rules_pushinteger(obj, (int)filter->value);
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../function.h"
+#include "../rules.h"
+#include "filter.h"
+
+/*
+  rate(key, value): change of value per second since the previous
+  call with this key, 0 on the first call.
+*/
+int8_t rule_function_rate_callback(struct rules_t *obj) {
+  struct rule_filter_t *filter = NULL;
+  float value = 0, rate = 0;
+  uint32_t now = rule_filter_millis();
+  uint8_t nr = rules_gettop(obj);
+  int8_t ret = 0;
+
+  if(nr != 2) {
+    return -1;
+  }
+  if((ret = rule_filter_tofloat(obj, 2, &value)) == -1) {
+    return -1;
+  }
+  if((filter = rule_filter_get(obj, RULE_FILTER_RATE)) == NULL) {
+    return -1;
+  }
+  while(nr > 0) {
+    rules_remove(obj, nr--);
+  }
+
+  if(ret == 1) {
+    rules_pushnil(obj);
+    return 0;
+  }
+
+  if(filter->nr > 0 && now != filter->time) {
+    rate = (value - filter->value) * 1000 / (float)(now - filter->time);
+  }
+  if(filter->nr == 0 || now != filter->time) {
+    filter->value = value;
+    filter->time = now;
+    filter->nr = 1;
+  }
+
+#ifdef DEBUG
+  printf("\trate = %f\n", rate);
+#endif
+  rule_filter_push(obj, rate);
+
+  return 0;
+}
@@ -21,8 +21,6 @@
 #include "../../common/timerqueue.h"
 
 int8_t rule_function_set_timer_callback(struct rules_t *obj) {
-  struct timerqueue_t *node = NULL;
-  struct itimerval it_val;
   uint16_t sec = 0, nr = 0;
   uint8_t x = rules_gettop(obj);
 
@@ -58,6 +56,10 @@ int8_t rule_function_set_timer_callback(struct rules_t *obj) {
     } break;
   }
 
+  if(rules_validating()) {
+    return 0;
+  }
+
   timerqueue_insert(sec, 0, nr);
 
   logprintf_P(F("timer #%d set to %d seconds"), nr, sec);
@@ -41,7 +41,7 @@
 #include "function.h"
 
 #define EPSILON 0.000001
-#define JMPSIZE 37
+#define JMPSIZE 43
 
 #if (!defined(NON32XFER_HANDLER) && defined(MMU_SEC_HEAP)) || defined(COVERALLS)
   #define getval(a) \
@@ -178,7 +178,13 @@ struct {
   "OP_PUSH",
   "OP_CALL",
   "OP_CLEAR",
-  "OP_RET"
+  "OP_RET",
+  "OP_GETEQ",
+  "OP_GETNE",
+  "OP_GETLT",
+  "OP_GETLE",
+  "OP_GETGT",
+  "OP_GETGE"
 };
 #endif
 
@@ -212,10 +218,70 @@ typedef struct rule_timer_t {
 
 static struct rule_stack_t *varstack = NULL;
 static struct rule_stack_t *stack = NULL;
+
+/*
+ * Strings are interned in the varstack, the number of
+ * an entry is its handle. A hash index holds the handle
+ * + 1 of every string, 0 is a free slot. Each string
+ * is preceded by its handle, so it can be referenced
+ * without looking it up. Runtime strings nothing refers
+ * to anymore are put on the dead list and given back
+ * when the next run starts, when no stack value can
+ * point to them. Free entries are linked through their
+ * len (low byte) and ref (high byte) fields.
+ */
+#define RULESTRINGHDR sizeof(uint16_t)
+#if defined(ESP8266)
+  #define RULESTRINGDEAD 32
+  #define RULESTRINGSPARE 16 // runtime strings the index is sized for
+#else
+  #define RULESTRINGDEAD 128
+  #define RULESTRINGSPARE 64
+#endif
+
+/*
+ * Once the rules are loaded the string bodies are moved
+ * to an arena in the mempool, so runtime strings don't
+ * fragment the heap. Each block starts with its size,
+ * the lowest bit set when it's used, followed by the
+ * handle of its string. Before that, or when the arena
+ * is full, a body is taken from the heap. Without the
+ * handler for byte access to the IRAM mempool the glue
+ * couldn't read the strings, so they stay on the heap.
+ */
+#define RULESTRINGBLOCK (2*sizeof(uint16_t))
+#if !defined(NON32XFER_HANDLER) && defined(MMU_SEC_HEAP)
+  #define RULESTRINGARENA 0
+#elif defined(ESP8266)
+  #define RULESTRINGARENA 512 // bytes kept for runtime strings
+#else
+  #define RULESTRINGARENA 2048
+#endif
+
+static unsigned char *strarena = NULL;
+static uint16_t strarenasize = 0;
+static uint16_t *strindex = NULL;
+static uint16_t strslots = 0;
+static uint8_t strheap = 0; // the index isn't in the mempool
+static uint16_t strfree = 0; // first free entry + 1
+static uint16_t strdead[RULESTRINGDEAD];
+static uint8_t nrstrdead = 0;
+static uint8_t strdeadfull = 0;
+static uint16_t strnr = 0;
+static uint32_t strbytes = 0;
+static uint32_t strlookups = 0;
+static uint32_t strhits = 0;
 static struct rule_timer_t timestamp;
 
 static uint8_t group = 1;
 
+/*
+ * Number of bytecode instructions executed since boot
+ */
+static uint32_t nrops = 0;
+static uint32_t budget = 0;
+static uint8_t validating = 0;
+
 // static uint32_t align(uint32_t p, uint8_t b) {
   // return (p + b) - ((p + b) % b);
 // }
@@ -340,6 +406,35 @@ static uint16_t lexer_parse_string(char *text, uint16_t len, uint16_t *pos) {
   return 0;
 }
 
+/*
+  An event name can have a quoted part with spaces in it, for
+  example Time#"0 6 * * 1-5", which is kept as is.
+*/
+static int8_t lexer_parse_event(char *text, uint16_t len, uint16_t *pos) {
+  char current = getval(text[*pos]);
+
+  while(*pos < len &&
+      (current != ' ' &&
+      current != ',' &&
+      current != ';' &&
+      current != '(' &&
+      current != ')')) {
+    if(current == '"') {
+      (*pos)++;
+      while(*pos < len && getval(text[*pos]) != '"') {
+        (*pos)++;
+      }
+      if(*pos == len) {
+        return -1;
+      }
+    }
+    (*pos)++;
+    current = getval(text[*pos]);
+  }
+
+  return 0;
+}
+
 static int8_t lexer_parse_quoted_string(char *text, uint16_t len, uint16_t *pos) {
   uint8_t start = 0;
   char current = 0;
@@ -482,63 +577,297 @@ static int16_t lexer_peek(char **text, uint16_t skip, uint8_t *type, uint16_t *s
   return -1;
 }
 
-static int32_t varstack_find(char **text, uint16_t start, uint16_t len) {
-  uint32_t a = varstack->nrbytes;
-  uint32_t i = 0, x = 0;
+/*
+ * Tabs and newlines in strings are tokenized as 127
+ * and 128
+ */
+static uint8_t varstack_char(uint8_t c) {
+  if(c == 127) {
+    return 9;
+  } else if(c == 128) {
+    return 10;
+  }
+  return c;
+}
 
-  for(i=0;i<a;i++) {
-    if(gettype(varstack->buffer[i]) == VCHAR) {
-      struct vm_vchar_t *old = (struct vm_vchar_t *)&varstack->buffer[i];
-      if(len == old->len) {
-        for(x=0;x<len;x++) {
-          if(getval(old->value[x]) != getval((*text)[start+x])) {
-            break;
-          }
+static struct vm_vchar_t *varstack_entry(uint16_t nr) {
+  return (struct vm_vchar_t *)&varstack->buffer[nr*sizeof(struct vm_vchar_t)];
+}
+
+static uint16_t varstack_handle(const char *str) {
+  uint16_t nr = 0;
+  memcpy(&nr, &str[-RULESTRINGHDR], RULESTRINGHDR);
+  return nr;
+}
+
+static uint32_t varstack_hash(char **text, uint16_t start, uint16_t len) {
+  uint32_t hash = 2166136261UL;
+  uint16_t x = 0;
+
+  for(x=0;x<len;x++) {
+    hash = (hash ^ varstack_char(getval((*text)[start+x]))) * 16777619UL;
+  }
+  return hash;
+}
+
+static uint8_t varstack_in_arena(const char *str) {
+  return (const unsigned char *)str >= strarena && (const unsigned char *)str < &strarena[strarenasize];
+}
+
+/*
+ * First fit, free blocks are merged with the free blocks
+ * behind them while looking for room.
+ */
+static unsigned char *varstack_arena_alloc(uint16_t len) {
+  uint16_t pos = 0, size = 0, next = 0, x = 0;
+  uint16_t need = (RULESTRINGBLOCK+len+3) & ~3;
+
+  while(pos < strarenasize) {
+    uint16_t *hdr = (uint16_t *)&strarena[pos];
+    size = getval(hdr[0]);
+    if((size & 1) == 0) {
+      while((next = pos+size) < strarenasize && (getval(((uint16_t *)&strarena[next])[0]) & 1) == 0) {
+        size += getval(((uint16_t *)&strarena[next])[0]);
+      }
+      if(size >= need) {
+        if(size >= need+RULESTRINGBLOCK+4) {
+          setval(((uint16_t *)&strarena[pos+need])[0], size-need);
+          size = need;
         }
-        if(x == old->len) {
-          return i;
+        setval(hdr[0], size | 1);
+        for(x=RULESTRINGBLOCK;x<size;x++) {
+          setval(strarena[pos+x], 0);
         }
+        return &strarena[pos];
       }
-      i += sizeof(struct vm_vchar_t)-1;
+      setval(hdr[0], size);
     }
+    pos += size & ~1;
   }
-  return -1;
+  return NULL;
 }
 
-static uint16_t varstack_add(char **text, uint16_t start, uint16_t len, uint8_t fixed) {
-  uint16_t a = varstack->nrbytes;
-  int32_t i = -1;
+static char *varstack_alloc(uint16_t nr, uint16_t len) {
+  unsigned char *p = NULL;
 
-  struct vm_vchar_t *value = (struct vm_vchar_t *)&varstack->buffer[a];
+  if(strarena != NULL && (p = varstack_arena_alloc(len+1)) != NULL) {
+    setval(((uint16_t *)p)[1], nr);
+    strnr++;
+    strbytes += len+1;
+    return (char *)&p[RULESTRINGBLOCK];
+  }
 
-  i = varstack_find(text, start, len);
+  if((p = (unsigned char *)MALLOC(RULESTRINGHDR+len+1)) == NULL) {
+    OUT_OF_MEMORY
+    return NULL;
+  }
+  memset(p, 0, RULESTRINGHDR+len+1);
+  memcpy(p, &nr, RULESTRINGHDR);
 
-  if(i > -1) {
-    return i;
+#if defined(DEBUG) || defined(COVERALLS)
+  memused += RULESTRINGHDR+len+1;
+#endif
+  strnr++;
+  strbytes += len+1;
+
+  return (char *)&p[RULESTRINGHDR];
+}
+
+static void varstack_release(struct vm_vchar_t *node) {
+  if(node->value == NULL) {
+    return;
   }
+  uint16_t len = strlen(node->value);
+  if(varstack_in_arena(node->value)) {
+    uint16_t *hdr = (uint16_t *)&node->value[-RULESTRINGBLOCK];
+    setval(hdr[0], getval(hdr[0]) & ~1);
+  } else {
+    char *p = &node->value[-RULESTRINGHDR];
+    FREE(p);
+#if defined(DEBUG) || defined(COVERALLS)
+    memused -= RULESTRINGHDR+len+1;
+#endif
+  }
+  node->value = NULL;
 
-  if(fixed == 0) {
-    for(i=0;i<a;i++) {
-      if(gettype(varstack->buffer[i]) == VCHAR) {
-        struct vm_vchar_t *old = (struct vm_vchar_t *)&varstack->buffer[i];
-        if(getval(old->fixed) == 0 && getval(old->ref) == 0) {
-          break;
-        }
-        i += sizeof(struct vm_vchar_t)-1;
+  strnr--;
+  strbytes -= len+1;
+}
+
+/*
+ * Moves the bodies of the strings the rules were loaded
+ * with into a new arena, the rule names point to them.
+ */
+static void varstack_arena_build(struct rules_t **rules, uint8_t nrrules, struct pbuf *mempool) {
+  uint16_t nr = 0, nrvars = rules_nrvars(), len = 0, x = 0;
+  uint32_t size = RULESTRINGARENA;
+  unsigned char *p = NULL;
+  uint8_t i = 0;
+
+  if(RULESTRINGARENA == 0 || strarena != NULL) {
+    return;
+  }
+  for(nr=0;nr<nrvars;nr++) {
+    struct vm_vchar_t *node = varstack_entry(nr);
+    if(node->value != NULL) {
+      size += (RULESTRINGBLOCK+strlen(node->value)+1+3) & ~3;
+    }
+  }
+  size = (size+3) & ~3;
+  if(size > 0xFFFC || (strarena = (unsigned char *)rules_alloc(mempool, size)) == NULL) {
+    logprintln_P(F("no room for the strings in the mempool"));
+    return;
+  }
+  strarenasize = size;
+  setval(((uint16_t *)strarena)[0], strarenasize);
+
+  for(nr=0;nr<nrvars;nr++) {
+    struct vm_vchar_t *node = varstack_entry(nr);
+    if(node->value == NULL) {
+      continue;
+    }
+    len = strlen(node->value);
+    p = varstack_arena_alloc(len+1);
+    setval(((uint16_t *)p)[1], nr);
+    for(x=0;x<len;x++) {
+      setval(p[RULESTRINGBLOCK+x], node->value[x]);
+    }
+    for(i=0;i<nrrules;i++) {
+      if(rules[i]->name == node->value) {
+        rules[i]->name = (const char *)&p[RULESTRINGBLOCK];
       }
     }
-    if(i == a) {
-      i = -1;
+    char *old = &node->value[-RULESTRINGHDR];
+    FREE(old);
+#if defined(DEBUG) || defined(COVERALLS)
+    memused -= RULESTRINGHDR+len+1;
+#endif
+    node->value = (char *)&p[RULESTRINGBLOCK];
+  }
+}
+
+static void varstack_index_put(uint16_t nr) {
+  struct vm_vchar_t *node = varstack_entry(nr);
+  uint16_t mask = strslots-1;
+  uint16_t i = varstack_hash(&node->value, 0, getval(node->len)) & mask;
+
+  while(getval(strindex[i]) != 0) {
+    i = (i + 1) & mask;
+  }
+  setval(strindex[i], nr+1);
+}
+
+/*
+ * Linear probing without tombstones, like the timerqueue:
+ * after freeing a slot, shift back the entries of the run
+ * behind it that would no longer be found.
+ */
+static void varstack_index_del(uint16_t nr) {
+  struct vm_vchar_t *node = varstack_entry(nr);
+  uint16_t mask = strslots-1, j = 0, k = 0, x = 0;
+  uint16_t i = varstack_hash(&node->value, 0, getval(node->len)) & mask;
+
+  while((x = getval(strindex[i])) != nr+1) {
+    if(x == 0) {
+      return;
     }
-    if(i > -1) {
-      a = i;
-      value = (struct vm_vchar_t *)&varstack->buffer[a];
+    i = (i + 1) & mask;
+  }
+  setval(strindex[i], 0);
+
+  j = i;
+  while(1) {
+    j = (j + 1) & mask;
+    if((x = getval(strindex[j])) == 0) {
+      break;
+    }
+    node = varstack_entry(x-1);
+    k = varstack_hash(&node->value, 0, getval(node->len)) & mask;
+    if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      setval(strindex[i], x);
+      setval(strindex[j], 0);
+      i = j;
     }
   }
-  if(i == -1) {
-    if(a+sizeof(struct vm_vchar_t) > varstack->bufsize) {
-      void *oldptr = (void *)varstack->buffer;
+}
 
+/*
+ * Fills a zeroed index of slots entries, a power of two.
+ */
+static void varstack_index_build(uint16_t *buf, uint16_t slots, uint8_t heap) {
+  uint16_t nr = 0, nrvars = rules_nrvars();
+
+  if(strheap == 1) {
+    FREE(strindex);
+  }
+  strindex = buf;
+  strslots = slots;
+  strheap = heap;
+
+  for(nr=0;nr<nrvars;nr++) {
+    if(varstack_entry(nr)->value != NULL) {
+      varstack_index_put(nr);
+    }
+  }
+}
+
+/*
+ * Keeps the index at most half full, a new one is
+ * taken from the heap.
+ */
+static int8_t varstack_index_grow(uint16_t nrvars) {
+  uint16_t slots = (strslots == 0) ? 16 : strslots, *buf = NULL;
+
+  while(slots < nrvars*2) {
+    slots *= 2;
+  }
+  if(slots == strslots) {
+    return 0;
+  }
+  if((buf = (uint16_t *)MALLOC(sizeof(uint16_t)*slots)) == NULL) {
+    OUT_OF_MEMORY
+    return -1;
+  }
+  memset(buf, 0, sizeof(uint16_t)*slots);
+  varstack_index_build(buf, slots, 1);
+  return 0;
+}
+
+static int32_t varstack_find(char **text, uint16_t start, uint16_t len) {
+  uint16_t mask = strslots-1, i = 0, nr = 0, x = 0;
+
+  if(strindex == NULL) {
+    return -1;
+  }
+
+  i = varstack_hash(text, start, len) & mask;
+  while((nr = getval(strindex[i])) != 0) {
+    struct vm_vchar_t *old = varstack_entry(nr-1);
+    if(len == getval(old->len)) {
+      for(x=0;x<len;x++) {
+        if((uint8_t)getval(old->value[x]) != varstack_char(getval((*text)[start+x]))) {
+          break;
+        }
+      }
+      if(x == len) {
+        return (nr-1)*sizeof(struct vm_vchar_t);
+      }
+    }
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+static uint16_t varstack_new(char **text, uint16_t start, uint16_t len, uint8_t fixed) {
+  struct vm_vchar_t *value = NULL;
+  uint16_t a = varstack->nrbytes, nr = 0, x = 0;
+
+  if(strfree > 0) {
+    nr = strfree-1;
+    value = varstack_entry(nr);
+    strfree = getval(value->len) | (getval(value->ref) << 8);
+  } else {
+    if(a+sizeof(struct vm_vchar_t) > varstack->bufsize) {
       if((varstack->buffer = (unsigned char *)REALLOC(varstack->buffer, varstack->bufsize+sizeof(struct vm_vchar_t))) == NULL) {
         OUT_OF_MEMORY
       }
@@ -548,39 +877,101 @@ static uint16_t varstack_add(char **text, uint16_t start, uint16_t len, uint8_t
 #if defined(DEBUG) || defined(COVERALLS)
       memused += sizeof(struct vm_vchar_t);
 #endif
-
-      if(varstack->buffer != oldptr) {
-        value = (struct vm_vchar_t *)&varstack->buffer[a];
-      }
     }
+    nr = a/sizeof(struct vm_vchar_t);
+    value = varstack_entry(nr);
+    setval(varstack->nrbytes, a+sizeof(struct vm_vchar_t));
   }
 
-  if((value->value = (char *)MALLOC(len+1)) == NULL) {
-    OUT_OF_MEMORY;
-  }
-  memset(value->value, 0, len+1);
-  for(uint16_t x=0;x<len;x++) {
-    if(((uint8_t)getval((*text)[start+x])) == 127) {
-      setval(value->value[x], 9);
-    } else if(((uint8_t)getval((*text)[start+x])) == 128) {
-      setval(value->value[x], 10);
-    } else {
-      setval(value->value[x], getval((*text)[start+x]));
+  if((value->value = varstack_alloc(nr, len)) != NULL) {
+    for(x=0;x<len;x++) {
+      setval(value->value[x], varstack_char(getval((*text)[start+x])));
     }
   }
-  setval(value->value[len], 0);
   setval(value->type, VCHAR);
   setval(value->len, len);
   setval(value->ref, 0);
   setval(value->fixed, fixed);
-  if(i == -1) {
-    setval(varstack->nrbytes, a+sizeof(struct vm_vchar_t));
+
+  if(value->value != NULL && varstack_index_grow(rules_nrvars()) == 0) {
+    varstack_index_put(nr);
   }
 
-#if defined(DEBUG) || defined(COVERALLS)
-  memused += len+1;
-#endif
+  return nr*sizeof(struct vm_vchar_t);
+}
 
+static uint16_t varstack_add(char **text, uint16_t start, uint16_t len, uint8_t fixed) {
+  int32_t a = varstack_find(text, start, len);
+
+  if(a > -1) {
+    /*
+     * A constant can equal a string of a validation run,
+     * the bytecode then keeps it.
+     */
+    if(fixed == 1) {
+      setval(((struct vm_vchar_t *)&varstack->buffer[a])->fixed, 1);
+    }
+    return a;
+  }
+  return varstack_new(text, start, len, fixed);
+}
+
+static void varstack_dead(uint16_t nr) {
+  if(nrstrdead < RULESTRINGDEAD) {
+    strdead[nrstrdead++] = nr;
+  } else {
+    strdeadfull = 1;
+  }
+}
+
+static void varstack_free(uint16_t nr) {
+  struct vm_vchar_t *node = varstack_entry(nr);
+
+  if(node->value == NULL || getval(node->fixed) != 0 || getval(node->ref) != 0) {
+    return;
+  }
+  varstack_index_del(nr);
+  varstack_release(node);
+  setval(node->len, strfree & 0xFF);
+  setval(node->ref, strfree >> 8);
+  strfree = nr+1;
+}
+
+/*
+ * Only called when a run starts, so no value on the
+ * stack points to a string given back.
+ */
+static void varstack_reclaim(void) {
+  uint16_t i = 0, nrvars = rules_nrvars();
+
+  if(strdeadfull == 1) {
+    for(i=0;i<nrvars;i++) {
+      varstack_free(i);
+    }
+  } else {
+    for(i=0;i<nrstrdead;i++) {
+      varstack_free(strdead[i]);
+    }
+  }
+  nrstrdead = 0;
+  strdeadfull = 0;
+}
+
+/*
+ * Looks up a runtime string, it's added when it's new.
+ */
+static uint16_t varstack_intern(const char *str) {
+  char *p = (char *)str;
+  uint16_t len = strlen(str);
+  int32_t a = varstack_find(&p, 0, len);
+
+  strlookups++;
+  if(a > -1) {
+    strhits++;
+    return a;
+  }
+  a = varstack_new(&p, 0, len, 0);
+  varstack_dead(a/sizeof(struct vm_vchar_t));
   return a;
 }
 
@@ -855,7 +1246,7 @@ static int8_t rule_prepare(char **text,
           setval((*text)[tpos], VINTEGER); tpos++;
           x = (uint32_t)var;
           if((var < 0 && var < -8388608) || (var > 0 && var > 16777215)) {
-            logprintf_P(F("FATAL: Integer %g is out of range"), __FUNCTION__, __LINE__, var);
+            logprintf_P(F("FATAL: Integer %g is out of range"), var);
             return -1;
           }
         } else {
@@ -957,7 +1348,10 @@ static int8_t rule_prepare(char **text,
         lexer_parse_skip_characters((*text), *len, &pos);
       }
       uint16_t s = pos;
-      lexer_parse_string((*text), *len, &pos);
+      if(lexer_parse_event((*text), *len, &pos) == -1) {
+        logprintf_P(F("ERROR: unterminated quote in event name"));
+        return -1;
+      }
 
       if(ctx == TCEVENT || ctx == TTHEN) {
         logprintf_P(F("ERROR: nested 'on' block"));
@@ -1331,7 +1725,7 @@ static int8_t rule_prepare(char **text,
       if(nrhooks > 0) {
         /* LCOV_EXCL_START*/
         /* FIXME */
-        logprintf_P(F("ERROR: missing matching ')'"), &(*text)[pos]);
+        logprintf_P(F("ERROR: missing matching ')'"));
         /* LCOV_EXCL_STOP*/
         return -1;
       }
@@ -1363,7 +1757,7 @@ static int8_t rule_prepare(char **text,
   if(nrhooks > 0) {
     /* LCOV_EXCL_START*/
     /* FIXME */
-    logprintf_P(F("ERROR: missing matching ')'"), &(*text)[pos]);
+    logprintf_P(F("ERROR: missing matching ')'"));
     return -1;
     /* LCOV_EXCL_STOP*/
   }
@@ -1492,8 +1886,23 @@ int8_t rules_pushfloat(struct rules_t *obj, float nr) {
 }
 
 int8_t rules_pushstring(struct rules_t *obj, char *str) {
-  uint16_t c = varstack_add(&str, 0, strlen(str), 0);
-  assert(c >= 0);
+  uint16_t c = varstack_intern(str);
+
+  unsigned char val[rule_max_var_bytes()] = { '\0' };
+  struct vm_vptr_t *node = (struct vm_vptr_t *)val;
+
+  setval(node->type, VPTR);
+  setval(node->value, c/sizeof(struct vm_top_t));
+
+  return vm_stack_push(obj, 0, val) >= 0;
+}
+
+/*
+ * Pushes a string from rules_tostring or rules_addstring
+ * without looking it up again.
+ */
+int8_t rules_pushinterned(struct rules_t *obj, const char *str) {
+  uint16_t c = varstack_handle(str)*sizeof(struct vm_vchar_t);
 
   unsigned char val[rule_max_var_bytes()] = { '\0' };
   struct vm_vptr_t *node = (struct vm_vptr_t *)val;
@@ -1504,36 +1913,78 @@ int8_t rules_pushstring(struct rules_t *obj, char *str) {
   return vm_stack_push(obj, 0, val) >= 0;
 }
 
+/*
+ * The string has to come from rules_tostring or
+ * rules_addstring. A string referenced 255 times
+ * is kept until the rules are reloaded.
+ */
 void rules_ref(const char *str) {
-  int32_t c = varstack_find((char **)&str, 0, strlen(str));
-  if(c == -1) {
-    return;
+  struct vm_vchar_t *node = varstack_entry(varstack_handle(str));
+  uint8_t ref = getval(node->ref);
+
+  if(getval(node->fixed) == 0 && ref < 0xFF) {
+    setval(node->ref, ref+1);
+  }
+}
+
+void rules_unref(const char *str) {
+  uint16_t nr = varstack_handle(str);
+  struct vm_vchar_t *node = varstack_entry(nr);
+  uint8_t ref = getval(node->ref);
+
+  if(getval(node->fixed) == 0 && ref > 0 && ref < 0xFF) {
+    setval(node->ref, ref-1);
+    if(ref == 1) {
+      varstack_dead(nr);
+    }
   }
+}
 
+/*
+  Adds a copy of a string to the varstack for a value that has to
+  outlive the rules it came from. The copy is referenced once.
+*/
+const char *rules_addstring(const char *str) {
+  if(varstack == NULL) {
+    return NULL;
+  }
+  uint16_t c = varstack_intern(str);
   struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[c];
-  if(getval(node->fixed) == 0) {
-    setval(node->ref, getval(node->ref)+1);
+  if(node->value != NULL) {
+    rules_ref(node->value);
   }
+  return (const char *)node->value;
 }
 
-void rules_unref(const char *str) {
-  int32_t c = varstack_find((char **)&str, 0, strlen(str));
-  if(c == -1) {
+/*
+ * Moves the string index into the mempool, sized for
+ * the runtime strings as well. It stays on the heap
+ * when the mempool is full.
+ */
+void rules_strings_build(struct rules_t **rules, uint8_t nrrules, struct pbuf *mempool) {
+  uint16_t slots = 16, *buf = NULL;
+
+  if(varstack == NULL) {
     return;
   }
+  varstack_arena_build(rules, nrrules, mempool);
 
-  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[c];
-  if(getval(node->fixed) == 0) {
-    setval(node->ref, getval(node->ref)-1);
-    if(getval(node->ref) == 0) {
-      FREE(node->value);
-#if defined(DEBUG) || defined(COVERALLS)
-      memused -= node->len+1;
-#endif
-      node->value = NULL;
-      setval(node->len, 0);
-    }
+  while(slots < (rules_nrvars()+RULESTRINGSPARE)*2) {
+    slots *= 2;
+  }
+  if((buf = (uint16_t *)rules_alloc(mempool, sizeof(uint16_t)*slots)) == NULL) {
+    logprintln_P(F("no room for the string index in the mempool"));
+    return;
   }
+  varstack_index_build(buf, slots, 0);
+}
+
+void rules_strings(struct rule_strings_t *stats) {
+  stats->nr = strnr;
+  stats->bytes = strbytes;
+  stats->slots = strslots;
+  stats->lookups = strlookups;
+  stats->hits = strhits;
 }
 
 const char *rules_tostring(struct rules_t *obj, int8_t pos) {
@@ -1553,6 +2004,89 @@ const char *rules_tostring(struct rules_t *obj, int8_t pos) {
   return NULL;
 }
 
+/*
+ * Variable names are stored once in the varstack. The
+ * index of a name doesn't change as long as the rules
+ * are loaded, so it can be used to give it a fixed slot.
+ */
+int16_t rules_tovar(struct rules_t *obj, int8_t pos) {
+  int16_t offset = vm_val_pos(pos);
+  if(pos < 0) {
+    offset = getval(stack->nrbytes)-offset;
+  }
+  if(offset >= 4) {
+    if(getval(stack->buffer[offset]) == VPTR) {
+      struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+      return (getval(node->value)*sizeof(struct vm_top_t))/sizeof(struct vm_vchar_t);
+    }
+  }
+  return -1;
+}
+
+uint16_t rules_nrvars(void) {
+  if(varstack == NULL) {
+    return 0;
+  }
+  return varstack->nrbytes/sizeof(struct vm_vchar_t);
+}
+
+const char *rules_varname(uint16_t nr) {
+  if(nr >= rules_nrvars()) {
+    return NULL;
+  }
+  struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[nr*sizeof(struct vm_vchar_t)];
+  if(gettype(var->type) != VCHAR || getval(var->fixed) == 0) {
+    return NULL;
+  }
+  return (const char *)var->value;
+}
+
+int8_t rules_usesvar(struct rules_t *obj, uint16_t nr) {
+  uint16_t i = 0, nrbytes = getval(obj->bc.nrbytes);
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    uint8_t type = gettype(node->type);
+    if(type == OP_SETVAL && (int8_t)getval(node->a) == nr) {
+      return 1;
+    }
+    if((type == OP_GETVAL || (type >= OP_GETEQ && type <= OP_GETGE)) && (int8_t)getval(node->b) == nr) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Hands out memory from the mempool behind the rules.
+ * The stack always comes last, so it moves up. This is
+ * only safe when no rule is running.
+ */
+void *rules_alloc(struct pbuf *mempool, uint16_t size) {
+  uint16_t stacksize = 0;
+  void *ret = NULL;
+
+  size = (size+3) & ~3;
+  if(stack != NULL) {
+    stacksize = sizeof(struct rule_stack_t)+getval(stack->bufsize);
+  }
+  if(mempool->len+size+stacksize > mempool->tot_len) {
+    return NULL;
+  }
+
+  ret = &((unsigned char *)mempool->payload)[mempool->len];
+  mempool->len += size;
+  memset(ret, 0, size);
+
+  if(stack != NULL) {
+    uint16_t bufsize = getval(stack->bufsize);
+    stack = (struct rule_stack_t *)&((unsigned char *)mempool->payload)[mempool->len];
+    setval(stack->bufsize, bufsize);
+    setval(stack->nrbytes, 4);
+    stack->buffer = &((unsigned char *)mempool->payload)[mempool->len+sizeof(struct rule_stack_t)];
+  }
+  return ret;
+}
+
 int rules_tointeger(struct rules_t *obj, int8_t pos) {
   int16_t offset = vm_val_pos(pos);
   if(pos < 0) {
@@ -2197,8 +2731,498 @@ static void bc_assign_slots(struct rules_t *obj) {
         }
       }
     }
-    end = bc_next(obj, end);
+    end = bc_next(obj, end);
+  }
+}
+
+/*
+ * After the slots are assigned the bytecode gets a few cheap
+ * peephole passes:
+ * - math on two constants is computed once here;
+ * - an if on a constant comparison loses the branch that can
+ *   never run;
+ * - a variable read directly compared against a constant is
+ *   fused into a single OP_GETxx instruction.
+ * Removed instructions are marked with type 0 and compacted away
+ * at the end, after which the relative jumps are corrected.
+ */
+#define is_compare(a) (a >= OP_EQ && a <= OP_OR)
+#define is_getcmp(a) (a >= OP_GETEQ && a <= OP_GETGE)
+
+static uint8_t bc_slot_reads(struct vm_top_t *node, int8_t slot) {
+  uint8_t type = gettype(node->type);
+  if(is_op_and_math(type)) {
+    return ((int8_t)getval(node->b) == slot || (int8_t)getval(node->c) == slot);
+  } else if(type == OP_TEST || type == OP_PUSH) {
+    return ((int8_t)getval(node->a) == slot);
+  } else if(type == OP_SETVAL) {
+    return ((int8_t)getval(node->b) == slot);
+  } else if(is_getcmp(type)) {
+    return ((int8_t)getval(node->c) == slot);
+  }
+  return 0;
+}
+
+static uint8_t bc_slot_writes(struct vm_top_t *node, int8_t slot) {
+  uint8_t type = gettype(node->type);
+  if(is_op_and_math(type) || is_getcmp(type) || type == OP_GETVAL || type == OP_CALL) {
+    return ((int8_t)getval(node->a) == slot);
+  }
+  return 0;
+}
+
+static void bc_slot_replace(struct vm_top_t *node, int8_t slot, int8_t with) {
+  uint8_t type = gettype(node->type);
+  if(is_op_and_math(type)) {
+    if((int8_t)getval(node->b) == slot) {
+      setval(node->b, with);
+    }
+    if((int8_t)getval(node->c) == slot) {
+      setval(node->c, with);
+    }
+  } else if(type == OP_TEST || type == OP_PUSH) {
+    setval(node->a, with);
+  } else if(type == OP_SETVAL) {
+    setval(node->b, with);
+  } else if(is_getcmp(type)) {
+    setval(node->c, with);
+  }
+}
+
+/*
+ * How many operands in the whole bytecode refer to this slot
+ */
+static uint16_t bc_slot_uses(struct rules_t *obj, int8_t slot) {
+  uint16_t i = 0, nrbytes = getval(obj->bc.nrbytes), cnt = 0;
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    uint8_t type = gettype(node->type);
+    if(type == 0 || type == OP_JMP) {
+      continue;
+    }
+    cnt += ((int8_t)getval(node->a) == slot);
+    cnt += ((int8_t)getval(node->b) == slot);
+    cnt += ((int8_t)getval(node->c) == slot);
+  }
+  return cnt;
+}
+
+/*
+ * A slot is constant when it holds a number
+ * and no instruction ever writes to it.
+ */
+static int8_t bc_slot_const(struct rules_t *obj, int8_t slot, float *out) {
+  uint16_t i = 0, nrbytes = getval(obj->bc.nrbytes);
+  uint16_t pos = vm_val_pos(slot);
+
+  if(slot >= 0 || pos >= getval(obj->heap->nrbytes)) {
+    return -1;
+  }
+
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    if(gettype(node->type) != 0 && bc_slot_writes(node, slot)) {
+      return -1;
+    }
+  }
+
+  if(out == NULL) {
+    return 0;
+  }
+
+  switch(gettype(obj->heap->buffer[pos])) {
+    case VINTEGER: {
+      struct vm_vinteger_t *node = (struct vm_vinteger_t *)&obj->heap->buffer[pos];
+      uint32_t val = 0;
+      val |= getval(node->value[0]) << 16;
+      val |= getval(node->value[1]) << 8;
+      val |= getval(node->value[2]);
+
+      if(val & 0x800000) {
+        val |= 0xFF000000;
+        *out = ((float)(val*-1))*-1;
+      } else {
+        *out = (float)val;
+      }
+    } break;
+    case VFLOAT: {
+      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[pos];
+      uint32_t val = 0;
+      val |= (getval(node->type) >> 5) << 29;
+      val |= getval(node->value[0]) << 21;
+      val |= getval(node->value[1]) << 13;
+      val |= getval(node->value[2]) << 5;
+
+      uint322float(val, out);
+    } break;
+    default: {
+      return -1;
+    } break;
+  }
+  return 0;
+}
+
+/*
+ * Stores a number the same way STEP_MATH_RESULT does, an
+ * integer has to fit in 24 bits.
+ */
+static void bc_slot_store(struct rules_t *obj, int8_t slot, float var) {
+  uint16_t pos = vm_val_pos(slot);
+  float nr = 0;
+
+  if(modff(var, &nr) == 0) {
+    struct vm_vinteger_t *value = (struct vm_vinteger_t *)&obj->heap->buffer[pos];
+    setval(value->type, VINTEGER);
+    setval(value->value[0], ((uint32_t)(int32_t)var >> 16) & 0xFF);
+    setval(value->value[1], ((uint32_t)(int32_t)var >> 8) & 0xFF);
+    setval(value->value[2], ((uint32_t)(int32_t)var) & 0xFF);
+  } else {
+    float f = float32to27(var);
+    uint32_t x = 0;
+    float2uint32(f, &x);
+
+    struct vm_vfloat_t *value = (struct vm_vfloat_t *)&obj->heap->buffer[pos];
+    setval(value->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
+    setval(value->value[0], ((uint32_t)x >> 21) & 0xFF);
+    setval(value->value[1], ((uint32_t)x >> 13) & 0xFF);
+    setval(value->value[2], ((uint32_t)x >> 5) & 0xFF);
+  }
+}
+
+/*
+ * A slot is dead from an instruction onwards when in every
+ * block that follows it's written before it's read. Only
+ * forward jumps exist, so a block can only be entered at
+ * its start.
+ */
+static uint8_t bc_slot_dead(struct rules_t *obj, uint8_t *targets, uint16_t from, int8_t slot) {
+  uint16_t i = 0, nrbytes = getval(obj->bc.nrbytes);
+  uint8_t written = 0;
+
+  for(i=from;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    uint8_t type = gettype(node->type);
+    if(i > from && targets[i/sizeof(struct vm_top_t)] == 1) {
+      written = 0;
+    }
+    if(type == 0) {
+      continue;
+    }
+    if(written == 0) {
+      if(bc_slot_reads(node, slot)) {
+        return 0;
+      }
+      if(bc_slot_writes(node, slot)) {
+        written = 1;
+      }
+    }
+    if(type == OP_JMP) {
+      written = 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * A taken or skipped OP_JMP always clears the jump flag, so
+ * removing one is only safe when the flag was already cleared
+ * by an earlier jump. A comparison on a NULL value leaves the
+ * flag as it was, and rules called from another rule inherit
+ * it, so a compare, test or call in between, or the start of
+ * the bytecode, keeps the jump in place.
+ */
+static uint8_t bc_flag_safe(struct rules_t *obj, uint16_t pos) {
+  int32_t i = pos;
+  uint8_t type = 0;
+
+  while((i = bc_before(obj, i)) >= 0) {
+    type = gettype(obj->bc.buffer[i]);
+    if(type == OP_JMP) {
+      return 1;
+    }
+    if(is_compare(type) || is_getcmp(type) || type == OP_TEST || type == OP_CALL) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static int32_t bc_next_kept(struct rules_t *obj, uint16_t pos) {
+  int32_t i = pos;
+  while((i = bc_next(obj, i)) >= 0) {
+    if(gettype(obj->bc.buffer[i]) != 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static float bc_compute(uint8_t type, float x, float y) {
+  switch(type) {
+    case OP_EQ: return (fabs(x-y) < EPSILON);
+    case OP_NE: return (fabs(x-y) >= EPSILON);
+    case OP_LT: return (x < y);
+    case OP_LE: return (x <= y);
+    case OP_GT: return (x > y);
+    case OP_GE: return (x >= y);
+    case OP_AND: return (x > 0 && y > 0);
+    case OP_OR: return (x > 0 || y > 0);
+    case OP_SUB: return x-y;
+    case OP_ADD: return x+y;
+    case OP_DIV: return x/y;
+    case OP_MUL: return x*y;
+    case OP_POW: return pow(x, y);
+    case OP_MOD: return fmodf(x, y);
+  }
+  return 0;
+}
+
+static uint8_t bc_fold(struct rules_t *obj, uint8_t *targets) {
+  uint16_t i = 0, nrbytes = getval(obj->bc.nrbytes);
+  int32_t j = 0, end = -1;
+  uint8_t changed = 0;
+  float x = 0, y = 0, var = 0, nr = 0;
+
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    uint8_t type = gettype(node->type);
+    int8_t a = (int8_t)getval(node->a);
+    int8_t b = (int8_t)getval(node->b);
+    int8_t c = (int8_t)getval(node->c);
+    int8_t host = 0;
+
+    if(!is_math(type) || b == c) {
+      continue;
+    }
+    if(bc_slot_const(obj, b, &x) == -1 || bc_slot_const(obj, c, &y) == -1) {
+      continue;
+    }
+    var = bc_compute(type, x, y);
+    if(isnan(var) || isinf(var)) {
+      continue;
+    }
+    /*
+     * Integers are stored in 24 bits, what STEP_MATH_RESULT
+     * makes of anything larger is left to the runtime.
+     */
+    if(modff(var, &nr) == 0 && (var < -8388608 || var > 8388607)) {
+      continue;
+    }
+
+    /*
+     * The result needs a slot only used by this
+     * instruction, so sharing constants stays safe.
+     */
+    if(bc_slot_uses(obj, b) == 1) {
+      host = b;
+    } else if(bc_slot_uses(obj, c) == 1) {
+      host = c;
+    } else {
+      continue;
+    }
+
+    /*
+     * Find where the result stops being used inside
+     * this block, it must be dead from there on.
+     */
+    end = -1;
+    for(j=i+sizeof(struct vm_top_t);j<nrbytes;j+=sizeof(struct vm_top_t)) {
+      struct vm_top_t *z = (struct vm_top_t *)&obj->bc.buffer[j];
+      uint8_t t = gettype(z->type);
+      if(targets[j/sizeof(struct vm_top_t)] == 1 || t == OP_JMP || t == OP_RET) {
+        end = j;
+        break;
+      }
+      if(t != 0 && bc_slot_writes(z, a)) {
+        break;
+      }
+    }
+    if(end >= 0 && bc_slot_dead(obj, targets, end, a) == 0) {
+      continue;
+    }
+
+    for(j=i+sizeof(struct vm_top_t);j<nrbytes;j+=sizeof(struct vm_top_t)) {
+      struct vm_top_t *z = (struct vm_top_t *)&obj->bc.buffer[j];
+      uint8_t t = gettype(z->type);
+      if(j == end) {
+        break;
+      }
+      if(t == 0) {
+        continue;
+      }
+      if(bc_slot_reads(z, a)) {
+        bc_slot_replace(z, a, host);
+      }
+      if(bc_slot_writes(z, a)) {
+        break;
+      }
+    }
+
+    bc_slot_store(obj, host, var);
+    setval(node->type, 0);
+    changed = 1;
+  }
+  return changed;
+}
+
+static uint8_t bc_prune(struct rules_t *obj, uint8_t *targets) {
+  uint16_t i = 0, k = 0, nrbytes = getval(obj->bc.nrbytes);
+  int32_t j = 0, to = 0;
+  uint8_t changed = 0;
+  float x = 0, y = 0;
+
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    uint8_t type = gettype(node->type);
+
+    if(!is_compare(type)) {
+      continue;
+    }
+    if((j = bc_next_kept(obj, i)) == -1 || gettype(obj->bc.buffer[j]) != OP_JMP ||
+       targets[j/sizeof(struct vm_top_t)] == 1) {
+      continue;
+    }
+    if(bc_slot_const(obj, (int8_t)getval(node->b), &x) == -1 ||
+       bc_slot_const(obj, (int8_t)getval(node->c), &y) == -1) {
+      continue;
+    }
+
+    struct vm_top_t *jmp = (struct vm_top_t *)&obj->bc.buffer[j];
+    to = j+((int8_t)getval(jmp->a)*sizeof(struct vm_top_t));
+
+    if(bc_compute(type, x, y) > 0) {
+      /*
+       * Condition always holds, the jump never happens
+       */
+      if(bc_flag_safe(obj, i) == 0 ||
+         bc_slot_dead(obj, targets, j+sizeof(struct vm_top_t), (int8_t)getval(node->a)) == 0) {
+        continue;
+      }
+      setval(node->type, 0);
+      setval(jmp->type, 0);
+    } else {
+      /*
+       * Condition never holds, everything up to the
+       * jump target can go. Other jumps may only land
+       * on the first instruction of that range.
+       */
+      if(to > nrbytes || bc_flag_safe(obj, i) == 0 ||
+         bc_slot_dead(obj, targets, to, (int8_t)getval(node->a)) == 0) {
+        continue;
+      }
+      for(k=0;k<nrbytes;k+=sizeof(struct vm_top_t)) {
+        struct vm_top_t *z = (struct vm_top_t *)&obj->bc.buffer[k];
+        if(gettype(z->type) != OP_JMP || (k >= i && k < to)) {
+          continue;
+        }
+        int32_t t = k+((int8_t)getval(z->a)*sizeof(struct vm_top_t));
+        if(t > i && t < to) {
+          break;
+        }
+      }
+      if(k < nrbytes) {
+        continue;
+      }
+      for(k=i;k<to;k+=sizeof(struct vm_top_t)) {
+        setval(obj->bc.buffer[k], 0);
+      }
+    }
+    changed = 1;
+  }
+  return changed;
+}
+
+static void bc_fuse(struct rules_t *obj, uint8_t *targets) {
+  uint16_t i = 0, nrbytes = getval(obj->bc.nrbytes);
+  int32_t j = 0;
+
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    if(gettype(node->type) != OP_GETVAL) {
+      continue;
+    }
+    if((j = bc_next_kept(obj, i)) == -1 || targets[j/sizeof(struct vm_top_t)] == 1) {
+      continue;
+    }
+
+    struct vm_top_t *cmp = (struct vm_top_t *)&obj->bc.buffer[j];
+    uint8_t type = gettype(cmp->type);
+    int8_t a = (int8_t)getval(node->a);
+    int8_t b = (int8_t)getval(cmp->b);
+    int8_t c = (int8_t)getval(cmp->c);
+
+    if(type < OP_EQ || type > OP_GE || (int8_t)getval(cmp->a) != a || b == c) {
+      continue;
+    }
+
+    /*
+     * Only when the variable is already on the left side,
+     * swapping them would name the wrong operator and side
+     * in the errors of STEP_OP_VALUES.
+     */
+    if(b != a || bc_slot_const(obj, c, NULL) == -1) {
+      continue;
+    }
+
+    setval(node->type, (getval(node->type) & 0xE0) | (type - OP_EQ + OP_GETEQ));
+    setval(node->c, c);
+    setval(cmp->type, 0);
+  }
+}
+
+static void bc_optimize(struct rules_t *obj) {
+  uint16_t nrbytes = getval(obj->bc.nrbytes), nr = nrbytes/sizeof(struct vm_top_t);
+  uint16_t i = 0, x = 0, y = 0;
+  uint8_t *targets = NULL;
+
+  if(nr == 0 || (targets = (uint8_t *)MALLOC(nr)) == NULL) {
+    return;
+  }
+  memset(targets, 0, nr);
+
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    if(gettype(node->type) == OP_JMP) {
+      x = (i/sizeof(struct vm_top_t))+(int8_t)getval(node->a);
+      if(x < nr) {
+        targets[x] = 1;
+      }
+    }
+  }
+
+  while(bc_fold(obj, targets) == 1 || bc_prune(obj, targets) == 1);
+  bc_fuse(obj, targets);
+
+  FREE(targets);
+
+  /*
+   * A jump to a removed instruction lands
+   * on the first one kept after it.
+   */
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    if(gettype(node->type) == OP_JMP) {
+      uint16_t to = i+((int8_t)getval(node->a)*sizeof(struct vm_top_t));
+      uint8_t cnt = 0;
+      for(x=i;x<to && x<nrbytes;x+=sizeof(struct vm_top_t)) {
+        cnt += (gettype(obj->bc.buffer[x]) != 0);
+      }
+      setval(node->a, cnt);
+    }
   }
+
+  for(x=0,y=0;x<nrbytes;x+=sizeof(struct vm_top_t)) {
+    if(gettype(obj->bc.buffer[x]) == 0) {
+      continue;
+    }
+    if(x != y) {
+      for(i=0;i<sizeof(struct vm_top_t);i++) {
+        setval(obj->bc.buffer[y+i], getval(obj->bc.buffer[x+i]));
+      }
+    }
+    y += sizeof(struct vm_top_t);
+  }
+  setval(obj->bc.nrbytes, y);
 }
 
 static int16_t bc_find_math_dep(struct rules_t *obj, uint16_t start, uint16_t a) {
@@ -2246,7 +3270,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
           if((tmp1B = bc_next(obj, tmp1B)) == -1) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             exit(-1);
             /* LCOV_EXCL_STOP*/
           }
@@ -2313,7 +3337,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
           if((tmp1B = bc_next(obj, tmp1B)) == -1) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             exit(-1);
             /* LCOV_EXCL_STOP*/
           }
@@ -2389,7 +3413,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
             if((tmp1C = bc_next(obj, tmp1C)) == -1) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               exit(-1);
               /* LCOV_EXCL_STOP*/
             }
@@ -2466,7 +3490,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
             if((tmp1B = bc_next(obj, tmp1B)) == -1) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               exit(-1);
               /* LCOV_EXCL_STOP*/
             }
@@ -2928,7 +3952,7 @@ uint16_t lexer_clear(struct rules_t *obj, char **text, uint16_t start, uint16_t
       } break;
       /* LCOV_EXCL_START*/
       default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       } break;
       /* LCOV_EXCL_STOP*/
     }
@@ -2958,7 +3982,7 @@ uint16_t lexer_clear(struct rules_t *obj, char **text, uint16_t start, uint16_t
       setval((*text)[y], tmp & 0xFF);
     } else {
       /* LCOV_EXCL_START*/
-        logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       /* LCOV_EXCL_STOP*/
     }
   }
@@ -4059,6 +5083,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           bc_parent(obj, OP_RET, 0, 0, 0);
 
           bc_assign_slots(obj);
+          bc_optimize(obj);
 
           loop = 0;
         } else if(type == TEND) {
@@ -4119,9 +5144,136 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
   return 0;
 }
 
+uint32_t rules_ops(void) {
+  return nrops;
+}
+
+/*
+ * Max instructions of a single rule_run, rules called
+ * by that rule included. 0 means no limit.
+ */
+void rules_budget(uint32_t ops) {
+  budget = ops;
+}
+
+uint8_t rules_validating(void) {
+  return validating;
+}
+
+/*
+ * Unwinds the rule calls of a run that
+ * went over its budget
+ */
+static int8_t vm_budget_hit(struct rules_t *obj) {
+  struct rules_t *ret = NULL;
+
+  logprintf_P(F("rule #%d stopped after %lu instructions"), (int)obj->nr, (unsigned long)budget);
+
+  while(obj != NULL) {
+    ret = obj->ctx.ret;
+    obj->ctx.ret = NULL;
+    obj->ctx.go = NULL;
+    setval(obj->cont, 0);
+    obj = ret;
+  }
+
+  return -2;
+}
+
+/*
+ * Reads variable b into heap position a
+ */
+static int8_t vm_getval(struct rules_t *obj, uint16_t a, uint16_t b) {
+  vm_stack_push(obj, b, &varstack->buffer[b]);
+
+  rule_options.vm_value_get(obj);
+
+#if defined(DEBUG) || defined(COVERALLS)
+  /* LCOV_EXCL_START*/
+  if(rules_gettop(obj) < 2) {
+    logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+    return -1;
+  }
+#endif
+
+  /* LCOV_EXCL_STOP*/
+  switch(rules_type(obj, -1)) {
+    case VNULL: {
+      struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
+      setval(upd->type, VNULL);
+    } break;
+    case VINTEGER: {
+      int32_t x = rules_tointeger(obj, -1);
+      struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+      setval(upd->type, VINTEGER);
+      setval(upd->value[0], ((uint32_t)x >> 16) & 0xFF);
+      setval(upd->value[1], ((uint32_t)x >> 8) & 0xFF);
+      setval(upd->value[2], ((uint32_t)x) & 0xFF);
+    } break;
+    case VCHAR: {
+      int16_t offset = vm_val_pos(-1);
+      offset = getval(stack->nrbytes)-offset;
+
+      if(offset >= 4) {
+        if(getval(stack->buffer[offset]) == VPTR) {
+          struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+
+          struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
+          setval(upd->type, VPTR);
+          setval(upd->value, getval(node->value));
+        } else {
+          return -1;
+        }
+      } else {
+        return -1;
+      }
+    } break;
+    case VFLOAT: {
+      float f = rules_tofloat(obj, -1);
+      uint32_t x = 0;
+      float2uint32(f, &x);
+
+      struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+
+      setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
+      setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
+      setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
+      setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
+
+    } break;
+    /* LCOV_EXCL_START*/
+    default: {
+      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      return -1;
+    } break;
+    /* LCOV_EXCL_STOP*/
+  }
+
+  rules_remove(obj, -1);
+  rules_remove(obj, -1);
+
+  return 0;
+}
+
 int8_t rule_run(struct rules_t *obj, uint8_t validate) {
   uint16_t pos = 0;
   uint8_t t = 0;
+  /*
+   * Heap positions of the math operands,
+   * shared with the fused OP_GETxx instructions
+   */
+  uint8_t a = 0, b = 0, c = 0;
+  /*
+   * The budget is only checked between statements
+   * and on rule calls, every rule ends with a clear
+   */
+  uint32_t limit = (validate == 0 && budget > 0) ? nrops + budget : 0;
+
+  validating = validate;
+
+  if(nrstrdead > 0 || strdeadfull == 1) {
+    varstack_reclaim();
+  }
 
   /*
    * This approach is much faster than a switch
@@ -4153,20 +5305,26 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
       &&STEP_CALL,      // OP_CALL,       19
       &&STEP_CLEAR,     // OP_CLEAR,      20
       &&STEP_RET,       // OP_RET         21
-      &&STEP_OP_EQ,     // OP_EQ          22
-      &&STEP_OP_NE,     // OP_NE          23
-      &&STEP_OP_LT,     // OP_LT          24
-      &&STEP_OP_LE,     // OP_LE          25
-      &&STEP_OP_GT,     // OP_GT          26
-      &&STEP_OP_GE,     // OP_GE          27
-      &&STEP_OP_AND,    // OP_AND         28
-      &&STEP_OP_OR,     // OP_OR          29
-      &&STEP_OP_SUB,    // OP_SUB         30
-      &&STEP_OP_ADD,    // OP_ADD         31
-      &&STEP_OP_DIV,    // OP_DIV         32
-      &&STEP_OP_MUL,    // OP_MUL         33
-      &&STEP_OP_POW,    // OP_POW         34
-      &&STEP_OP_MOD,    // OP_MOD         35
+      &&STEP_GETCMP,    // OP_GETEQ       23
+      &&STEP_GETCMP,    // OP_GETNE       24
+      &&STEP_GETCMP,    // OP_GETLT       25
+      &&STEP_GETCMP,    // OP_GETLE       26
+      &&STEP_GETCMP,    // OP_GETGT       27
+      &&STEP_GETCMP,    // OP_GETGE       28
+      &&STEP_OP_EQ,     // OP_EQ          29
+      &&STEP_OP_NE,     // OP_NE          30
+      &&STEP_OP_LT,     // OP_LT          31
+      &&STEP_OP_LE,     // OP_LE          32
+      &&STEP_OP_GT,     // OP_GT          33
+      &&STEP_OP_GE,     // OP_GE          34
+      &&STEP_OP_AND,    // OP_AND         35
+      &&STEP_OP_OR,     // OP_OR          36
+      &&STEP_OP_SUB,    // OP_SUB         37
+      &&STEP_OP_ADD,    // OP_ADD         38
+      &&STEP_OP_DIV,    // OP_DIV         39
+      &&STEP_OP_MUL,    // OP_MUL         40
+      &&STEP_OP_POW,    // OP_POW         41
+      &&STEP_OP_MOD,    // OP_MOD         42
     };
     memcpy(&jmptbl, &tmp, sizeof(tmp));
   }
@@ -4177,6 +5335,7 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
 /*****************/
   BEGIN:
     uint8_t type = gettype(obj->bc.buffer[pos]);
+    nrops++;
 #ifdef DEBUG
     printf("rule #%d, pos: %lu, op_id: %d, op: %s\n", obj->nr, pos/sizeof(struct vm_top_t), type, op_names[type].name);
 #endif
@@ -4186,9 +5345,9 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
 /*****************/
   STEP_OP_MATH: {
     struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
-    uint8_t a = vm_val_pos((int8_t)getval(node->a));
-    uint8_t b = vm_val_pos((int8_t)getval(node->b));
-    uint8_t c = vm_val_pos((int8_t)getval(node->c));
+    a = vm_val_pos((int8_t)getval(node->a));
+    b = vm_val_pos((int8_t)getval(node->b));
+    c = vm_val_pos((int8_t)getval(node->c));
 
 #if defined(DEBUG) || defined(COVERALLS)
     if((int8_t)getval(node->a) >= 0) {
@@ -4212,7 +5371,9 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
       return -1;
     }
 #endif
+  }
 
+  STEP_OP_VALUES: {
     float nr = 0, var = 0;
     float x = 0, y = 0;
     uint8_t x_type = gettype(obj->heap->buffer[b]);
@@ -4329,7 +5490,7 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
     }
 #endif
 
-    goto *jmptbl[type+22];
+    goto *jmptbl[type+28];
 
     STEP_OP_ADD:
       var = x+y;
@@ -4588,77 +5749,47 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
     }
 #endif
 
-    vm_stack_push(obj, b, &varstack->buffer[b]);
-
-    rule_options.vm_value_get(obj);
-
-#if defined(DEBUG) || defined(COVERALLS)
-    /* LCOV_EXCL_START*/
-    if(rules_gettop(obj) < 2) {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+    if(vm_getval(obj, a, b) == -1) {
       return -1;
     }
-#endif
-
-    /* LCOV_EXCL_STOP*/
-    switch(rules_type(obj, -1)) {
-      case VNULL: {
-        struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
-        setval(upd->type, VNULL);
-      } break;
-      case VINTEGER: {
-        int32_t x = rules_tointeger(obj, -1);
-        struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
-        setval(upd->type, VINTEGER);
-        setval(upd->value[0], ((uint32_t)x >> 16) & 0xFF);
-        setval(upd->value[1], ((uint32_t)x >> 8) & 0xFF);
-        setval(upd->value[2], ((uint32_t)x) & 0xFF);
-      } break;
-      case VCHAR: {
-        int16_t offset = vm_val_pos(-1);
-        offset = getval(stack->nrbytes)-offset;
 
-        if(offset >= 4) {
-          if(getval(stack->buffer[offset]) == VPTR) {
-            struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+    pos += sizeof(struct vm_top_t);
 
-            struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
-            setval(upd->type, VPTR);
-            setval(upd->value, getval(node->value));
-          } else {
-            return -1;
-          }
-        } else {
-          return -1;
-        }
-      } break;
-      case VFLOAT: {
-        float f = rules_tofloat(obj, -1);
-        uint32_t x = 0;
-        float2uint32(f, &x);
+    goto BEGIN;
+  }
+/*****************/
 
-        struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+/*****************/
+  STEP_GETCMP: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
 
-        setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
-        setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
-        setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
-        setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
+    uint16_t x = (int8_t)getval(node->b)*sizeof(struct vm_vchar_t);
+    a = vm_val_pos((int8_t)getval(node->a));
+    b = a;
+    c = vm_val_pos((int8_t)getval(node->c));
 
-      } break;
-      /* LCOV_EXCL_START*/
-      default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-        return -1;
-      } break;
-      /* LCOV_EXCL_STOP*/
+#if defined(DEBUG) || defined(COVERALLS)
+    if((int8_t)getval(node->b) < 0) {
+      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if((int8_t)getval(node->a) >= 0 || (int8_t)getval(node->c) >= 0) {
+      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if(a > getval(obj->heap->nrbytes) || c > getval(obj->heap->nrbytes)) {
+      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
     }
+#endif
 
-    rules_remove(obj, -1);
-    rules_remove(obj, -1);
+    if(vm_getval(obj, a, x) == -1) {
+      return -1;
+    }
 
-    pos += sizeof(struct vm_top_t);
+    type = type - OP_GETEQ + OP_EQ;
 
-    goto BEGIN;
+    goto STEP_OP_VALUES;
   }
 /*****************/
 
@@ -4892,6 +6023,10 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
         obj = obj->ctx.go;
         pos = 0;
 
+        if(limit > 0 && (int32_t)(nrops - limit) >= 0) {
+          return vm_budget_hit(obj);
+        }
+
 #ifdef DEBUG
       printf("\n");
 #endif
@@ -4917,6 +6052,10 @@ int8_t rule_run(struct rules_t *obj, uint8_t validate) {
     setval(stack->nrbytes, 4);
     pos += sizeof(struct vm_top_t);
 
+    if(limit > 0 && (int32_t)(nrops - limit) >= 0) {
+      return vm_budget_hit(obj);
+    }
+
     goto BEGIN;
   }
 
@@ -5122,7 +6261,7 @@ void rules_gc(struct rules_t ***rules, uint8_t *nrrules) {
       switch(varstack->buffer[i]) {
         case VCHAR: {
           struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i];
-          FREE(node->value);
+          varstack_release(node);
         } break;
         /* LCOV_EXCL_START*/
         default: {
@@ -5147,11 +6286,269 @@ void rules_gc(struct rules_t ***rules, uint8_t *nrrules) {
 
   varstack = NULL;
 
+  if(strheap == 1) {
+    FREE(strindex);
+  }
+  strindex = NULL;
+  strslots = 0;
+  strarena = NULL;
+  strarenasize = 0;
+  strheap = 0;
+  strfree = 0;
+  nrstrdead = 0;
+  strdeadfull = 0;
+
 #if defined(DEBUG) || defined(COVERALLS)
   memused = 0;
 #endif
 }
 
+/*
+ * The compiled rules are the used part of the mempool
+ * (rules, bytecode and heaps) together with the varstack.
+ * Pointers are stored as they were, and relocated to the
+ * mempool address at load time.
+ */
+typedef struct rule_dump_t {
+  uint32_t build;
+  uintptr_t base;
+  uint16_t memlen;
+  uint16_t stacksize;
+  uint16_t varbytes;
+  uint16_t varsize;
+  uint8_t nrrules;
+} __attribute__((aligned(4))) rule_dump_t;
+
+typedef struct rule_dump_rule_t {
+  uint16_t pos;
+  int16_t name;
+} __attribute__((aligned(4))) rule_dump_rule_t;
+
+static uint32_t rules_build(void) {
+  /*
+   * Bytecode is only valid for the engine it was
+   * compiled with, so tie it to the build time.
+   */
+  const char *str = __DATE__ " " __TIME__;
+  uint32_t hash = 2166136261UL;
+  while(*str) {
+    hash = (hash ^ (uint8_t)*str++) * 16777619UL;
+  }
+  return hash;
+}
+
+int8_t rules_dump(struct rules_t **rules, uint8_t nrrules, struct pbuf *mempool, uint16_t (*write)(unsigned char *buf, uint16_t len)) {
+  struct rule_dump_t hdr;
+  unsigned char buf[64];
+  uint16_t i = 0, x = 0;
+
+  if(nrrules == 0 || varstack == NULL || mempool == NULL || mempool->next != NULL) {
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(struct rule_dump_t));
+  hdr.build = rules_build();
+  hdr.base = (uintptr_t)mempool->payload;
+  hdr.memlen = mempool->len;
+  hdr.stacksize = (stack == NULL) ? 0 : getval(stack->bufsize);
+  hdr.varbytes = varstack->nrbytes;
+  hdr.varsize = varstack->bufsize;
+  hdr.nrrules = nrrules;
+  if(write((unsigned char *)&hdr, sizeof(struct rule_dump_t)) != sizeof(struct rule_dump_t)) {
+    return -1;
+  }
+
+  for(i=0;i<nrrules;i++) {
+    struct rule_dump_rule_t node;
+    node.pos = (uint16_t)((unsigned char *)rules[i] - (unsigned char *)mempool->payload);
+    node.name = -1;
+    for(x=0;x<varstack->nrbytes;x+=sizeof(struct vm_vchar_t)) {
+      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[x];
+      if(rules[i]->name != NULL && var->value == rules[i]->name) {
+        node.name = x;
+        break;
+      }
+    }
+    if(write((unsigned char *)&node, sizeof(struct rule_dump_rule_t)) != sizeof(struct rule_dump_rule_t)) {
+      return -1;
+    }
+  }
+
+  /*
+   * Runtime strings are stored as free entries
+   */
+  for(i=0;i<varstack->nrbytes;i+=sizeof(struct vm_vchar_t)) {
+    struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[i];
+    memset(buf, 0, 4);
+    buf[0] = getval(var->type);
+    buf[1] = getval(var->fixed);
+    if(buf[1] != 0) {
+      buf[2] = getval(var->len);
+      buf[3] = getval(var->ref);
+    }
+    if(gettype(buf[0]) != VCHAR || (buf[1] != 0 && var->value == NULL)) {
+      return -1;
+    }
+    if(write(buf, 4) != 4) {
+      return -1;
+    }
+    for(x=0;x<buf[2];x++) {
+      buf[4+(x%32)] = getval(var->value[x]);
+      if((x%32) == 31 || x == buf[2]-1) {
+        if(write(&buf[4], (x%32)+1) != (x%32)+1) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  unsigned char *payload = (unsigned char *)mempool->payload;
+  for(i=0;i<hdr.memlen;i+=sizeof(buf)) {
+    uint16_t len = MIN((uint16_t)sizeof(buf), (uint16_t)(hdr.memlen-i));
+    for(x=0;x<len;x++) {
+      buf[x] = getval(payload[i+x]);
+    }
+    if(write(buf, len) != len) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int8_t rules_load(struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, uint16_t (*read)(unsigned char *buf, uint16_t len)) {
+  struct rule_dump_t hdr;
+  struct rule_dump_rule_t *nodes = NULL;
+  unsigned char buf[64];
+  uint16_t i = 0, x = 0;
+
+  if(mempool == NULL || mempool->next != NULL) {
+    return -1;
+  }
+  if(read((unsigned char *)&hdr, sizeof(struct rule_dump_t)) != sizeof(struct rule_dump_t)) {
+    return -1;
+  }
+  if(hdr.build != rules_build() || hdr.nrrules == 0 ||
+     (hdr.varbytes % sizeof(struct vm_vchar_t)) != 0 || hdr.varsize < hdr.varbytes ||
+     (uint32_t)hdr.memlen+sizeof(struct rule_stack_t)+hdr.stacksize > mempool->tot_len) {
+    return -1;
+  }
+
+  if(*nrrules > 0 || varstack != NULL) {
+    rules_gc(rules, nrrules);
+  }
+
+  if((nodes = (struct rule_dump_rule_t *)MALLOC(sizeof(struct rule_dump_rule_t)*hdr.nrrules)) == NULL) {
+    OUT_OF_MEMORY
+    return -1;
+  }
+  if(read((unsigned char *)nodes, sizeof(struct rule_dump_rule_t)*hdr.nrrules) != sizeof(struct rule_dump_rule_t)*hdr.nrrules) {
+    FREE(nodes);
+    return -1;
+  }
+  for(i=0;i<hdr.nrrules;i++) {
+    if((uint32_t)nodes[i].pos+sizeof(struct rules_t) > hdr.memlen || nodes[i].name >= (int16_t)hdr.varbytes) {
+      FREE(nodes);
+      return -1;
+    }
+  }
+
+  if((varstack = (struct rule_stack_t *)MALLOC(sizeof(struct rule_stack_t))) == NULL) {
+    OUT_OF_MEMORY
+    FREE(nodes);
+    return -1;
+  }
+  memset(varstack, 0, sizeof(struct rule_stack_t));
+  if(hdr.varsize > 0) {
+    if((varstack->buffer = (unsigned char *)MALLOC(hdr.varsize)) == NULL) {
+      OUT_OF_MEMORY
+      FREE(varstack);
+      FREE(nodes);
+      return -1;
+    }
+    memset(varstack->buffer, 0, hdr.varsize);
+    varstack->bufsize = hdr.varsize;
+  }
+
+  int8_t ok = 1;
+  for(i=0;ok == 1 && i<hdr.varbytes;i+=sizeof(struct vm_vchar_t)) {
+    struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[i];
+    if(read(buf, 4) != 4 || gettype(buf[0]) != VCHAR) {
+      ok = 0;
+      break;
+    }
+    setval(var->type, buf[0]);
+    varstack->nrbytes = i+sizeof(struct vm_vchar_t);
+    if(buf[1] == 0) {
+      setval(var->len, strfree & 0xFF);
+      setval(var->ref, strfree >> 8);
+      strfree = i/sizeof(struct vm_vchar_t)+1;
+      continue;
+    }
+    if((var->value = varstack_alloc(i/sizeof(struct vm_vchar_t), buf[2])) == NULL) {
+      ok = 0;
+      break;
+    }
+    setval(var->fixed, buf[1]);
+    setval(var->len, buf[2]);
+    setval(var->ref, buf[3]);
+    if(buf[2] > 0 && read((unsigned char *)var->value, buf[2]) != buf[2]) {
+      ok = 0;
+    }
+  }
+  if(ok == 1 && varstack_index_grow(rules_nrvars()) == -1) {
+    ok = 0;
+  }
+
+  unsigned char *payload = (unsigned char *)mempool->payload;
+  for(i=0;ok == 1 && i<hdr.memlen;i+=sizeof(buf)) {
+    uint16_t len = MIN((uint16_t)sizeof(buf), (uint16_t)(hdr.memlen-i));
+    if(read(buf, len) != len) {
+      ok = 0;
+      break;
+    }
+    for(x=0;x<len;x++) {
+      setval(payload[i+x], buf[x]);
+    }
+  }
+  if(ok == 1 && (*rules = (struct rules_t **)MALLOC(sizeof(struct rules_t *)*hdr.nrrules)) == NULL) {
+    OUT_OF_MEMORY
+    ok = 0;
+  }
+  if(ok == 0) {
+    FREE(nodes);
+    if(varstack->nrbytes == 0 && varstack->buffer != NULL) {
+      FREE(varstack->buffer);
+    }
+    rules_gc(rules, nrrules);
+    return -1;
+  }
+
+  intptr_t delta = (intptr_t)payload - (intptr_t)hdr.base;
+  for(i=0;i<hdr.nrrules;i++) {
+    struct rules_t *obj = (struct rules_t *)&payload[nodes[i].pos];
+    obj->ctx.go = NULL;
+    obj->ctx.ret = NULL;
+    setval(obj->cont, 0);
+    obj->userdata = NULL;
+    obj->name = (nodes[i].name < 0) ? NULL : ((struct vm_vchar_t *)&varstack->buffer[nodes[i].name])->value;
+    obj->bc.buffer = (unsigned char *)((intptr_t)obj->bc.buffer + delta);
+    obj->heap = (struct rule_stack_t *)((intptr_t)obj->heap + delta);
+    obj->heap->buffer = (unsigned char *)((intptr_t)obj->heap->buffer + delta);
+    (*rules)[i] = obj;
+  }
+  *nrrules = hdr.nrrules;
+  FREE(nodes);
+
+  mempool->len = hdr.memlen;
+  stack = (struct rule_stack_t *)&payload[hdr.memlen];
+  setval(stack->bufsize, hdr.stacksize);
+  setval(stack->nrbytes, 4);
+  stack->buffer = &payload[hdr.memlen+sizeof(struct rule_stack_t)];
+
+  return 0;
+}
+
 int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
   struct pbuf *mempool_rule = NULL;
   uint16_t newlen = getval(input->tot_len), max_varstack_size = 4;
@@ -5421,7 +6818,7 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
   printf("heap expected %d, got %d\n", heapsize, getval(obj->heap->nrbytes));
   assert(heapsize >= getval(obj->heap->nrbytes));
   printf("bc expected %d, got %d\n", bcsize, getval(obj->bc.nrbytes));
-  assert(bcsize == getval(obj->bc.nrbytes));
+  assert(bcsize >= getval(obj->bc.nrbytes));
   printf("bcsize: %d, heapsize: %d\n", getval(obj->bc.nrbytes), getval(obj->heap->nrbytes));
 #endif
 /*LCOV_EXCL_STOP*/
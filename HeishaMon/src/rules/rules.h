@@ -38,6 +38,8 @@
   uint8_t mmu_get_uint8(void *ptr);
   uint16_t mmu_set_uint16(void *ptr, uint16_t src);
   uint16_t mmu_get_uint16(void *ptr);
+  int digitalRead(uint8_t pin);
+  void digitalWrite(uint8_t pin, uint8_t val);
 #elif defined(ESP32)
   #include <Arduino.h>
   #include "lwip/pbuf.h" 	
@@ -120,7 +122,13 @@ typedef enum {
   OP_PUSH = 19,
   OP_CALL = 20,
   OP_CLEAR = 21,
-  OP_RET = 22
+  OP_RET = 22,
+  OP_GETEQ = 23,
+  OP_GETNE = 24,
+  OP_GETLT = 25,
+  OP_GETLE = 26,
+  OP_GETGT = 27,
+  OP_GETGE = 28
 } opcodes;
 
 typedef struct rules_t {
@@ -174,24 +182,49 @@ typedef struct rule_options_t {
 
 extern struct rule_options_t rule_options;
 
+typedef struct rule_strings_t {
+  uint16_t nr; // interned strings
+  uint32_t bytes;
+  uint16_t slots; // size of the hash index
+  uint32_t lookups; // runtime strings looked up
+  uint32_t hits; // of which were already interned
+} rule_strings_t;
+
 int8_t rule_token(struct rule_stack_t *obj, uint16_t pos, unsigned char **out);
 const char *rule_by_nr(struct rules_t **rule, uint8_t nrrules, uint8_t nr);
 int8_t rule_by_name(struct rules_t **rule, uint8_t nrrules, char *name);
 int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata);
 int8_t rule_run(struct rules_t *rule, uint8_t validate);
+uint32_t rules_ops(void);
+/* rule_run returns -2 when a run goes over the budget */
+void rules_budget(uint32_t ops);
+/* functions can skip their side effects in the run that validates a new rule */
+uint8_t rules_validating(void);
 void rules_gc(struct rules_t ***rules, uint8_t *nrrules);
+int8_t rules_dump(struct rules_t **rules, uint8_t nrrules, struct pbuf *mempool, uint16_t (*write)(unsigned char *buf, uint16_t len));
+int8_t rules_load(struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, uint16_t (*read)(unsigned char *buf, uint16_t len));
 
 int8_t rules_pushnil(struct rules_t *obj);
 int8_t rules_pushfloat(struct rules_t *obj, float nr);
 int8_t rules_pushinteger(struct rules_t *obj, int nr);
 int8_t rules_pushstring(struct rules_t *obj, char *str);
+int8_t rules_pushinterned(struct rules_t *obj, const char *str);
 
 void rules_ref(const char *str);
 void rules_unref(const char *str);
+const char *rules_addstring(const char *str);
+void rules_strings_build(struct rules_t **rules, uint8_t nrrules, struct pbuf *mempool);
+void rules_strings(struct rule_strings_t *stats);
 
 int rules_tointeger(struct rules_t *obj, int8_t pos);
 float rules_tofloat(struct rules_t *obj, int8_t pos);
 const char *rules_tostring(struct rules_t *obj, int8_t pos);
+int16_t rules_tovar(struct rules_t *obj, int8_t pos);
+
+uint16_t rules_nrvars(void);
+const char *rules_varname(uint16_t nr);
+int8_t rules_usesvar(struct rules_t *obj, uint16_t nr);
+void *rules_alloc(struct pbuf *mempool, uint16_t size);
 
 void rules_remove(struct rules_t *rule, int8_t pos);
 uint8_t rules_gettop(struct rules_t *rule);
@@ -3,6 +3,9 @@
 #include "version.h"
 #include "htmlcode.h"
 #include "commands.h"
+#include "mqtt.h"
+#include "rules.h"
+#include "src/rules/rules.h"
 #include "src/common/progmem.h"
 #include "src/common/webserver.h"
 #include "src/common/timerqueue.h"
@@ -178,6 +181,7 @@ void ntpReload(settingsStruct *heishamonSettings) {
   tzset();
 #endif
   sntp_init();
+  rules_time_reload();
 }
 
 void loadSettings(settingsStruct *heishamonSettings) {
@@ -217,9 +221,12 @@ void loadSettings(settingsStruct *heishamonSettings) {
           if ( jsonDoc["ntp_servers"] ) strlcpy(heishamonSettings->ntp_servers, jsonDoc["ntp_servers"], sizeof(heishamonSettings->ntp_servers));
           if ( jsonDoc["timezone"]) heishamonSettings->timezone = jsonDoc["timezone"];
           heishamonSettings->force_rules = ( jsonDoc["force_rules"] == "enabled" ) ? true : false;
+          heishamonSettings->coalesce_rules = ( jsonDoc["coalesce_rules"] == "enabled" ) ? true : false;
           heishamonSettings->use_1wire = ( jsonDoc["use_1wire"] == "enabled" ) ? true : false;
           heishamonSettings->use_s0 = ( jsonDoc["use_s0"] == "enabled" ) ? true : false;
           heishamonSettings->hotspot = ( jsonDoc["hotspot"] == "disabled" ) ? false : true; //default to true if not found in settings
+          heishamonSettings->mqttSpool = ( jsonDoc["mqttSpool"] == "enabled" ) ? true : false;
+          heishamonSettings->mqtt5 = ( jsonDoc["mqtt5"] == "enabled" ) ? true : false;
           heishamonSettings->listenonly = ( jsonDoc["listenonly"] == "enabled" ) ? true : false;
           heishamonSettings->logMqtt = ( jsonDoc["logMqtt"] == "enabled" ) ? true : false;
           heishamonSettings->logHexdump = ( jsonDoc["logHexdump"] == "enabled" ) ? true : false;
@@ -228,6 +235,7 @@ void loadSettings(settingsStruct *heishamonSettings) {
           heishamonSettings->opentherm = ( jsonDoc["opentherm"] == "enabled" ) ? true : false;
 #ifdef ESP32          
           heishamonSettings->proxy = ( jsonDoc["proxy"] == "enabled" ) ? true : false;
+          if ( !jsonDoc["proxyMaxAge"].isNull()) heishamonSettings->proxyMaxAge = jsonDoc["proxyMaxAge"];
 #endif          
           if ( jsonDoc["waitTime"]) heishamonSettings->waitTime = jsonDoc["waitTime"];
           if (heishamonSettings->waitTime < 5) heishamonSettings->waitTime = 5;
@@ -239,6 +247,7 @@ void loadSettings(settingsStruct *heishamonSettings) {
           if (heishamonSettings->updateAllTime < heishamonSettings->waitTime) heishamonSettings->updateAllTime = heishamonSettings->waitTime;
           if ( jsonDoc["updataAllDallasTime"]) heishamonSettings->updataAllDallasTime = jsonDoc["updataAllDallasTime"];
           if (heishamonSettings->updataAllDallasTime < heishamonSettings->waitDallasTime) heishamonSettings->updataAllDallasTime = heishamonSettings->waitDallasTime;
+          if ( !jsonDoc["rulesBudget"].isNull()) heishamonSettings->rulesBudget = jsonDoc["rulesBudget"];
           //if (jsonDoc["s0_1_gpio"]) heishamonSettings->s0Settings[0].gpiopin = jsonDoc["s0_1_gpio"];
           if (jsonDoc["s0_1_ppkwh"]) heishamonSettings->s0Settings[0].ppkwh = jsonDoc["s0_1_ppkwh"];
           if (jsonDoc["s0_1_interval"]) heishamonSettings->s0Settings[0].lowerPowerInterval = jsonDoc["s0_1_interval"];
@@ -270,6 +279,8 @@ void loadSettings(settingsStruct *heishamonSettings) {
   }
   //end read
 
+  mqtt_topics_build(); //topic base could have changed
+
 }
 
 void setupWifi(settingsStruct *heishamonSettings) {
@@ -410,6 +421,16 @@ void settingsToJson(JsonDocument &jsonDoc, settingsStruct *heishamonSettings) {
   } else {
     jsonDoc["hotspot"] = "disabled";
   }
+  if (heishamonSettings->mqttSpool) {
+    jsonDoc["mqttSpool"] = "enabled";
+  } else {
+    jsonDoc["mqttSpool"] = "disabled";
+  }
+  if (heishamonSettings->mqtt5) {
+    jsonDoc["mqtt5"] = "enabled";
+  } else {
+    jsonDoc["mqtt5"] = "disabled";
+  }
   if (heishamonSettings->listenonly) {
     jsonDoc["listenonly"] = "enabled";
   } else {
@@ -419,6 +440,11 @@ void settingsToJson(JsonDocument &jsonDoc, settingsStruct *heishamonSettings) {
   } else {
     jsonDoc["force_rules"] = "disabled";
   }
+  if (heishamonSettings->coalesce_rules) {
+    jsonDoc["coalesce_rules"] = "enabled";
+  } else {
+    jsonDoc["coalesce_rules"] = "disabled";
+  }
   if (heishamonSettings->logMqtt) {
     jsonDoc["logMqtt"] = "enabled";
   } else {
@@ -450,12 +476,14 @@ void settingsToJson(JsonDocument &jsonDoc, settingsStruct *heishamonSettings) {
   } else {
     jsonDoc["proxy"] = "disabled";
   }
+  jsonDoc["proxyMaxAge"] = heishamonSettings->proxyMaxAge;
 #endif 
   jsonDoc["waitTime"] = heishamonSettings->waitTime;
   jsonDoc["waitDallasTime"] = heishamonSettings->waitDallasTime;
   jsonDoc["dallasResolution"] = heishamonSettings->dallasResolution;
   jsonDoc["updateAllTime"] = heishamonSettings->updateAllTime;
   jsonDoc["updataAllDallasTime"] = heishamonSettings->updataAllDallasTime;
+  jsonDoc["rulesBudget"] = heishamonSettings->rulesBudget;
 }
 
 void saveJsonToFile(JsonDocument &jsonDoc, const char* filename) {
@@ -482,7 +510,10 @@ int saveSettings(struct webserver_t *client, settingsStruct *heishamonSettings)
   settingsToJson(jsonDoc, heishamonSettings); //stores current settings in a json document
 
   jsonDoc["force_rules"] = String("disabled");
+  jsonDoc["coalesce_rules"] = String("disabled");
   jsonDoc["hotspot"] = String("disabled");
+  jsonDoc["mqttSpool"] = String("disabled");
+  jsonDoc["mqtt5"] = String("disabled");
   jsonDoc["listenonly"] = String("disabled");
   jsonDoc["logMqtt"] = String("disabled");
   jsonDoc["logHexdump"] = String("disabled");
@@ -519,10 +550,16 @@ int saveSettings(struct webserver_t *client, settingsStruct *heishamonSettings)
       }
     } else if (strcmp(tmp->name.c_str(), "hotspot") == 0) {
       jsonDoc["hotspot"] = tmp->value;
+    } else if (strcmp(tmp->name.c_str(), "mqttSpool") == 0) {
+      jsonDoc["mqttSpool"] = tmp->value;
+    } else if (strcmp(tmp->name.c_str(), "mqtt5") == 0) {
+      jsonDoc["mqtt5"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "listenonly") == 0) {
       jsonDoc["listenonly"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "force_rules") == 0) {
       jsonDoc["force_rules"] = tmp->value;
+    } else if (strcmp(tmp->name.c_str(), "coalesce_rules") == 0) {
+      jsonDoc["coalesce_rules"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "logMqtt") == 0) {
       jsonDoc["logMqtt"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "logHexdump") == 0) {
@@ -536,6 +573,8 @@ int saveSettings(struct webserver_t *client, settingsStruct *heishamonSettings)
 #ifdef ESP32      
     } else if (strcmp(tmp->name.c_str(), "proxy") == 0) {
       jsonDoc["proxy"] = tmp->value;
+    } else if (strcmp(tmp->name.c_str(), "proxyMaxAge") == 0) {
+      jsonDoc["proxyMaxAge"] = tmp->value;
 #endif      
     } else if (strcmp(tmp->name.c_str(), "ntp_servers") == 0) {
       jsonDoc["ntp_servers"] = tmp->value;
@@ -547,6 +586,8 @@ int saveSettings(struct webserver_t *client, settingsStruct *heishamonSettings)
       jsonDoc["waitDallasTime"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "updateAllTime") == 0) {
       jsonDoc["updateAllTime"] = tmp->value;
+    } else if (strcmp(tmp->name.c_str(), "rulesBudget") == 0) {
+      jsonDoc["rulesBudget"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "dallasResolution") == 0) {
       jsonDoc["dallasResolution"] = tmp->value;
     } else if (strcmp(tmp->name.c_str(), "updataAllDallasTime") == 0) {
@@ -785,6 +826,16 @@ int getSettings(struct webserver_t *client, settingsStruct *heishamonSettings) {
 
         itoa(heishamonSettings->hotspot, str, 10);
         webserver_send_content(client, str, strlen(str));
+
+        webserver_send_content_P(client, PSTR(",\"mqttSpool\":"), 13);
+
+        itoa(heishamonSettings->mqttSpool, str, 10);
+        webserver_send_content(client, str, strlen(str));
+
+        webserver_send_content_P(client, PSTR(",\"mqtt5\":"), 9);
+
+        itoa(heishamonSettings->mqtt5, str, 10);
+        webserver_send_content(client, str, strlen(str));
         
       } break;
     case 6: {
@@ -797,6 +848,14 @@ int getSettings(struct webserver_t *client, settingsStruct *heishamonSettings) {
 
         itoa(heishamonSettings->force_rules, str, 10);
         webserver_send_content(client, str, strlen(str));
+        webserver_send_content_P(client, PSTR(",\"coalesce_rules\":"), 18);
+
+        itoa(heishamonSettings->coalesce_rules, str, 10);
+        webserver_send_content(client, str, strlen(str));
+        webserver_send_content_P(client, PSTR(",\"rulesBudget\":"), 15);
+
+        itoa(heishamonSettings->rulesBudget, str, 10);
+        webserver_send_content(client, str, strlen(str));
 
       } break;
     case 7: {
@@ -831,6 +890,10 @@ int getSettings(struct webserver_t *client, settingsStruct *heishamonSettings) {
         webserver_send_content_P(client, PSTR(",\"proxy\":"), 9);
         itoa(heishamonSettings->proxy, str, 10);
         webserver_send_content(client, str, strlen(str));
+
+        webserver_send_content_P(client, PSTR(",\"proxyMaxAge\":"), 15);
+        itoa(heishamonSettings->proxyMaxAge, str, 10);
+        webserver_send_content(client, str, strlen(str));
 #endif      
         webserver_send_content_P(client, PSTR(",\"use_1wire\":"), 13);
         itoa(heishamonSettings->use_1wire, str, 10);
@@ -1292,6 +1355,36 @@ int handleJsonOutput(struct webserver_t *client, char* actData, char* actDataExt
 }
 
 
+static void showRulesEnd(struct webserver_t *client) {
+  char row[256];
+  const char *name = NULL, *trigger = NULL;
+  webserver_send_content_P(client, showRulesPage2, strlen_P(showRulesPage2));
+  webserver_send_content_P(client, showRulesProfile1, strlen_P(showRulesProfile1));
+  for (uint8_t i = 0; i < nrrules; i++) {
+    const struct rule_profile_t *profile = rules_profile(i, &name, &trigger);
+    if (profile == NULL) {
+      break;
+    }
+    int len = snprintf_P(row, sizeof(row), showRulesProfileRow, (name == NULL) ? "" : name,
+                         (unsigned long)profile->runs, (unsigned long)((profile->runs == 0) ? 0 : profile->total / profile->runs),
+                         (unsigned long)profile->max, (unsigned long)profile->ewma, (unsigned long)profile->ops,
+                         (unsigned long)profile->budgethits, trigger);
+    if (len > 0) {
+      webserver_send_content(client, row, (len < (int)sizeof(row)) ? len : sizeof(row) - 1);
+    }
+  }
+  webserver_send_content_P(client, showRulesProfile2, strlen_P(showRulesProfile2));
+  struct rule_strings_t strstats;
+  rules_strings(&strstats);
+  int len = snprintf_P(row, sizeof(row), showRulesStrings, strstats.nr, (unsigned long)strstats.bytes, strstats.slots,
+                       (unsigned long)strstats.lookups, (unsigned long)((strstats.lookups == 0) ? 0 : (uint64_t)strstats.hits * 100 / strstats.lookups));
+  if (len > 0) {
+    webserver_send_content(client, row, (len < (int)sizeof(row)) ? len : sizeof(row) - 1);
+  }
+  webserver_send_content_P(client, menuJS, strlen_P(menuJS));
+  webserver_send_content_P(client, webFooter, strlen_P(webFooter));
+}
+
 int showRules(struct webserver_t *client) {
   uint16_t len = 0, len1 = 0;
 
@@ -1335,9 +1428,7 @@ int showRules(struct webserver_t *client) {
             delete f;
           }
           client->userdata = NULL;
-          webserver_send_content_P(client, showRulesPage2, strlen_P(showRulesPage2));
-          webserver_send_content_P(client, menuJS, strlen_P(menuJS));
-          webserver_send_content_P(client, webFooter, strlen_P(webFooter));
+          showRulesEnd(client);
         }
       } else if (client->content == 1) {
         if (f) {
@@ -1347,9 +1438,7 @@ int showRules(struct webserver_t *client) {
           delete f;
         }
         client->userdata = NULL;
-        webserver_send_content_P(client, showRulesPage2, strlen_P(showRulesPage2));
-        webserver_send_content_P(client, menuJS, strlen_P(menuJS));
-        webserver_send_content_P(client, webFooter, strlen_P(webFooter));
+        showRulesEnd(client);
       }
     } else if (client->content == 1) {
       if (f) {
@@ -1359,14 +1448,10 @@ int showRules(struct webserver_t *client) {
         delete f;
       }
       client->userdata = NULL;
-      webserver_send_content_P(client, showRulesPage2, strlen_P(showRulesPage2));
-      webserver_send_content_P(client, menuJS, strlen_P(menuJS));
-      webserver_send_content_P(client, webFooter, strlen_P(webFooter));
+      showRulesEnd(client);
     }
   } else if (client->content == 1) {
-    webserver_send_content_P(client, showRulesPage2, strlen_P(showRulesPage2));
-    webserver_send_content_P(client, menuJS, strlen_P(menuJS));
-    webserver_send_content_P(client, webFooter, strlen_P(webFooter));
+    showRulesEnd(client);
   }
 
   return 0;
@@ -46,6 +46,8 @@ struct settingsStruct {
   char ntp_servers[254] = "pool.ntp.org";
 
   bool force_rules = false; //force rules on boot, even after a crash
+  bool coalesce_rules = false; //run each triggered rule once after a received frame is decoded
+  uint16_t rulesBudget = 0; //max instructions of a single rule run, 0 = no limit
   bool listenonly = false; //listen only so heishamon can be installed parallel to cz-taw1, set commands will not work though
   bool optionalPCB = false; //do we emulate an optional PCB?
   bool use_1wire = false; //1wire enabled?
@@ -55,8 +57,11 @@ struct settingsStruct {
   bool logSerial1 = true; //log to serial1 (gpio2) from start
   bool opentherm = false; //opentherm enable flag
   bool hotspot = true; //enable wifi hotspot when wifi is not connected
+  bool mqttSpool = false; //store values in flash while mqtt is not connected and send them after reconnecting
+  bool mqtt5 = false; //use mqtt 5 with topic aliases instead of mqtt 3.1.1
 #ifdef ESP32
   bool proxy = true; //cztaw proxy port enable flag
+  uint16_t proxyMaxAge = 30; //max age in seconds of cached data answered to proxy before a fresh poll is forced (0 = always from cache)
 #endif
   s0SettingsStruct s0Settings[NUM_S0_COUNTERS];
   gpioSettingsStruct gpioSettings;